@@ -26,7 +26,7 @@ The ClearOS eCAP Adapter can be configured to add custom headers to outbound HTT
 %prep
 %setup -q
 ./autogen.sh
-%{configure}
+%{configure} --enable-response-service
 
 %build
 make %{?_smp_mflags}
@@ -40,6 +40,7 @@ mkdir -p -m 755 $RPM_BUILD_ROOT%{_sysconfdir}/clearos
 cp clearos-ecap-adapter.conf $RPM_BUILD_ROOT%{_sysconfdir}/clearos/ecap-adapter.conf
 mkdir -p -m 755 $RPM_BUILD_ROOT%{_sysconfdir}/squid
 cp squid_ecap.conf $RPM_BUILD_ROOT%{_sysconfdir}/squid
+mkdir -p -m 755 $RPM_BUILD_ROOT%{_localstatedir}/lib/clearos-ecap-adapter
 
 # Clean-up
 %clean
@@ -57,7 +58,9 @@ cp squid_ecap.conf $RPM_BUILD_ROOT%{_sysconfdir}/squid
 %files
 %defattr(-,root,root)
 %{_libdir}/libclearos-ecap-adapter.so*
+%{_bindir}/clearos-ecap-compile
 %config(noreplace) %attr(0640,root,squid) %{_sysconfdir}/clearos/ecap-adapter.conf
 %{_sysconfdir}/squid/squid_ecap.conf
+%dir %attr(0755,squid,squid) %{_localstatedir}/lib/clearos-ecap-adapter
 
 # vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,747 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <map>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <new>
+#include <algorithm>
+
+#include <libecap/common/area.h>
+#include <libecap/common/name.h>
+#include <libecap/common/header.h>
+#include <libecap/common/memory.h>
+
+#include <syslog.h>
+#include <expat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "expat-xml.h"
+#include "adapter-log.h"
+#include "adapter-stats.h"
+#include "pool.h"
+#include "url-matcher.h"
+#include "client-matcher.h"
+#include "html-scanner.h"
+#include "header-template.h"
+#include "adapter-config.h"
+#include "rule-index.h"
+#include "shared-state.h"
+#include "lookup.h"
+
+// Builds the shared image of the rules a Config gives up
+class SharedIndexBuilder : public Adapter::SharedRulesBuilder
+{
+public:
+    SharedIndexBuilder(const Adapter::HeaderRuleList &rules) : rules(rules) { };
+
+    virtual void build(std::vector<unsigned char> &image) const
+        { Adapter::RuleIndex::Build(rules, image); };
+
+protected:
+    const Adapter::HeaderRuleList &rules;
+};
+
+ConfigParser::ConfigParser(const std::string &filename)
+    : ExpatXmlParser(), filename(filename) { }
+
+void ConfigParser::Reset(void)
+{
+    ExpatXmlParser::Reset();
+}
+
+void ConfigParser::Parse(void)
+{
+    ParseFile(filename);
+}
+
+void ConfigParser::ParseElementOpen(ExpatXmlTag *tag)
+{
+    ADAPTER_TRACE("%s: %s", __PRETTY_FUNCTION__, tag->GetName().c_str());
+
+    Adapter::Config *config = static_cast<Adapter::Config *>(priv_data);
+
+    // the root only at the top, so that no two <header> are ever open
+    if ((*tag) == "clearos-ecap-adapter") {
+        if (stack.size())
+            ParseError("unexpected tag: " + tag->GetName());
+    }
+    else if ((*tag) == "header") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!tag->ParamExists("name"))
+            ParseError("parameter missing: " + tag->GetName());
+
+        header_rule = Adapter::HeaderRule();
+        header_rule.name = tag->GetParamValue("name");
+        header_rule.action = ParseHeaderAction(tag);
+        header_rule.direction = ParseHeaderDirection(tag);
+        ParseList(tag, "host", header_rule.hosts);
+        ParseList(tag, "domain", header_rule.domains);
+        ParseList(tag, "path", header_rule.paths);
+        ParseList(tag, "client", header_rule.clients);
+        ParseList(tag, "user", header_rule.users);
+    }
+    else if ((*tag) == "list") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!tag->ParamExists("name") || !tag->ParamExists("type")
+            || !tag->ParamExists("file"))
+            ParseError("parameter missing: " + tag->GetName());
+    }
+    else if ((*tag) == "index") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!tag->ParamExists("file"))
+            ParseError("parameter missing: " + tag->GetName());
+
+        config->setIndex(tag->GetParamValue("file"));
+    }
+    else if ((*tag) == "body") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+
+        if (tag->ParamExists("window"))
+            config->setBodyWindow(ParseNumber(tag, "window", SIZE_MAX));
+        if (tag->ParamExists("budget"))
+            config->setBodyBudget(ParseNumber(tag, "budget", SIZE_MAX));
+        if (tag->ParamExists("bypass"))
+            config->setBodyBypass(ParseNumber(tag, "bypass", SIZE_MAX));
+    }
+    else if ((*tag) == "log") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+
+        if (tag->ParamExists("level")) {
+            int level = Adapter::Log::ParseLevel(tag->GetParamValue("level"));
+            if (level < 0)
+                ParseError("invalid log level: " + tag->GetParamValue("level"));
+            config->setLogLevel(level);
+        }
+        if (tag->ParamExists("queue"))
+            config->setLogQueue(ParseNumber(tag, "queue", MAX_LOG_QUEUE));
+    }
+    else if ((*tag) == "reload") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+
+        if (tag->ParamExists("interval"))
+            config->setReloadInterval(ParseNumber(tag, "interval", UINT_MAX));
+    }
+    else if ((*tag) == "pool") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+
+        if (tag->ParamExists("limit"))
+            config->setPoolLimit(ParseNumber(tag, "limit", SIZE_MAX));
+    }
+    else if ((*tag) == "cache") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+
+        if (tag->ParamExists("size"))
+            config->setCacheSize(ParseNumber(tag, "size", SIZE_MAX));
+    }
+    else if ((*tag) == "stats") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!tag->ParamExists("file"))
+            ParseError("parameter missing: " + tag->GetName());
+
+        unsigned long interval = 0;
+        if (tag->ParamExists("interval"))
+            interval = ParseNumber(tag, "interval", UINT_MAX);
+        config->setStats(tag->GetParamValue("file"), interval);
+    }
+    else if ((*tag) == "trace") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!tag->ParamExists("file") || !tag->ParamExists("sample"))
+            ParseError("parameter missing: " + tag->GetName());
+
+        unsigned long events = DEFAULT_TRACE_EVENTS;
+        if (tag->ParamExists("events"))
+            events = ParseNumber(tag, "events", SIZE_MAX);
+        bool signal = false;
+        if (tag->ParamExists("signal")) {
+            const std::string &name = tag->GetParamValue("signal");
+            if (name == "usr2") signal = true;
+            else if (name != "none")
+                ParseError("invalid signal for " + tag->GetName() + ": " + name);
+        }
+
+        config->setTrace(tag->GetParamValue("file"), ParseNumber(tag, "sample", UINT_MAX),
+            events, signal);
+    }
+    else if ((*tag) == "html") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+#ifndef ENABLE_RESPONSE_SERVICE
+        ParseError("tag " + tag->GetName() + " needs configure --enable-response-service");
+#endif
+    }
+    else if ((*tag) == "lookup") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!tag->ParamExists("name") || !tag->ParamExists("key"))
+            ParseError("parameter missing: " + tag->GetName());
+
+        const int key = Adapter::HeaderTemplate::ParseVariable(tag->GetParamValue("key"));
+        if (key < 0)
+            ParseError("invalid key for " + tag->GetName() + ": " + tag->GetParamValue("key"));
+
+        Adapter::Lookup::Resolver resolver = Adapter::Lookup::resolverFile;
+        if (tag->ParamExists("socket"))
+            resolver = Adapter::Lookup::resolverSocket;
+        else if (!tag->ParamExists("file"))
+            ParseError("parameter missing: " + tag->GetName());
+
+        unsigned long ttl = DEFAULT_LOOKUP_TTL, timeout = DEFAULT_LOOKUP_TIMEOUT;
+        if (tag->ParamExists("ttl"))
+            ttl = ParseNumber(tag, "ttl", UINT_MAX);
+        if (tag->ParamExists("timeout"))
+            timeout = ParseNumber(tag, "timeout", UINT_MAX);
+
+        try {
+            config->addLookup(Adapter::LookupPointer(new Adapter::Lookup(
+                tag->GetParamValue("name"), static_cast<Adapter::TemplateValues::Variable>(key),
+                resolver, tag->GetParamValue((resolver == Adapter::Lookup::resolverFile) ? "file" : "socket"),
+                ttl, timeout)));
+        } catch (std::runtime_error &e) {
+            ParseError(e.what());
+        }
+    }
+}
+
+void ConfigParser::ParseElementClose(ExpatXmlTag *tag)
+{
+    ADAPTER_TRACE("%s: %s", __PRETTY_FUNCTION__, tag->GetName().c_str());
+
+    const std::string &value = tag->GetText();
+    Adapter::Config *config = static_cast<Adapter::Config *>(priv_data);
+
+    if ((*tag) == "header") {
+        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (header_rule.action == Adapter::headerRemove) {
+            if (value.size())
+                ParseError("unexpected value for tag: " + tag->GetName());
+        }
+        else if (!value.size())
+            ParseError("missing value for tag: " + tag->GetName());
+
+        header_rule.value = value;
+        config->addHeader(header_rule);
+    }
+    else if ((*tag) == "list")
+        ParseListFile(tag, value);
+    else if ((*tag) == "html") {
+        Adapter::HtmlScanner::InjectSite inject = ParseInjectSite(tag);
+        if (inject != Adapter::HtmlScanner::injectNone && !value.size())
+            ParseError("missing snippet for tag: " + tag->GetName());
+
+        Adapter::size_type limit = DEFAULT_HTML_LIMIT;
+        if (tag->ParamExists("limit"))
+            limit = ParseNumber(tag, "limit", SIZE_MAX);
+
+        config->setHtml(inject, value, limit);
+    }
+}
+
+unsigned long ConfigParser::ParseNumber(ExpatXmlTag *tag, const std::string &key,
+    unsigned long max)
+{
+    const std::string &value = tag->GetParamValue(key);
+
+    // decimal only: strtoul() would take "010" as octal and wrap "-1";
+    // max keeps the value within the setting it goes to
+    char *end = NULL;
+    errno = 0;
+    unsigned long number = strtoul(value.c_str(), &end, 10);
+    if (!value.size() || !isdigit((unsigned char)value[0]) || *end != '\0' ||
+        errno == ERANGE || number > max)
+        ParseError("invalid number for " + tag->GetName() + ": " + key);
+
+    return number;
+}
+
+Adapter::HeaderAction ConfigParser::ParseHeaderAction(ExpatXmlTag *tag)
+{
+    if (!tag->ParamExists("action")) return Adapter::headerAdd;
+
+    const std::string &action = tag->GetParamValue("action");
+    if (action == "add") return Adapter::headerAdd;
+    if (action == "set") return Adapter::headerSet;
+    if (action == "remove") return Adapter::headerRemove;
+    if (action == "add-if-absent") return Adapter::headerAddIfAbsent;
+
+    ParseError("invalid action for " + tag->GetName() + ": " + action);
+    return Adapter::headerAdd;
+}
+
+Adapter::HeaderDirection ConfigParser::ParseHeaderDirection(ExpatXmlTag *tag)
+{
+    if (!tag->ParamExists("direction")) return Adapter::directionRequest;
+
+    const std::string &direction = tag->GetParamValue("direction");
+    if (direction == "request") return Adapter::directionRequest;
+    if (direction == "response") {
+#ifndef ENABLE_RESPONSE_SERVICE
+        // no service would ever see the response
+        ParseError("direction=\"response\" for " + tag->GetName() +
+            " needs configure --enable-response-service");
+#endif
+        return Adapter::directionResponse;
+    }
+
+    ParseError("invalid direction for " + tag->GetName() + ": " + direction);
+    return Adapter::directionRequest;
+}
+
+Adapter::HtmlScanner::InjectSite ConfigParser::ParseInjectSite(ExpatXmlTag *tag)
+{
+    if (!tag->ParamExists("inject")) return Adapter::HtmlScanner::injectNone;
+
+    const std::string &site = tag->GetParamValue("inject");
+    if (site == "head") return Adapter::HtmlScanner::injectHead;
+    if (site == "body") return Adapter::HtmlScanner::injectBody;
+
+    ParseError("invalid inject site for " + tag->GetName() + ": " + site);
+    return Adapter::HtmlScanner::injectNone;
+}
+
+// splits a space and/or comma separated attribute, if present
+void ConfigParser::ParseList(ExpatXmlTag *tag,
+    const std::string &key, std::vector<std::string> &items)
+{
+    if (!tag->ParamExists(key)) return;
+
+    const std::string &value = tag->GetParamValue(key);
+    const char *separators = " \t,";
+
+    size_t start = value.find_first_not_of(separators);
+    while (start != std::string::npos) {
+        size_t end = value.find_first_of(separators, start);
+        items.push_back(value.substr(start, end - start));
+        start = value.find_first_not_of(separators, end);
+    }
+
+    if (!items.size())
+        ParseError("empty list for " + tag->GetName() + ": " + key);
+}
+
+// reads a bulk list: one "selector [value]" per line, where the selector
+// is a host, domain, path, client or user as the type says, and lines
+// without a value take the element text; "#" starts a comment
+void ConfigParser::ParseListFile(ExpatXmlTag *tag, const std::string &value)
+{
+    Adapter::Config *config = static_cast<Adapter::Config *>(priv_data);
+
+    Adapter::HeaderRule rule;
+    rule.name = tag->GetParamValue("name");
+    rule.action = ParseHeaderAction(tag);
+    rule.direction = ParseHeaderDirection(tag);
+
+    const std::string &type = tag->GetParamValue("type");
+    std::vector<std::string> *selectors = NULL;
+    if (type == "host") selectors = &rule.hosts;
+    else if (type == "domain") selectors = &rule.domains;
+    else if (type == "path") selectors = &rule.paths;
+    else if (type == "client") selectors = &rule.clients;
+    else if (type == "user") selectors = &rule.users;
+    else ParseError("invalid type for " + tag->GetName() + ": " + type);
+
+    // a device such as /dev/zero would be read for ever
+    const std::string &file = tag->GetParamValue("file");
+    struct stat st;
+    if (stat(file.c_str(), &st) == 0 && !S_ISREG(st.st_mode))
+        ParseError("not a regular file: " + file);
+    std::ifstream list(file.c_str());
+    if (!list.is_open()) ParseError("open error: " + file);
+    config->addSource(file);
+
+    const char *blanks = " \t\r";
+    std::string line;
+    for (unsigned long number = 1; std::getline(list, line); number++) {
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+
+        const size_t start = line.find_first_not_of(blanks);
+        if (start == std::string::npos) continue;
+        const size_t end = line.find_first_of(blanks, start);
+        const size_t value_start = line.find_first_not_of(blanks, end);
+
+        selectors->assign(1, line.substr(start, end - start));
+        rule.value = value;
+        if (value_start != std::string::npos) {
+            const size_t value_end = line.find_last_not_of(blanks);
+            rule.value = line.substr(value_start, value_end - value_start + 1);
+        }
+
+        if ((rule.action == Adapter::headerRemove) != !rule.value.size()) {
+            char position[32];
+            snprintf(position, sizeof(position), ":%lu", number);
+            ParseError("invalid value in list: " + file + position);
+        }
+        config->addHeader(rule);
+    }
+}
+
+// identified names let the host match them without comparing strings;
+// the value area owns a copy that every request shares
+Adapter::HeaderEntry::HeaderEntry(const std::string &name, const std::string &value,
+    HeaderAction action, HeaderDirection direction, size_t slot,
+    const std::vector<std::string> &lookups)
+    : name(name, libecap::Name::NextId()), value_template(value, lookups),
+    value((value_template.dynamic()) ? libecap::Area() : libecap::Area::FromTempString(value)),
+    action(action), direction(direction), slot(slot) { }
+
+static std::atomic<uint64_t> last_generation(0);
+
+Adapter::Config::Config()
+    : rule_counts(), body_window(DEFAULT_BODY_WINDOW),
+    body_budget(DEFAULT_BODY_BUDGET), body_bypass(0),
+    log_level(LOG_INFO), log_queue(0), reload_interval(0),
+    pool_limit(DEFAULT_POOL_LIMIT),
+    cache_size(DEFAULT_DECISION_CACHE), config_generation(++last_generation),
+    stats_interval(0),
+    trace_sample(0), trace_events(DEFAULT_TRACE_EVENTS), trace_signal(false),
+    html_scanning(false), html_inject(HtmlScanner::injectNone),
+    html_limit(DEFAULT_HTML_LIMIT) { }
+
+// parses and prepares a complete configuration; throws on any error,
+// so a half-loaded file never reaches transactions
+Adapter::ConfigPointer Adapter::Config::Load(const std::string &filename,
+    SharedState *shared)
+{
+    Config *config = new Config;
+    ConfigPointer snapshot(config);
+
+    config->addSource(filename);
+    ConfigParser parser(filename);
+    parser.SetPrivateData(static_cast<void *>(config));
+    parser.Parse();
+
+    if (shared && !config->rule_index)
+        config->share(*shared);
+    config->compile();
+
+    return snapshot;
+}
+
+// headers apply in the order written, each seeing what the ones before
+// it did, so every one is kept
+void Adapter::Config::addHeader(const HeaderRule &rule)
+{
+    const std::string scope = rule.scope();
+
+    ADAPTER_LOG(LOG_DEBUG, "%s: %s: %d: %s%s%s", __PRETTY_FUNCTION__,
+        rule.name.c_str(), rule.action, rule.value.c_str(),
+        (scope.size()) ? ": " : "", scope.c_str());
+
+    header_rules.push_back(rule);
+}
+
+void Adapter::Config::setBodyWindow(size_type window)
+{
+    ADAPTER_LOG(LOG_DEBUG, "%s: %lu",
+        __PRETTY_FUNCTION__, (unsigned long)window);
+
+    if (!window) throw std::runtime_error("Invalid body window");
+    body_window = window;
+}
+
+void Adapter::Config::setBodyBudget(size_type budget)
+{
+    ADAPTER_LOG(LOG_DEBUG, "%s: %lu",
+        __PRETTY_FUNCTION__, (unsigned long)budget);
+
+    body_budget = budget;
+}
+
+void Adapter::Config::setBodyBypass(size_type size)
+{
+    ADAPTER_LOG(LOG_DEBUG, "%s: %lu",
+        __PRETTY_FUNCTION__, (unsigned long)size);
+
+    body_bypass = size;
+}
+
+void Adapter::Config::setLogLevel(int level)
+{
+    log_level = level;
+}
+
+void Adapter::Config::setLogQueue(size_t queue_size)
+{
+    log_queue = queue_size;
+}
+
+void Adapter::Config::setReloadInterval(unsigned seconds)
+{
+    reload_interval = seconds;
+}
+
+void Adapter::Config::setPoolLimit(size_t blocks)
+{
+    pool_limit = blocks;
+}
+
+void Adapter::Config::setCacheSize(size_t entries)
+{
+    ADAPTER_LOG(LOG_DEBUG, "%s: %lu", __PRETTY_FUNCTION__, (unsigned long)entries);
+    cache_size = entries;
+}
+
+void Adapter::Config::setStats(const std::string &filename, unsigned seconds)
+{
+    ADAPTER_LOG(LOG_DEBUG, "%s: %s, interval: %u",
+        __PRETTY_FUNCTION__, filename.c_str(), seconds);
+
+    if (!filename.size()) throw std::runtime_error("Invalid stats file");
+    stats_file = filename;
+    stats_interval = seconds;
+}
+
+void Adapter::Config::setTrace(const std::string &filename, unsigned sample,
+    size_t events, bool signal)
+{
+    ADAPTER_LOG(LOG_DEBUG, "%s: %s, sample: %u, events: %lu, signal: %d",
+        __PRETTY_FUNCTION__, filename.c_str(), sample, (unsigned long)events, signal);
+
+    if (!filename.size()) throw std::runtime_error("Invalid trace file");
+    if (!sample) throw std::runtime_error("Invalid trace sample");
+    if (!events) throw std::runtime_error("Invalid trace events");
+    trace_file = filename;
+    trace_sample = sample;
+    trace_events = events;
+    trace_signal = signal;
+}
+
+void Adapter::Config::setHtml(HtmlScanner::InjectSite inject,
+    const std::string &snippet, size_type limit)
+{
+    ADAPTER_LOG(LOG_DEBUG, "%s: inject: %d, snippet: %lu bytes, limit: %lu",
+        __PRETTY_FUNCTION__, inject,
+        (unsigned long)snippet.size(), (unsigned long)limit);
+
+    if (!limit) throw std::runtime_error("Invalid HTML scan limit");
+
+    html_scanning = true;
+    html_inject = inject;
+    if (inject != HtmlScanner::injectNone)
+        html_snippet = libecap::Area::FromTempString(snippet);
+    html_limit = limit;
+}
+
+// maps a compiled rule index; it stays mapped for as long as any
+// snapshot or transaction refers to it
+void Adapter::Config::setIndex(const std::string &filename)
+{
+    ADAPTER_LOG(LOG_DEBUG, "%s: %s", __PRETTY_FUNCTION__, filename.c_str());
+
+    rule_index = RuleIndex::Map(filename);
+    index_file = filename;
+    addSource(filename);
+}
+
+void Adapter::Config::addLookup(const LookupPointer &lookup)
+{
+    ADAPTER_LOG(LOG_DEBUG, "%s: %s", __PRETTY_FUNCTION__, lookup->name().c_str());
+
+    if (std::find(lookup_names.begin(), lookup_names.end(), lookup->name()) != lookup_names.end())
+        throw std::runtime_error("Duplicate lookup: " + lookup->name());
+    if (lookup_list.size() == TEMPLATE_LOOKUPS)
+        throw std::runtime_error("Too many lookups: " + lookup->name());
+
+    lookup_list.push_back(lookup);
+    lookup_names.push_back(lookup->name());
+}
+
+void Adapter::Config::addSource(const std::string &filename)
+{
+    if (std::find(source_files.begin(), source_files.end(), filename) == source_files.end())
+        source_files.push_back(filename);
+}
+
+void Adapter::Config::header(unsigned rule, HeaderRef &ref) const
+{
+    if (rule < header_list.size()) {
+        const HeaderEntry &entry = header_list[rule];
+        ref.name = &entry.name;
+        ref.value_template = (entry.value_template.dynamic()) ? &entry.value_template : NULL;
+        ref.value = entry.value;
+        ref.action = entry.action;
+        ref.slot = entry.slot;
+        return;
+    }
+
+    rule -= header_list.size();
+    const IndexRule &entry = rule_index->rule(rule);
+    ref.name = &index_names[entry.name];
+    ref.value_template = NULL;
+    ref.value = rule_index->value(rule);
+    ref.action = HeaderAction(entry.action);
+    ref.slot = index_slots[(entry.flags & RuleIndex::flagResponse) ?
+        directionResponse : directionRequest][entry.name];
+}
+
+Adapter::HeaderDirection Adapter::Config::direction(unsigned rule) const
+{
+    if (rule < header_list.size())
+        return header_list[rule].direction;
+
+    const IndexRule &entry = rule_index->rule(rule - header_list.size());
+    return (entry.flags & RuleIndex::flagResponse) ? directionResponse : directionRequest;
+}
+
+// Rules for a name with placeholders in any value stay here, so that
+// all the rules that compete for a header are matched together.  The
+// others become the shared index, numbered after what stays; without
+// shared memory to be had, every rule stays.
+void Adapter::Config::share(SharedState &shared)
+{
+    std::map<std::string, bool> dynamic; // by lowercase name
+    for (size_t i = 0; i < header_rules.size(); i++) {
+        std::string key(header_rules[i].name);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        dynamic[key] = dynamic[key] ||
+            HeaderTemplate(header_rules[i].value, lookup_names).dynamic();
+    }
+
+    HeaderRuleList local, common;
+    for (size_t i = 0; i < header_rules.size(); i++) {
+        std::string key(header_rules[i].name);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        (dynamic[key] ? local : common).push_back(header_rules[i]);
+    }
+    if (!common.size()) return;
+
+    try {
+        std::string label;
+        const int fd = shared.rules(RuleIndex::Digest(common),
+            SharedIndexBuilder(common), label);
+        rule_index = RuleIndex::Map(fd, label);
+    } catch (std::runtime_error &e) {
+        ADAPTER_LOG(LOG_WARNING, "%s: %s: rules not shared",
+            __PRETTY_FUNCTION__, e.what());
+        return;
+    }
+
+    header_rules.swap(local);
+}
+
+// builds the header list shared by all transactions from the parsed
+// rules; rule numbers index both the list and the URL matcher
+void Adapter::Config::compile(void)
+{
+    header_list.clear();
+    header_list.reserve(header_rules.size());
+    rule_counts[directionRequest] = rule_counts[directionResponse] = 0;
+
+    // entries sharing a direction and name share a slot, so that
+    // transactions can tell what an earlier entry did to the header a
+    // later one looks at, and client scopes only compete within one
+    std::map<std::string, size_t> slots[2];
+
+    for (size_t i = 0; i < header_rules.size(); i++) {
+        const HeaderRule &rule = header_rules[i];
+
+        std::string key(rule.name);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        const size_t slot = slots[rule.direction].insert(std::make_pair(key, i)).first->second;
+        rule_counts[rule.direction]++;
+
+        header_list.push_back(HeaderEntry(rule.name, rule.value, rule.action,
+            rule.direction, slot, lookup_names));
+        const bool client_scoped = rule.clients.size() || rule.users.size();
+        url_matcher.add(i, rule.hosts, rule.domains, rule.paths, client_scoped);
+        client_matcher.add(i, slot, rule.hosts.size() || rule.domains.size(),
+            rule.clients, rule.users);
+    }
+
+    url_matcher.compile();
+    client_matcher.compile();
+
+    // index rules share slots, and names, with XML rules for the same
+    // header; index rules are never compared with XML rules otherwise
+    index_names.clear();
+    index_slots[directionRequest].clear();
+    index_slots[directionResponse].clear();
+    if (!rule_index) return;
+
+    const std::vector<libecap::Name> &names = rule_index->names();
+    for (size_t n = 0; n < names.size(); n++) {
+        std::string key(names[n].image());
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+        const libecap::Name *name = &names[n];
+        for (int d = directionRequest; d <= directionResponse; d++) {
+            std::map<std::string, size_t>::const_iterator slot = slots[d].find(key);
+            if (slot != slots[d].end()) {
+                name = &header_list[slot->second].name;
+                index_slots[d].push_back(slot->second);
+            } else
+                index_slots[d].push_back(header_list.size() + d * names.size() + n);
+        }
+        index_names.push_back(*name);
+    }
+
+    for (size_t r = 0; r < rule_index->size(); r++) {
+        const bool response = rule_index->rule(r).flags & RuleIndex::flagResponse;
+        rule_counts[(response) ? directionResponse : directionRequest]++;
+    }
+}
+
+// a printable form of the scope, also used to tell rules apart
+std::string Adapter::HeaderRule::scope(void) const
+{
+    const struct {
+        const char *label;
+        const std::vector<std::string> *items;
+    } lists[] = {
+        { "host", &hosts },
+        { "domain", &domains },
+        { "path", &paths },
+        { "client", &clients },
+        { "user", &users }
+    };
+
+    std::string text;
+    for (size_t l = 0; l < sizeof(lists) / sizeof(lists[0]); l++) {
+        const std::vector<std::string> &items = *lists[l].items;
+        if (!items.size()) continue;
+
+        if (text.size()) text += ' ';
+        text += lists[l].label;
+        text += '=';
+        for (size_t i = 0; i < items.size(); i++) {
+            if (i) text += ',';
+            text += items[i];
+        }
+    }
+
+    // not a scope, but rules for responses never replace request ones
+    if (direction == directionResponse) {
+        if (text.size()) text += ' ';
+        text += "direction=response";
+    }
+
+    return text;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,252 @@
+#ifndef _ADAPTER_CONFIG_H
+#define _ADAPTER_CONFIG_H
+
+#define PACKAGE_CONFIG  "/etc/clearos/ecap-adapter.conf"
+
+// Default in-flight limit for adapted body content, in bytes
+#define DEFAULT_BODY_WINDOW     65536
+
+// Default limit for adapted body content of all transactions, in bytes
+#define DEFAULT_BODY_BUDGET     67108864
+
+// Default number of rule decisions cached, see DecisionCache
+#define DEFAULT_DECISION_CACHE  16384
+
+// Default number of HTML body bytes scanned for the document head
+#define DEFAULT_HTML_LIMIT      65536
+
+// Default number of latency trace events kept per thread
+#define DEFAULT_TRACE_EVENTS    16384
+
+// Largest asynchronous log queue, in messages; each takes 512 bytes
+#define MAX_LOG_QUEUE           65536
+
+namespace Adapter
+{
+using libecap::size_type;
+
+// What a <header> element does to the message
+typedef enum
+{
+    headerAdd, // appends, even if the header is present
+    headerSet, // replaces any present, or appends
+    headerRemove, // removes any present
+    headerAddIfAbsent // appends, unless the header is present
+} HeaderAction;
+
+// Which messages a <header> element edits
+typedef enum
+{
+    directionRequest, // requests, as reqmod_precache sees them
+    directionResponse // responses, as respmod_precache sees them
+} HeaderDirection;
+
+// A configured header, prepared once so that requests only share it
+// (or, for values with placeholders, only fill in the template)
+class HeaderEntry
+{
+public:
+    HeaderEntry(const std::string &name, const std::string &value,
+        HeaderAction action, HeaderDirection direction, size_t slot,
+        const std::vector<std::string> &lookups);
+
+    const libecap::Name name;
+    const HeaderTemplate value_template;
+    const libecap::Header::Value value; // empty if value_template.dynamic()
+    const HeaderAction action;
+    const HeaderDirection direction;
+    const size_t slot; // first entry with the same direction and (case-insensitive) name
+};
+
+typedef std::vector<HeaderEntry> HeaderList;
+
+// A <header> element as parsed, before it is compiled
+class HeaderRule
+{
+public:
+    std::string name;
+    std::string value; // empty for headerRemove
+    HeaderAction action;
+    HeaderDirection direction;
+
+    // scope, always of the request (for responses, the one they answer);
+    // a rule without any applies to every request
+    std::vector<std::string> hosts; // exact host names
+    std::vector<std::string> domains; // domains, including subdomains
+    std::vector<std::string> paths; // URI path prefixes
+    std::vector<std::string> clients; // client addresses or CIDR blocks
+    std::vector<std::string> users; // authenticated user names
+
+    HeaderRule() : action(headerAdd), direction(directionRequest) { };
+
+    std::string scope(void) const;
+};
+
+typedef std::vector<HeaderRule> HeaderRuleList;
+
+// Rules compiled into a binary file, see rule-index.h
+class RuleIndex;
+typedef libecap::shared_ptr<const RuleIndex> RuleIndexPointer;
+
+// Worker processes sharing memory, see shared-state.h
+class SharedState;
+
+// Values looked up off the host thread, see lookup.h
+class Lookup;
+typedef libecap::shared_ptr<const Lookup> LookupPointer;
+
+// A configured header as transactions see it, wherever it came from
+class HeaderRef
+{
+public:
+    const libecap::Name *name;
+    const HeaderTemplate *value_template; // NULL unless the value has placeholders
+    libecap::Area value;
+    HeaderAction action;
+    size_t slot; // shared by every header with the same direction and name
+};
+
+// Everything loaded from the configuration file.  Built by ConfigParser,
+// then published as an immutable snapshot that transactions pin for as
+// long as they run.
+class Config
+{
+public:
+    Config();
+
+    // with shared, rules without placeholders are compiled once for
+    // every worker, unless the file names an index
+    static libecap::shared_ptr<const Config> Load(const std::string &filename,
+        SharedState *shared = NULL);
+
+    void addHeader(const HeaderRule &rule);
+    void setBodyWindow(size_type window);
+    void setBodyBudget(size_type budget);
+    void setBodyBypass(size_type size);
+    void setLogLevel(int level);
+    void setLogQueue(size_t queue_size);
+    void setReloadInterval(unsigned seconds);
+    void setPoolLimit(size_t blocks);
+    void setCacheSize(size_t entries);
+    void setStats(const std::string &filename, unsigned seconds);
+    void setTrace(const std::string &filename, unsigned sample,
+        size_t events, bool signal);
+    void setHtml(HtmlScanner::InjectSite inject,
+        const std::string &snippet, size_type limit);
+    void setIndex(const std::string &filename);
+    void addLookup(const LookupPointer &lookup); // throws std::runtime_error
+    void addSource(const std::string &filename);
+
+    // rule numbers past headers() are index rules
+    void header(unsigned rule, HeaderRef &ref) const;
+    HeaderDirection direction(unsigned rule) const;
+    // false if no rule edits such messages
+    inline bool edits(HeaderDirection direction) const { return rule_counts[direction] != 0; };
+
+    inline const HeaderRuleList &rules(void) const { return header_rules; };
+    inline const HeaderList &headers(void) const { return header_list; };
+    inline const UrlMatcher &urlMatcher(void) const { return url_matcher; };
+    inline const ClientMatcher &clientMatcher(void) const { return client_matcher; };
+    inline size_type bodyWindow(void) const { return body_window; };
+    inline size_type bodyBudget(void) const { return body_budget; };
+    inline size_type bodyBypass(void) const { return body_bypass; };
+    inline int logLevel(void) const { return log_level; };
+    inline size_t logQueue(void) const { return log_queue; };
+    inline unsigned reloadInterval(void) const { return reload_interval; };
+    inline size_t poolLimit(void) const { return pool_limit; };
+    inline size_t cacheSize(void) const { return cache_size; };
+    // unique to this snapshot, for DecisionCache
+    inline uint64_t generation(void) const { return config_generation; };
+    inline const std::string &statsFile(void) const { return stats_file; };
+    inline unsigned statsInterval(void) const { return stats_interval; };
+    inline const std::string &traceFile(void) const { return trace_file; };
+    inline unsigned traceSample(void) const { return trace_sample; };
+    inline size_t traceEvents(void) const { return trace_events; };
+    inline bool traceSignal(void) const { return trace_signal; };
+    inline bool htmlScanning(void) const { return html_scanning; };
+    inline HtmlScanner::InjectSite htmlInject(void) const { return html_inject; };
+    inline const libecap::Area &htmlSnippet(void) const { return html_snippet; };
+    inline size_type htmlLimit(void) const { return html_limit; };
+    inline const RuleIndexPointer &index(void) const { return rule_index; };
+    inline const std::string &indexFile(void) const { return index_file; };
+    inline const std::vector<LookupPointer> &lookups(void) const { return lookup_list; };
+    // every file the snapshot was loaded from
+    inline const std::vector<std::string> &sources(void) const { return source_files; };
+
+protected:
+    void share(SharedState &shared);
+    void compile(void);
+
+    HeaderRuleList header_rules; // Custom headers, as parsed
+    HeaderList header_list; // Custom headers, as added to messages
+    UrlMatcher url_matcher; // Header scopes, by rule number
+    ClientMatcher client_matcher; // Client scopes, by rule number
+
+    RuleIndexPointer rule_index; // Compiled rules, numbered after header_list
+    std::string index_file;
+    std::vector<libecap::Name> index_names; // By index name number
+    std::vector<size_t> index_slots[2]; // By direction, then index name number
+    size_t rule_counts[2]; // XML and index rules, by direction
+
+    std::vector<LookupPointer> lookup_list; // By lookup number
+    std::vector<std::string> lookup_names; // By lookup number
+
+    std::vector<std::string> source_files; // This file, its lists and index
+
+    size_type body_window; // In-flight limit for adapted body content
+    size_type body_budget; // The same for all transactions, 0 for none
+    size_type body_bypass; // Larger bodies are not adapted, 0 for none
+
+    int log_level; // Highest syslog priority logged
+    size_t log_queue; // Asynchronous log queue size, 0 to log directly
+
+    unsigned reload_interval; // Seconds between file checks, 0 to disable
+
+    size_t pool_limit; // Free blocks kept per pool size class
+
+    size_t cache_size; // Rule decisions cached, 0 to disable
+    const uint64_t config_generation;
+
+    std::string stats_file; // Statistics dump, empty to disable
+    unsigned stats_interval; // Seconds between dumps, 0 for stop() only
+
+    std::string trace_file; // Latency trace dump, empty to disable
+    unsigned trace_sample; // One in this many transactions traced, 0 for none
+    size_t trace_events; // Kept per thread
+    bool trace_signal; // Dump on SIGUSR2 too
+
+    bool html_scanning; // Scan HTML responses
+    HtmlScanner::InjectSite html_inject; // Where to put html_snippet
+    libecap::Area html_snippet; // Injected into HTML responses
+    size_type html_limit; // Body bytes scanned at most
+};
+
+typedef libecap::shared_ptr<const Config> ConfigPointer;
+
+} // namespace Adapter
+
+class ConfigParser : public ExpatXmlParser
+{
+public:
+    ConfigParser(const std::string &filename);
+
+    virtual void Reset(void);
+    virtual void Parse(void);
+    virtual void ParseElementOpen(ExpatXmlTag *tag);
+    virtual void ParseElementClose(ExpatXmlTag *tag);
+
+protected:
+    unsigned long ParseNumber(ExpatXmlTag *tag, const std::string &key, unsigned long max);
+    void ParseList(ExpatXmlTag *tag, const std::string &key, std::vector<std::string> &items);
+    void ParseListFile(ExpatXmlTag *tag, const std::string &value);
+    Adapter::HeaderAction ParseHeaderAction(ExpatXmlTag *tag);
+    Adapter::HeaderDirection ParseHeaderDirection(ExpatXmlTag *tag);
+    Adapter::HtmlScanner::InjectSite ParseInjectSite(ExpatXmlTag *tag);
+
+    std::string filename;
+    Adapter::HeaderRule header_rule; // of the <header> open, if any
+};
+
+#endif // _ADAPTER_CONFIG_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
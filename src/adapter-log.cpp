@@ -0,0 +1,180 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include <syslog.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "adapter-log.h"
+
+// Longest message kept by the asynchronous queue, including the NUL
+#define LOG_ENTRY_SIZE          512
+
+std::atomic<int> Adapter::Log::level(LOG_INFO);
+
+namespace
+{
+
+struct LogEntry
+{
+    int priority;
+    char text[LOG_ENTRY_SIZE];
+};
+
+// Ring of formatted messages waiting for the writer thread
+struct LogQueue
+{
+    LogQueue() : head(0), count(0), dropped(0), running(false) { }
+    ~LogQueue() { Adapter::Log::SetAsync(0); }
+
+    std::vector<LogEntry> ring;
+    size_t head; // oldest entry
+    size_t count; // entries in use
+    unsigned long dropped; // messages lost to a full ring
+
+    std::atomic<bool> running;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::thread writer;
+};
+
+LogQueue queue;
+
+void LogWriter(void)
+{
+    std::vector<LogEntry> batch;
+    std::unique_lock<std::mutex> ul(queue.lock);
+
+    for ( ;; ) {
+        queue.ready.wait(ul, [] { return queue.count || !queue.running; });
+        if (!queue.count && !queue.running) break;
+
+        // take everything queued so far and write it without the lock
+        batch.clear();
+        for ( ; queue.count; queue.count--) {
+            batch.push_back(queue.ring[queue.head]);
+            queue.head = (queue.head + 1) % queue.ring.size();
+        }
+        unsigned long dropped = queue.dropped;
+        queue.dropped = 0;
+
+        ul.unlock();
+        for (std::vector<LogEntry>::const_iterator i = batch.begin(); i != batch.end(); i++)
+            syslog(LOG_LOCAL0 | i->priority, "%s", i->text);
+        if (dropped)
+            syslog(LOG_LOCAL0 | LOG_WARNING, "log queue full, %lu message(s) dropped", dropped);
+        ul.lock();
+    }
+}
+
+} // namespace
+
+void Adapter::Log::Open(void)
+{
+    openlog(PACKAGE_TARNAME, LOG_PID, LOG_LOCAL0);
+}
+
+void Adapter::Log::Close(void)
+{
+    SetAsync(0);
+    closelog();
+}
+
+void Adapter::Log::SetLevel(int priority)
+{
+    level.store(priority, std::memory_order_relaxed);
+}
+
+int Adapter::Log::ParseLevel(const std::string &name)
+{
+    static const struct {
+        const char *name;
+        int priority;
+    } levels[] = {
+        { "error", LOG_ERR },
+        { "warning", LOG_WARNING },
+        { "notice", LOG_NOTICE },
+        { "info", LOG_INFO },
+        { "debug", LOG_DEBUG },
+        { NULL, 0 }
+    };
+
+    for (int i = 0; levels[i].name; i++)
+        if (!strcasecmp(name.c_str(), levels[i].name)) return levels[i].priority;
+
+    return -1;
+}
+
+void Adapter::Log::SetAsync(size_t queue_size)
+{
+    Flush();
+
+    if (!queue_size) return;
+
+    {
+        std::lock_guard<std::mutex> lg(queue.lock);
+        queue.ring.resize(queue_size);
+        queue.head = queue.count = queue.dropped = 0;
+        queue.running = true;
+    }
+    queue.writer = std::thread(LogWriter);
+}
+
+// stops the writer thread once it has written everything queued
+void Adapter::Log::Flush(void)
+{
+    {
+        std::lock_guard<std::mutex> lg(queue.lock);
+        if (!queue.running) return;
+        queue.running = false;
+    }
+    queue.ready.notify_one();
+    queue.writer.join();
+}
+
+void Adapter::Log::Write(int priority, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+
+    if (!queue.running) {
+        vsyslog(LOG_LOCAL0 | priority, format, ap);
+        va_end(ap);
+        return;
+    }
+
+    char text[LOG_ENTRY_SIZE];
+    vsnprintf(text, sizeof(text), format, ap);
+    va_end(ap);
+
+    {
+        std::unique_lock<std::mutex> ul(queue.lock);
+        if (!queue.running) {
+            // the writer stopped while we were formatting
+            ul.unlock();
+            syslog(LOG_LOCAL0 | priority, "%s", text);
+            return;
+        }
+        if (queue.count == queue.ring.size()) {
+            queue.dropped++;
+            return;
+        }
+        LogEntry &entry = queue.ring[(queue.head + queue.count) % queue.ring.size()];
+        entry.priority = priority;
+        memcpy(entry.text, text, sizeof(text));
+        if (queue.count++) return; // the writer has yet to catch up anyway
+    }
+    queue.ready.notify_one();
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,55 @@
+#ifndef _ADAPTER_LOG_H
+#define _ADAPTER_LOG_H
+
+// Included by nearly every file, in any order: bring what it uses
+#include <atomic>
+#include <string>
+#include <syslog.h>
+
+// Logs a message if the configured level lets it through; the level
+// check is a single load, so nothing is formatted for dropped messages
+#define ADAPTER_LOG(priority, ...) \
+    do { \
+        if (Adapter::Log::Enabled(priority)) \
+            Adapter::Log::Write(priority, __VA_ARGS__); \
+    } while (0)
+
+// Per-callback tracing; compiled out by ./configure --disable-debug-trace
+#ifdef ENABLE_DEBUG_TRACE
+#define ADAPTER_TRACE(...) ADAPTER_LOG(LOG_DEBUG, __VA_ARGS__)
+#else
+#define ADAPTER_TRACE(...) do { } while (0)
+#endif
+
+namespace Adapter
+{
+
+class Log
+{
+public:
+    static void Open(void);
+    static void Close(void);
+
+    static inline bool Enabled(int priority)
+        { return priority <= level.load(std::memory_order_relaxed); };
+    static void SetLevel(int priority);
+    static int ParseLevel(const std::string &name);
+
+    // Queue messages for a background thread instead of calling
+    // syslog() on the caller's thread; queue_size == 0 disables
+    static void SetAsync(size_t queue_size);
+
+    static void Write(int priority, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+protected:
+    static void Flush(void);
+
+    static std::atomic<int> level;
+};
+
+} // namespace Adapter
+
+#endif // _ADAPTER_LOG_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
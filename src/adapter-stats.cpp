@@ -0,0 +1,189 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include <libecap/common/memory.h>
+
+#include <syslog.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adapter-log.h"
+#include "adapter-stats.h"
+#include "dump-file.h"
+#include "shared-state.h"
+
+// JSON member names, by Stats::Counter
+static const char *counter_names[] = {
+    "xactions_started",
+    "xactions_aborted",
+    "headers_injected",
+    "headers_removed",
+    "bodies_relayed",
+    "bodies_adapted",
+    "bodies_bypassed",
+    "html_injected",
+    "bytes_buffered",
+    "decision_hits",
+    "decision_misses"
+};
+
+static std::atomic<unsigned long> last_id(0);
+
+__thread unsigned long Adapter::Stats::cached_id = 0;
+__thread Adapter::Stats::Shard *Adapter::Stats::cached_shard = NULL;
+
+Adapter::Stats::Shard::Shard()
+    : peak_buffered(0), start_time_total(0), sample(0)
+{
+    for (int i = 0; i < counterMax; i++)
+        counters[i].store(0, std::memory_order_relaxed);
+    for (int i = 0; i < STATS_LATENCY_BUCKETS; i++)
+        start_time[i].store(0, std::memory_order_relaxed);
+}
+
+Adapter::Stats::Totals::Totals()
+    : peak_buffered(0), start_time_total(0), since(0), workers(0)
+{
+    memset(counters, 0, sizeof(counters));
+    memset(start_time, 0, sizeof(start_time));
+}
+
+Adapter::Stats::Stats()
+    : id(++last_id), since(time(NULL)), shared(NULL)
+{
+}
+
+// threads that still cache a shard of ours never see our id again
+Adapter::Stats::~Stats()
+{
+    for (size_t i = 0; i < shards.size(); i++)
+        delete shards[i];
+}
+
+Adapter::Stats::Shard &Adapter::Stats::attach(void)
+{
+    Shard *shard = new Shard;
+    {
+        std::lock_guard<std::mutex> lg(shards_lock);
+        shards.push_back(shard);
+    }
+
+    cached_id = id;
+    cached_shard = shard;
+    return *shard;
+}
+
+void Adapter::Stats::noteBuffered(size_t size)
+{
+    Shard &s = shard();
+    if (size > s.peak_buffered.load(std::memory_order_relaxed))
+        s.peak_buffered.store(size, std::memory_order_relaxed);
+}
+
+bool Adapter::Stats::sampleStart(void)
+{
+    Shard &s = shard();
+    if (++s.sample < STATS_TIMING_SAMPLE) return false;
+    s.sample = 0;
+    return true;
+}
+
+void Adapter::Stats::noteStartTime(unsigned long ns)
+{
+    int bucket = (ns) ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= STATS_LATENCY_BUCKETS)
+        bucket = STATS_LATENCY_BUCKETS - 1;
+
+    Shard &s = shard();
+    add(s.start_time[bucket], 1);
+    add(s.start_time_total, ns);
+}
+
+void Adapter::Stats::collect(Totals &totals) const
+{
+    totals = Totals();
+    totals.since = since;
+
+    std::lock_guard<std::mutex> lg(shards_lock);
+    for (size_t i = 0; i < shards.size(); i++) {
+        const Shard &s = *shards[i];
+        for (int c = 0; c < counterMax; c++)
+            totals.counters[c] += s.counters[c].load(std::memory_order_relaxed);
+        for (int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+            totals.start_time[b] += s.start_time[b].load(std::memory_order_relaxed);
+        totals.peak_buffered = std::max(totals.peak_buffered,
+            s.peak_buffered.load(std::memory_order_relaxed));
+        totals.start_time_total += s.start_time_total.load(std::memory_order_relaxed);
+    }
+}
+
+void Adapter::Stats::publish(void) const
+{
+    if (!shared) return;
+
+    Totals totals;
+    collect(totals);
+    shared->publish(totals);
+}
+
+void Adapter::Stats::format(std::ostream &os) const
+{
+    Totals totals;
+    collect(totals);
+    if (shared) {
+        shared->publish(totals);
+        shared->collect(totals);
+    }
+    const unsigned long *counters = totals.counters;
+    const unsigned long *start_time = totals.start_time;
+
+    os << "{\n  \"version\": \"" PACKAGE_VERSION "\",\n";
+    os << "  \"since\": " << totals.since << ",\n";
+    os << "  \"time\": " << time(NULL) << ",\n";
+    if (totals.workers)
+        os << "  \"workers\": " << totals.workers << ",\n";
+
+    for (int i = 0; i < counterMax; i++)
+        os << "  \"" << counter_names[i] << "\": " << counters[i] << ",\n";
+    os << "  \"peak_buffered\": " << totals.peak_buffered << ",\n";
+
+    // only the buckets in use, each with its upper bound
+    unsigned long samples = 0;
+    os << "  \"start_time_ns\": {\n";
+    os << "    \"sample\": " << STATS_TIMING_SAMPLE << ",\n";
+    os << "    \"buckets\": [";
+    for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        if (!start_time[i]) continue;
+        os << ((samples) ? ", " : " ") << "[" << (1UL << i) << ", " << start_time[i] << "]";
+        samples += start_time[i];
+    }
+    os << " ],\n";
+    os << "    \"count\": " << samples << ",\n";
+    os << "    \"total\": " << totals.start_time_total << "\n  }\n}\n";
+}
+
+bool Adapter::Stats::dump(const std::string &filename) const
+{
+    if (shared && !shared->dumps()) {
+        publish();
+        return true;
+    }
+
+    std::ostringstream os;
+    format(os);
+    return DumpFile(filename, os.str());
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,116 @@
+#ifndef _ADAPTER_STATS_H
+#define _ADAPTER_STATS_H
+
+// Buckets of the start() latency histogram; bucket n counts calls that
+// took less than 2^n nanoseconds, the last one everything slower
+#define STATS_LATENCY_BUCKETS   32
+
+// Reading the clock costs about as much as a whole header-only start(),
+// so only one in this many transactions (per thread) is timed
+#define STATS_TIMING_SAMPLE     16
+
+namespace Adapter
+{
+
+class SharedState;
+
+// Service counters.  Every thread updates a shard of its own with plain
+// loads and stores, so the hot path has neither locks nor locked bus
+// operations; readers add the shards up.  A reader may see one counter
+// a few updates ahead of another, which is fine for monitoring.
+class Stats
+{
+public:
+    typedef enum
+    {
+        xactionsStarted,
+        xactionsAborted,
+        headersInjected,
+        headersRemoved,
+        bodiesRelayed, // passed through untouched
+        bodiesAdapted, // passed through adaptContent()
+        bodiesBypassed, // relayed, too large or over budget to adapt
+        htmlInjected, // snippets spliced into HTML bodies
+        bytesBuffered, // body bytes queued for adaptation
+        decisionHits, // rule matches found in the DecisionCache
+        decisionMisses, // and the ones that had to be worked out
+        counterMax
+    } Counter;
+
+    // the shards added up, as format() shows them
+    class Totals
+    {
+    public:
+        Totals();
+
+        unsigned long counters[counterMax];
+        unsigned long peak_buffered;
+        unsigned long start_time[STATS_LATENCY_BUCKETS];
+        unsigned long start_time_total;
+        time_t since;
+        unsigned workers; // processes added up, 0 for this one alone
+    };
+
+    Stats();
+    ~Stats();
+
+    inline void count(Counter counter, unsigned long n = 1)
+        { add(shard().counters[counter], n); };
+    void noteBuffered(size_t size); // tracks the peak buffer size
+
+    // true for the transactions whose start() should be timed
+    bool sampleStart(void);
+    void noteStartTime(unsigned long ns);
+
+    void collect(Totals &totals) const;
+
+    // from now on, format() publishes our totals to state and shows
+    // those of every worker process sharing it; state must outlive us
+    inline void share(SharedState *state) { shared = state; };
+    void publish(void) const; // our totals, if shared
+
+    // machine-readable snapshot, as a JSON object
+    void format(std::ostream &os) const;
+    // writes format() to a temporary file renamed over filename; when
+    // shared, only one worker does, the others just publish
+    bool dump(const std::string &filename) const;
+
+protected:
+    class Shard
+    {
+    public:
+        Shard();
+
+        std::atomic<unsigned long> counters[counterMax];
+        std::atomic<unsigned long> peak_buffered;
+        std::atomic<unsigned long> start_time[STATS_LATENCY_BUCKETS];
+        std::atomic<unsigned long> start_time_total; // nanoseconds
+        unsigned sample; // owner thread only
+    };
+
+    // single writer: no need for an atomic read-modify-write
+    static inline void add(std::atomic<unsigned long> &counter, unsigned long n)
+        { counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); };
+
+    inline Shard &shard(void)
+        { return (cached_id == id) ? *cached_shard : attach(); };
+    Shard &attach(void); // creates the calling thread's shard
+
+    const unsigned long id; // never reused, unlike addresses
+    const time_t since;
+
+    mutable std::mutex shards_lock; // Guards shards
+    std::vector<Shard *> shards;
+
+    SharedState *shared; // Box-wide totals, NULL for our own
+
+    // the shard the calling thread used last, and whose it is
+    static __thread unsigned long cached_id;
+    static __thread Shard *cached_shard;
+};
+
+} // namespace Adapter
+
+#endif // _ADAPTER_STATS_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,315 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_SIMD_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "ascii-case.h"
+
+namespace
+{
+
+const uint64_t ONES = 0x0101010101010101ULL;
+
+// sets 0x20 in the bytes of w that are A-Z; the additions cannot carry
+// from one byte into the next, and bytes with the high bit set are kept
+inline uint64_t LowerWord(uint64_t w)
+{
+    const uint64_t heptets = w & (0x7f * ONES);
+    const uint64_t at_least_a = heptets + ((0x80 - 'A') * ONES);
+    const uint64_t above_z = heptets + ((0x80 - 'Z' - 1) * ONES);
+    const uint64_t upper = at_least_a & ~above_z & ~w & (0x80 * ONES);
+    return w | (upper >> 2);
+}
+
+inline char LowerByte(char c)
+{
+    return ((unsigned char)(c - 'A') < 26) ? c | 0x20 : c;
+}
+
+inline uint64_t LoadWord(const char *bytes)
+{
+    uint64_t w;
+    memcpy(&w, bytes, sizeof(w));
+    return w;
+}
+
+inline void StoreWord(char *bytes, uint64_t w)
+{
+    memcpy(bytes, &w, sizeof(w));
+}
+
+// the hash takes words of lowercase text in order, the last one padded
+// with zeros; the kernels only differ in how they lowercase them
+inline uint64_t Mix(uint64_t hash, uint64_t w)
+{
+    hash = (hash ^ w) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 32);
+}
+
+inline uint64_t HashStart(size_t length)
+{
+    return 0xcbf29ce484222325ULL ^ length;
+}
+
+inline uint64_t HashFinish(uint64_t hash)
+{
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    return hash ^ (hash >> 32);
+}
+
+// below eight bytes, a byte at a time; then a word at a time, the last
+// word overlapping the one before it rather than a loop over the rest
+void LowerScalar(char *to, const char *from, size_t length)
+{
+    if (length < 8) {
+        for (size_t i = 0; i < length; i++)
+            to[i] = LowerByte(from[i]);
+        return;
+    }
+
+    const uint64_t last = LowerWord(LoadWord(from + length - 8));
+    for (size_t i = 0; i + 8 < length; i += 8)
+        StoreWord(to + i, LowerWord(LoadWord(from + i)));
+    StoreWord(to + length - 8, last);
+}
+
+bool EqualScalar(const char *a, const char *b, size_t length)
+{
+    if (length < 8) {
+        uint64_t x = 0, y = 0;
+        memcpy(&x, a, length);
+        memcpy(&y, b, length);
+        return LowerWord(x) == LowerWord(y);
+    }
+
+    for (size_t i = 0; i + 8 < length; i += 8) {
+        if (LowerWord(LoadWord(a + i)) != LowerWord(LoadWord(b + i)))
+            return false;
+    }
+    return LowerWord(LoadWord(a + length - 8)) == LowerWord(LoadWord(b + length - 8));
+}
+
+// from offset i on; a short last word is the end of a whole one
+// shifted down, where there is room to load one
+uint64_t HashTail(uint64_t hash, const char *text, size_t i, size_t length)
+{
+    for ( ; i + 8 <= length; i += 8)
+        hash = Mix(hash, LowerWord(LoadWord(text + i)));
+    if (i == length) return hash;
+
+    const size_t rest = length - i;
+    uint64_t w = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (length >= 8)
+        w = LoadWord(text + length - 8) >> (8 * (8 - rest));
+    else
+#endif
+        memcpy(&w, text + i, rest);
+    return Mix(hash, LowerWord(w));
+}
+
+uint64_t HashScalar(const char *text, size_t length)
+{
+    return HashFinish(HashTail(HashStart(length), text, 0, length));
+}
+
+bool SupportedScalar(void)
+{
+    return true;
+}
+
+#ifdef HAVE_SIMD_KERNELS
+
+// signed comparisons leave bytes with the high bit set alone
+__attribute__((target("sse2")))
+inline __m128i Lower16(__m128i x)
+{
+    const __m128i upper = _mm_and_si128(
+        _mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+        _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+// the last block is read before any is written, so that to may be from
+__attribute__((target("sse2")))
+void LowerSse2(char *to, const char *from, size_t length)
+{
+    if (length < 16) {
+        LowerScalar(to, from, length);
+        return;
+    }
+
+    const __m128i last = Lower16(_mm_loadu_si128((const __m128i *)(from + length - 16)));
+    for (size_t i = 0; i + 16 < length; i += 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i *)(from + i));
+        _mm_storeu_si128((__m128i *)(to + i), Lower16(x));
+    }
+    _mm_storeu_si128((__m128i *)(to + length - 16), last);
+}
+
+__attribute__((target("sse2")))
+inline bool Equal16(const char *a, const char *b)
+{
+    const __m128i x = Lower16(_mm_loadu_si128((const __m128i *)a));
+    const __m128i y = Lower16(_mm_loadu_si128((const __m128i *)b));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xffff;
+}
+
+__attribute__((target("sse2")))
+bool EqualSse2(const char *a, const char *b, size_t length)
+{
+    if (length < 16)
+        return EqualScalar(a, b, length);
+
+    for (size_t i = 0; i + 16 < length; i += 16) {
+        if (!Equal16(a + i, b + i))
+            return false;
+    }
+    return Equal16(a + length - 16, b + length - 16);
+}
+
+__attribute__((target("sse2")))
+uint64_t HashSse2(const char *text, size_t length)
+{
+    uint64_t hash = HashStart(length);
+    size_t i = 0;
+    for ( ; i + 16 <= length; i += 16) {
+        uint64_t w[2];
+        _mm_storeu_si128((__m128i *)w,
+            Lower16(_mm_loadu_si128((const __m128i *)(text + i))));
+        hash = Mix(Mix(hash, w[0]), w[1]);
+    }
+    return HashFinish(HashTail(hash, text, i, length));
+}
+
+bool SupportedSse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+// the SSE2 and scalar code these hand the rest to must not find the
+// upper halves of the vector registers in use, or it runs much slower
+__attribute__((target("avx2")))
+inline __m256i Lower32(__m256i x)
+{
+    const __m256i upper = _mm256_and_si256(
+        _mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+void LowerAvx2(char *to, const char *from, size_t length)
+{
+    if (length < 32) {
+        LowerSse2(to, from, length);
+        return;
+    }
+
+    const __m256i last = Lower32(_mm256_loadu_si256((const __m256i *)(from + length - 32)));
+    for (size_t i = 0; i + 32 < length; i += 32) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)(from + i));
+        _mm256_storeu_si256((__m256i *)(to + i), Lower32(x));
+    }
+    _mm256_storeu_si256((__m256i *)(to + length - 32), last);
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx2")))
+inline bool Equal32(const char *a, const char *b)
+{
+    const __m256i x = Lower32(_mm256_loadu_si256((const __m256i *)a));
+    const __m256i y = Lower32(_mm256_loadu_si256((const __m256i *)b));
+    return (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) == 0xffffffffU;
+}
+
+__attribute__((target("avx2")))
+bool EqualAvx2(const char *a, const char *b, size_t length)
+{
+    if (length < 32)
+        return EqualSse2(a, b, length);
+
+    bool equal = true;
+    for (size_t i = 0; equal && i + 32 < length; i += 32)
+        equal = Equal32(a + i, b + i);
+    equal = equal && Equal32(a + length - 32, b + length - 32);
+    _mm256_zeroupper();
+    return equal;
+}
+
+__attribute__((target("avx2")))
+uint64_t HashAvx2(const char *text, size_t length)
+{
+    uint64_t hash = HashStart(length);
+    size_t i = 0;
+    for ( ; i + 32 <= length; i += 32) {
+        uint64_t w[4];
+        _mm256_storeu_si256((__m256i *)w,
+            Lower32(_mm256_loadu_si256((const __m256i *)(text + i))));
+        hash = Mix(Mix(Mix(Mix(hash, w[0]), w[1]), w[2]), w[3]);
+    }
+    _mm256_zeroupper();
+    for ( ; i + 16 <= length; i += 16) {
+        uint64_t w[2];
+        _mm_storeu_si128((__m128i *)w,
+            Lower16(_mm_loadu_si128((const __m128i *)(text + i))));
+        hash = Mix(Mix(hash, w[0]), w[1]);
+    }
+    return HashFinish(HashTail(hash, text, i, length));
+}
+
+bool SupportedAvx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif // HAVE_SIMD_KERNELS
+
+} // namespace
+
+// slowest first; the scalar kernel works everywhere
+const Adapter::AsciiCase::Kernels Adapter::AsciiCase::table[] = {
+    { "scalar", SupportedScalar, LowerScalar, EqualScalar, HashScalar },
+#ifdef HAVE_SIMD_KERNELS
+    { "sse2", SupportedSse2, LowerSse2, EqualSse2, HashSse2 },
+    { "avx2", SupportedAvx2, LowerAvx2, EqualAvx2, HashAvx2 },
+#endif
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+// usable from the start, for code that runs before Select() does
+const Adapter::AsciiCase::Kernels *Adapter::AsciiCase::kernels = &Adapter::AsciiCase::table[0];
+const bool Adapter::AsciiCase::selected = (kernels = Select(), true);
+
+const Adapter::AsciiCase::Kernels *Adapter::AsciiCase::Select(void)
+{
+    const Kernels *best = &table[0];
+    for (const Kernels *k = table; k->name; k++) {
+        if (k->supported()) best = k;
+    }
+    return best;
+}
+
+bool Adapter::AsciiCase::Use(const std::string &name)
+{
+    for (const Kernels *k = table; k->name; k++) {
+        if (name == k->name && k->supported()) {
+            kernels = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
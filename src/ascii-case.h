@@ -0,0 +1,58 @@
+#ifndef _ASCII_CASE_H
+#define _ASCII_CASE_H
+
+namespace Adapter
+{
+
+// Case-insensitive ASCII string primitives for host names, header names
+// and user names, which are looked at on every request.  Bytes outside
+// A-Z are left alone, whatever the locale.  The kernels doing the work
+// (scalar, a word at a time, or SSE2/AVX2 where the CPU has them) are
+// chosen when the library loads, and all give the same results.
+class AsciiCase
+{
+public:
+    // to may be from
+    static inline void Lower(char *to, const char *from, size_t length)
+        { kernels->lower(to, from, length); };
+    static inline bool Equal(const char *a, const char *b, size_t length)
+        { return kernels->equal(a, b, length); };
+    // of the lowercase text; the same in every process and kernel
+    static inline uint64_t Hash(const char *text, size_t length)
+        { return kernels->hash(text, length); };
+
+    static inline bool EndsWith(const char *text, size_t length,
+        const char *suffix, size_t suffix_length)
+    {
+        return length >= suffix_length &&
+            Equal(text + length - suffix_length, suffix, suffix_length);
+    };
+
+    // "scalar", "sse2" or "avx2"
+    static inline const char *Kernel(void) { return kernels->name; };
+    // false if the kernel is unknown or this CPU lacks it; for benchmarks
+    static bool Use(const std::string &name);
+
+protected:
+    class Kernels
+    {
+    public:
+        const char *name;
+        bool (*supported)(void);
+        void (*lower)(char *to, const char *from, size_t length);
+        bool (*equal)(const char *a, const char *b, size_t length);
+        uint64_t (*hash)(const char *text, size_t length);
+    };
+
+    static const Kernels *kernels;
+    static const Kernels table[];
+    static const bool selected;
+
+    static const Kernels *Select(void); // the fastest this CPU has
+};
+
+} // namespace Adapter
+
+#endif // _ASCII_CASE_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,75 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <new>
+
+#include <libecap/common/area.h>
+#include <libecap/common/errors.h>
+
+#include "pool.h"
+#include "body-buffer.h"
+
+Adapter::BodyBuffer::BodyBuffer(libecap::size_type window)
+    : head(0), buffered(0), window(window) { }
+
+void Adapter::BodyBuffer::append(const libecap::Area &chunk)
+{
+    if (!chunk.size) return;
+
+    // an area without details points into memory the host may reuse
+    // as soon as the chunk is shifted; only then do we need a copy
+    if (chunk.details)
+        chunks.push_back(chunk);
+    else
+        chunks.push_back(libecap::Area::FromTempBuffer(chunk.start, chunk.size));
+
+    buffered += chunk.size;
+}
+
+// returns at most one chunk worth of content; the caller asks again
+// for the rest, as the host does with any short area
+libecap::Area Adapter::BodyBuffer::content(
+    libecap::size_type offset, libecap::size_type size) const
+{
+    offset += head;
+    for (ChunkQueue::const_iterator i = chunks.begin(); i != chunks.end(); i++) {
+        if (offset < i->size) {
+            const libecap::size_type length = std::min(size, i->size - offset);
+            return libecap::Area(i->start + offset, length, i->details);
+        }
+        offset -= i->size;
+    }
+
+    return libecap::Area();
+}
+
+void Adapter::BodyBuffer::shift(libecap::size_type size)
+{
+    Must(size <= buffered);
+    buffered -= size;
+
+    size += head;
+    while (!chunks.empty() && size >= chunks.front().size) {
+        size -= chunks.front().size;
+        chunks.pop_front();
+    }
+    head = size;
+}
+
+// false, reserving nothing, if bytes do not fit under limit
+bool Adapter::BodyBudget::reserve(libecap::size_type bytes, libecap::size_type limit)
+{
+    libecap::size_type used = reserved.load(std::memory_order_relaxed);
+    do {
+        if (bytes > limit || used > limit - bytes) return false;
+    } while (!reserved.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+
+    return true;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,55 @@
+#ifndef _BODY_BUFFER_H
+#define _BODY_BUFFER_H
+
+namespace Adapter
+{
+
+// Queue of body chunks, kept as references to host-provided areas.
+// Content is served in place; nothing is copied or shifted in memory.
+class BodyBuffer
+{
+public:
+    BodyBuffer(libecap::size_type window);
+
+    inline bool empty(void) const { return !buffered; };
+    inline libecap::size_type size(void) const { return buffered; };
+    inline libecap::size_type room(void) const
+        { return (buffered < window) ? window - buffered : 0; };
+
+    void append(const libecap::Area &chunk);
+    libecap::Area content(libecap::size_type offset, libecap::size_type size) const;
+    void shift(libecap::size_type size);
+
+protected:
+    typedef std::deque<libecap::Area, PoolAllocator<libecap::Area> > ChunkQueue;
+    ChunkQueue chunks;
+
+    libecap::size_type head; // consumed bytes of chunks.front()
+    libecap::size_type buffered; // unconsumed bytes in all chunks
+    const libecap::size_type window; // in-flight limit, see room()
+};
+
+// Body bytes the transactions of a service may hold at once.  Each one
+// reserves all its window can hold before it buffers anything, so the
+// total stays under the limit and nobody waits on room held by another;
+// a transaction that cannot reserve relays its body instead.
+class BodyBudget
+{
+public:
+    BodyBudget() : reserved(0) { };
+
+    bool reserve(libecap::size_type bytes, libecap::size_type limit);
+    inline void release(libecap::size_type bytes)
+        { reserved.fetch_sub(bytes, std::memory_order_relaxed); };
+    inline libecap::size_type used(void) const
+        { return reserved.load(std::memory_order_relaxed); };
+
+protected:
+    std::atomic<libecap::size_type> reserved;
+};
+
+} // namespace Adapter
+
+#endif // _BODY_BUFFER_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,338 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <new>
+
+#include <libecap/common/area.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "pool.h"
+#include "ascii-case.h"
+#include "url-matcher.h"
+#include "client-matcher.h"
+
+// Initial user hash table size, doubled whenever it gets half full
+#define USER_TABLE_SIZE         64
+
+namespace
+{
+
+inline int Bit(const unsigned char *address, unsigned bit)
+{
+    return (address[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+// whether the first length bits of address and prefix agree
+bool PrefixMatches(const unsigned char *address, const unsigned char *prefix, unsigned length)
+{
+    const unsigned bytes = length / 8;
+    if (memcmp(address, prefix, bytes)) return false;
+    if (!(length % 8)) return true;
+
+    const unsigned char mask = 0xff << (8 - length % 8);
+    return (address[bytes] & mask) == prefix[bytes];
+}
+
+unsigned CommonPrefix(const unsigned char *a, const unsigned char *b, unsigned limit)
+{
+    unsigned bit = 0;
+    while (bit < limit && a[bit / 8] == b[bit / 8] && bit % 8 == 0 && bit + 8 <= limit)
+        bit += 8;
+    while (bit < limit && Bit(a, bit) == Bit(b, bit))
+        bit++;
+    return bit;
+}
+
+// of the lowercase name
+inline size_t HashUser(const char *name, size_t length)
+{
+    return Adapter::AsciiCase::Hash(name, length);
+}
+
+} // namespace
+
+Adapter::ClientNode::ClientNode(const unsigned char *address, unsigned length)
+    : length(length)
+{
+    memset(prefix, 0, sizeof(prefix));
+    memcpy(prefix, address, (length + 7) / 8);
+    if (length % 8)
+        prefix[length / 8] &= 0xff << (8 - length % 8);
+    child[0] = child[1] = -1;
+}
+
+Adapter::ClientMatcher::ClientMatcher()
+    : users(USER_TABLE_SIZE), user_count(0),
+    has_clients(false), has_users(false)
+{
+    const unsigned char any[16] = { 0 };
+    nodes.push_back(ClientNode(any, 0));
+}
+
+bool Adapter::ClientMatcher::ParseCidr(const std::string &text,
+    unsigned char *address, unsigned &length)
+{
+    const size_t slash = text.find('/');
+    const std::string host = text.substr(0, slash);
+
+    unsigned bits;
+    memset(address, 0, 16);
+    if (inet_pton(AF_INET6, host.c_str(), address) == 1)
+        bits = 128;
+    else if (inet_pton(AF_INET, host.c_str(), address + 12) == 1) {
+        address[10] = address[11] = 0xff;
+        bits = 32;
+    } else
+        return false;
+
+    length = 128;
+    if (slash == std::string::npos) return true;
+
+    const std::string prefix = text.substr(slash + 1);
+    char *end = NULL;
+    unsigned long value = strtoul(prefix.c_str(), &end, 10);
+    if (!prefix.size() || *end != '\0' || value > bits) return false;
+
+    length = 128 - bits + value;
+    return true;
+}
+
+void Adapter::ClientMatcher::add(unsigned rule, size_t group, bool hosted,
+    const std::vector<std::string> &clients,
+    const std::vector<std::string> &users)
+{
+    if (rule_groups.size() <= rule) {
+        rule_groups.resize(rule + 1);
+        rule_hosted.resize(rule + 1);
+        rule_clients.resize(rule + 1);
+        rule_users.resize(rule + 1);
+    }
+    rule_groups[rule] = group;
+    rule_hosted[rule] = hosted;
+    rule_clients[rule] = clients.size() > 0;
+    rule_users[rule] = users.size() > 0;
+
+    for (std::vector<std::string>::const_iterator i = clients.begin(); i != clients.end(); i++) {
+        unsigned char address[16];
+        unsigned length;
+        if (!ParseCidr(*i, address, length))
+            throw std::runtime_error("Invalid client address: " + *i);
+        insert(address, length, rule);
+        has_clients = true;
+    }
+
+    for (std::vector<std::string>::const_iterator i = users.begin(); i != users.end(); i++) {
+        std::string name(*i);
+        AsciiCase::Lower(&name[0], name.data(), name.size());
+        if (!name.size() || name.size() > MAX_USER_LENGTH)
+            throw std::runtime_error("Invalid user name: " + *i);
+        insertUser(name, rule);
+        has_users = true;
+    }
+}
+
+// nodes are addressed by index, as insertions move the vector around
+void Adapter::ClientMatcher::insert(const unsigned char *address, unsigned length, unsigned rule)
+{
+    int n = 0;
+    for ( ;; ) {
+        if (nodes[n].length == length) {
+            nodes[n].rules.push_back(rule);
+            return;
+        }
+
+        const int bit = Bit(address, nodes[n].length);
+        const int c = nodes[n].child[bit];
+        if (c < 0) {
+            nodes.push_back(ClientNode(address, length));
+            nodes.back().rules.push_back(rule);
+            nodes[n].child[bit] = nodes.size() - 1;
+            return;
+        }
+
+        const unsigned common = CommonPrefix(address, nodes[c].prefix,
+            std::min(length, nodes[c].length));
+        if (common == nodes[c].length) {
+            n = c; // the child is a prefix of ours
+            continue;
+        }
+
+        // split the edge to the child at the first differing bit, or at
+        // our own length if we are a prefix of the child
+        nodes.push_back(ClientNode(address, common));
+        const int split = nodes.size() - 1;
+        nodes[split].child[Bit(nodes[c].prefix, common)] = c;
+        nodes[n].child[bit] = split;
+
+        if (common == length) {
+            nodes[split].rules.push_back(rule);
+            return;
+        }
+
+        nodes.push_back(ClientNode(address, length));
+        nodes.back().rules.push_back(rule);
+        nodes[split].child[Bit(address, common)] = nodes.size() - 1;
+        return;
+    }
+}
+
+void Adapter::ClientMatcher::insertUser(const std::string &name, unsigned rule)
+{
+    if ((user_count + 1) * 2 > users.size()) {
+        std::vector<ClientUser> old(users.size() * 2);
+        old.swap(users);
+        user_count = 0;
+        for (std::vector<ClientUser>::const_iterator i = old.begin(); i != old.end(); i++) {
+            for (std::vector<unsigned>::const_iterator r = i->rules.begin(); r != i->rules.end(); r++)
+                insertUser(i->name, *r);
+        }
+    }
+
+    const size_t mask = users.size() - 1;
+    size_t slot = HashUser(name.data(), name.size()) & mask;
+    while (users[slot].name.size() && users[slot].name != name)
+        slot = (slot + 1) & mask;
+
+    if (!users[slot].name.size()) {
+        users[slot].name = name;
+        user_count++;
+    }
+    users[slot].rules.push_back(rule);
+}
+
+void Adapter::ClientMatcher::compile(void)
+{
+    for (std::vector<ClientUser>::iterator i = users.begin(); i != users.end(); i++) {
+        std::sort(i->rules.begin(), i->rules.end());
+        i->rules.erase(std::unique(i->rules.begin(), i->rules.end()), i->rules.end());
+    }
+}
+
+const Adapter::ClientUser *Adapter::ClientMatcher::findUser(const char *name, size_t length) const
+{
+    if (!length || length > MAX_USER_LENGTH) return NULL;
+
+    const size_t mask = users.size() - 1;
+    size_t slot = HashUser(name, length) & mask;
+    while (users[slot].name.size()) {
+        const std::string &candidate = users[slot].name;
+        if (candidate.size() == length && AsciiCase::Equal(candidate.data(), name, length))
+            return &users[slot];
+        slot = (slot + 1) & mask;
+    }
+
+    return NULL;
+}
+
+// every prefix on the way down matches; deeper ones come later
+void Adapter::ClientMatcher::lookup(const unsigned char *address, ClientHits &hits) const
+{
+    int n = 0;
+    while (n >= 0) {
+        const ClientNode &node = nodes[n];
+        if (!PrefixMatches(address, node.prefix, node.length)) break;
+
+        for (std::vector<unsigned>::const_iterator i = node.rules.begin(); i != node.rules.end(); i++)
+            hits.push_back(ClientHit(*i, node.length));
+
+        if (node.length == 128) break;
+        n = node.child[Bit(address, node.length)];
+    }
+}
+
+void Adapter::ClientMatcher::match(const libecap::Area &client,
+    const libecap::Area &user, const UrlMatcher &urls,
+    const char *path, size_t path_length, RuleMatches &matches) const
+{
+    ClientHits hits;
+    if (has_clients && client.size && client.size < INET6_ADDRSTRLEN) {
+        char text[INET6_ADDRSTRLEN];
+        memcpy(text, client.start, client.size);
+        text[client.size] = '\0';
+
+        unsigned char address[16];
+        unsigned length;
+        if (ParseCidr(text, address, length) && length == 128)
+            lookup(address, hits);
+    }
+
+    const ClientUser *entry = (has_users) ? findUser(user.start, user.size) : NULL;
+
+    // the rules UrlMatcher left to us
+    const size_t selected = matches.size();
+    for (ClientHits::const_iterator h = hits.begin(); h != hits.end(); h++) {
+        if (!rule_hosted[h->first] && urls.pathMatches(h->first, path, path_length))
+            matches.push_back(h->first);
+    }
+    if (entry) {
+        for (std::vector<unsigned>::const_iterator i = entry->rules.begin(); i != entry->rules.end(); i++) {
+            if (!rule_hosted[*i] && urls.pathMatches(*i, path, path_length))
+                matches.push_back(*i);
+        }
+    }
+    if (matches.size() != selected) {
+        std::sort(matches.begin(), matches.end());
+        matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+    }
+
+    // address scoped rules still in the running, with their longest prefix
+    ClientHits eligible;
+
+    size_t kept = 0;
+    for (size_t m = 0; m < matches.size(); m++) {
+        const unsigned rule = matches[m];
+        if (rule < rule_groups.size()) {
+            if (rule_users[rule] && (!entry ||
+                !std::binary_search(entry->rules.begin(), entry->rules.end(), rule)))
+                continue;
+
+            if (rule_clients[rule]) {
+                // a rule listed under several prefixes keeps the longest
+                unsigned best = 0;
+                bool found = false;
+                for (ClientHits::const_iterator h = hits.begin(); h != hits.end(); h++) {
+                    if (h->first != rule) continue;
+                    best = std::max(best, h->second);
+                    found = true;
+                }
+                if (!found) continue;
+                eligible.push_back(ClientHit(rule, best));
+            }
+        }
+        matches[kept++] = rule;
+    }
+    matches.resize(kept);
+
+    if (eligible.size() < 2) return;
+
+    // shorter prefixes in a group give way to longer ones
+    kept = 0;
+    for (size_t m = 0; m < matches.size(); m++) {
+        const unsigned rule = matches[m];
+        bool shadowed = false;
+        if (rule < rule_groups.size() && rule_clients[rule]) {
+            unsigned best = 0;
+            for (ClientHits::const_iterator e = eligible.begin(); e != eligible.end(); e++) {
+                if (e->first == rule) best = e->second;
+            }
+            for (ClientHits::const_iterator e = eligible.begin(); e != eligible.end() && !shadowed; e++) {
+                if (e->second > best && rule_groups[e->first] == rule_groups[rule])
+                    shadowed = true;
+            }
+        }
+        if (!shadowed) matches[kept++] = rule;
+    }
+    matches.resize(kept);
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
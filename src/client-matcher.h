@@ -0,0 +1,94 @@
+#ifndef _CLIENT_MATCHER_H
+#define _CLIENT_MATCHER_H
+
+// Longest user name we look up
+#define MAX_USER_LENGTH         256
+
+namespace Adapter
+{
+
+// One prefix of a path-compressed binary trie over 128-bit addresses;
+// IPv4 lives in the IPv4-mapped range (::ffff:0:0/96)
+class ClientNode
+{
+public:
+    ClientNode(const unsigned char *address, unsigned length);
+
+    unsigned char prefix[16]; // bits past length are zero
+    unsigned length; // in bits
+    int child[2]; // by the bit after the prefix, -1 for none
+    std::vector<unsigned> rules; // rules for this exact prefix
+};
+
+// A configured user name and the rules scoped to it
+class ClientUser
+{
+public:
+    std::string name; // lowercase, empty for a free slot
+    std::vector<unsigned> rules;
+};
+
+// Compiled client scopes (addresses and user names) of the configured
+// rules.  Addresses are looked up in a Patricia trie, so the cost does
+// not grow with the number of networks; user names in an open-addressed
+// hash table.  Unlike UrlMatcher, this one narrows down matches the URL
+// scopes have already selected, and adds the rules that have a client
+// scope but no host scope.
+class ClientMatcher
+{
+public:
+    ClientMatcher();
+
+    // clients are addresses or CIDR blocks, IPv4 or IPv6; rules of a
+    // group compete for the longest prefix.  Throws std::runtime_error
+    // for an address that does not parse.
+    void add(unsigned rule, size_t group, bool hosted,
+        const std::vector<std::string> &clients,
+        const std::vector<std::string> &users);
+    void compile(void);
+
+    // false when no rule is scoped by client
+    inline bool scoped(void) const { return has_clients || has_users; };
+    inline bool hasClients(void) const { return has_clients; };
+    inline bool hasUsers(void) const { return has_users; };
+
+    // adds the rules without a host scope that this client and path
+    // select, then drops the matches whose client scope does not fit; of
+    // the address scoped rules left in a group, only the longest prefix
+    // ones stay
+    void match(const libecap::Area &client, const libecap::Area &user,
+        const UrlMatcher &urls, const char *path, size_t path_length,
+        RuleMatches &matches) const;
+
+    // parses "address" or "address/length"; false if it does not
+    static bool ParseCidr(const std::string &text,
+        unsigned char *address, unsigned &length);
+
+protected:
+    typedef std::pair<unsigned, unsigned> ClientHit; // rule, prefix length
+    typedef std::vector<ClientHit, PoolAllocator<ClientHit> > ClientHits;
+
+    void insert(const unsigned char *address, unsigned length, unsigned rule);
+    void lookup(const unsigned char *address, ClientHits &hits) const;
+    const ClientUser *findUser(const char *name, size_t length) const;
+    void insertUser(const std::string &name, unsigned rule);
+
+    std::vector<ClientNode> nodes; // nodes[0] is the root, ::/0
+    std::vector<ClientUser> users; // power of two slots
+    size_t user_count;
+
+    // per rule
+    std::vector<size_t> rule_groups;
+    std::vector<unsigned char> rule_hosted; // found by UrlMatcher
+    std::vector<unsigned char> rule_clients; // scoped by address
+    std::vector<unsigned char> rule_users; // scoped by user name
+
+    bool has_clients;
+    bool has_users;
+};
+
+} // namespace Adapter
+
+#endif // _CLIENT_MATCHER_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
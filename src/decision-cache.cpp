@@ -0,0 +1,62 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <list>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <algorithm>
+#include <atomic>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "url-matcher.h"
+#include "decision-cache.h"
+
+bool Adapter::DecisionCache::find(const std::string &key,
+    uint64_t generation, RuleMatches &matches)
+{
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lg(s.lock);
+
+    std::unordered_map<std::string, Entry>::iterator i = s.entries.find(key);
+    if (i == s.entries.end() || i->second.generation != generation)
+        return false;
+
+    s.recency.splice(s.recency.begin(), s.recency, i->second.used);
+    matches.assign(i->second.rules.begin(), i->second.rules.end());
+    return true;
+}
+
+void Adapter::DecisionCache::insert(const std::string &key, uint64_t generation,
+    const RuleMatches &matches, size_t capacity)
+{
+    const size_t limit = std::max<size_t>(1, capacity / DECISION_SHARDS);
+
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lg(s.lock);
+
+    std::unordered_map<std::string, Entry>::iterator i = s.entries.find(key);
+    if (i == s.entries.end()) {
+        while (s.entries.size() >= limit) {
+            s.entries.erase(*s.recency.back());
+            s.recency.pop_back();
+        }
+
+        // element addresses survive rehashing, unlike iterators
+        i = s.entries.insert(std::make_pair(key, Entry())).first;
+        s.recency.push_front(&i->first);
+        i->second.used = s.recency.begin();
+    } else
+        s.recency.splice(s.recency.begin(), s.recency, i->second.used);
+
+    i->second.generation = generation;
+    i->second.rules.assign(matches.begin(), matches.end());
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,54 @@
+#ifndef _DECISION_CACHE_H
+#define _DECISION_CACHE_H
+
+// Independently locked parts of the cache
+#define DECISION_SHARDS         16
+
+namespace Adapter
+{
+
+// Rule matches remembered by whatever decided them (the host, a path
+// prefix, the client...), so that popular sites are matched once.  Each
+// shard evicts its least recently used entry when full.  Entries carry
+// the generation of the configuration that made them and only count
+// for that one, so a reload invalidates them all at once; they are
+// replaced as they are looked up again, or age out.
+class DecisionCache
+{
+public:
+    // any thread; false on a miss
+    bool find(const std::string &key, uint64_t generation, RuleMatches &matches);
+    // capacity is for the whole cache
+    void insert(const std::string &key, uint64_t generation,
+        const RuleMatches &matches, size_t capacity);
+
+protected:
+    typedef std::list<const std::string *> Recency; // keys, most recent first
+
+    class Entry
+    {
+    public:
+        uint64_t generation;
+        std::vector<unsigned> rules;
+        Recency::iterator used; // our place in Shard::recency
+    };
+
+    class Shard
+    {
+    public:
+        std::mutex lock; // Guards the rest
+        std::unordered_map<std::string, Entry> entries;
+        Recency recency; // points to the keys of entries
+    };
+
+    inline Shard &shard(const std::string &key)
+        { return shards[std::hash<std::string>()(key) % DECISION_SHARDS]; };
+
+    Shard shards[DECISION_SHARDS];
+};
+
+} // namespace Adapter
+
+#endif // _DECISION_CACHE_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
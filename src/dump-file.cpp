@@ -0,0 +1,61 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "adapter-log.h"
+#include "dump-file.h"
+
+// mkstemp() makes the file 0600; dumps are for monitoring to read
+bool Adapter::DumpFile(const std::string &filename, const std::string &image)
+{
+    std::vector<char> temporary(filename.begin(), filename.end());
+    const char suffix[] = ".XXXXXX";
+    temporary.insert(temporary.end(), suffix, suffix + sizeof(suffix));
+
+    int fd = mkstemp(&temporary[0]);
+    if (fd < 0) {
+        ADAPTER_LOG(LOG_ERR, "%s: %s: %s", __PRETTY_FUNCTION__,
+            &temporary[0], strerror(errno));
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < image.size()) {
+        ssize_t rc = write(fd, image.data() + written, image.size() - written);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) break;
+        written += rc;
+    }
+    bool ok = written == image.size() && fchmod(fd, 0644) == 0;
+    if (close(fd) < 0)
+        ok = false;
+    if (!ok) {
+        ADAPTER_LOG(LOG_ERR, "%s: %s: %s", __PRETTY_FUNCTION__,
+            &temporary[0], strerror(errno));
+        unlink(&temporary[0]);
+        return false;
+    }
+
+    if (rename(&temporary[0], filename.c_str()) < 0) {
+        ADAPTER_LOG(LOG_ERR, "%s: %s: %s", __PRETTY_FUNCTION__,
+            filename.c_str(), strerror(errno));
+        unlink(&temporary[0]);
+        return false;
+    }
+
+    return true;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,17 @@
+#ifndef _DUMP_FILE_H
+#define _DUMP_FILE_H
+
+namespace Adapter
+{
+
+// Replaces filename with image, whole: the image goes to a temporary
+// file of our own next to it (SMP workers may dump to the same file at
+// once), which is then renamed over it.  Logs and returns false on
+// errors, leaving filename as it was.
+bool DumpFile(const std::string &filename, const std::string &image);
+
+} // namespace Adapter
+
+#endif // _DUMP_FILE_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -4,72 +4,117 @@
 
 #include <iostream>
 #include <map>
+#include <deque>
+#include <list>
 #include <vector>
+#include <unordered_map>
+#include <functional>
 #include <string>
 #include <fstream>
 #include <stdexcept>
+#include <atomic>
+#include <new>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
 
 #include <libecap/common/registry.h>
 #include <libecap/common/errors.h>
 #include <libecap/common/message.h>
+#include <libecap/common/body.h>
 #include <libecap/common/header.h>
 #include <libecap/common/names.h>
 #include <libecap/host/host.h>
 #include <libecap/adapter/service.h>
 #include <libecap/adapter/xaction.h>
 #include <libecap/host/xaction.h>
+#include <libecap/common/memory.h>
 
 #include <syslog.h>
 #include <expat.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "expat-xml.h"
+#include "adapter-log.h"
+#include "adapter-stats.h"
+#include "latency-trace.h"
+#include "pool.h"
+#include "ascii-case.h"
+#include "body-buffer.h"
+#include "url-matcher.h"
+#include "decision-cache.h"
+#include "message-meta.h"
+#include "client-matcher.h"
+#include "html-scanner.h"
+#include "header-template.h"
+#include "adapter-config.h"
+#include "rule-index.h"
+#include "shared-state.h"
+#include "lookup.h"
 
-#define PACKAGE_CONFIG  "/etc/clearos/ecap-adapter.conf"
-
-class ConfigParser : public ExpatXmlParser
+// Not required, but adds clarity
+namespace Adapter
 {
-public:
-    ConfigParser(const std::string &filename);
 
-    virtual void Reset(void);
-    virtual void Parse(void);
-    virtual void ParseElementOpen(ExpatXmlTag *tag);
-    virtual void ParseElementClose(ExpatXmlTag *tag);
+static const libecap::Name headerContentEncoding("Content-Encoding", libecap::Name::NextId());
 
-protected:
-    std::string filename;
-};
+// Meta-information about adapted responses, see Xaction::option()
+static const libecap::Name optionPageTitle("X-Page-Title", libecap::Name::NextId());
+#define OPTION_PAGE_META_PREFIX "X-Page-Meta-"
+
+// Meta-information about every transaction, for %adapt::<last_h logging
+static const libecap::Name optionHeadersAdded("X-Adapter-Headers-Added", libecap::Name::NextId());
+static const libecap::Name optionBodyMode("X-Adapter-Body-Mode", libecap::Name::NextId());
 
-class TitleParser : public ExpatXmlParser
+// A header entry as it applies to one message, conditions resolved
+class HeaderEdit
 {
 public:
-    virtual void ParseElementOpen(ExpatXmlTag *tag);
-    virtual void ParseElementClose(ExpatXmlTag *tag);
+    HeaderEdit() : remove(false), add(true) { };
+
+    HeaderRef header; // from Config::header()
+    bool remove; // removeAny() first
+    bool add;
 };
 
-void TitleParser::ParseElementOpen(ExpatXmlTag *tag)
-{
-}
+typedef std::vector<HeaderEdit, PoolAllocator<HeaderEdit> > HeaderEdits;
 
-void TitleParser::ParseElementClose(ExpatXmlTag *tag)
-{
-}
+// Which of the matched entries name a header present in the message
+typedef std::vector<unsigned char, PoolAllocator<unsigned char> > HeaderPresence;
 
-namespace std
+class HeaderPresenceVisitor : public libecap::NamedValueVisitor
 {
-    typedef map<string, string> HeaderMap;
-}
+public:
+    HeaderPresenceVisitor(const HeaderEdits &edits, HeaderPresence &present)
+        : edits(edits), present(present) { };
 
-// Not required, but adds clarity
-namespace Adapter
+    virtual void visit(const libecap::Name &name, const libecap::Area &value);
+
+protected:
+    const HeaderEdits &edits;
+    HeaderPresence &present;
+};
+
+// How the virgin body (if any) becomes the adapted body
+typedef enum
 {
-using libecap::size_type;
+    bodyRelay, // hand host vb areas back as ab, never copied
+    bodyAdapt // pass vb through adaptContent(), which may rewrite it
+} BodyMode;
 
 class Service : public libecap::adapter::Service
 {
 public:
     Service();
+    virtual ~Service();
 
     // About
     virtual std::string uri() const; // unique across all vendors
@@ -79,31 +124,124 @@ public:
     // Configuration
     virtual void configure(const libecap::Options &config);
     virtual void reconfigure(const libecap::Options &config);
-    void addHeader(std::string &header, std::string &value);
 
     // Lifecycle
     virtual void start(); // expect makeXaction() calls
     virtual void stop(); // no more makeXaction() calls until start()
     virtual void retire(); // no more makeXaction() calls
+    void share(void); // with a ResponseService, which forwards its calls
 
     // Scope (XXX: this may be changed to look at the whole header)
     virtual bool wantsUrl(const char *url) const;
+    bool wantsResponses(void) const; // for ResponseService::wantsUrl()
+
+    // Asynchronous transactions, waiting for lookups
+    virtual bool makesAsyncXactions() const;
+    virtual void suspend(timeval &timeout); // shortens it while lookups run
+    virtual void resume(); // tells transactions of their answers
 
     // Work
     virtual libecap::adapter::Service::MadeXactionPointer makeXaction(libecap::host::Xaction *hostx);
 
 protected:
+    BodyMode bodyMode(const Config &config, libecap::host::Xaction *hostx,
+        const MessageMeta &meta) const;
+
+    void attach(void); // to shared_name, once
+    void reload(void); // loads config_file, keeping the old snapshot on errors
+    void publish(const ConfigPointer &snapshot);
+    const ConfigPointer &current(void) const;
+
+    void startWatcher(void);
+    void stopWatcher(void);
+    void watch(unsigned reload_interval, unsigned stats_interval,
+        std::string stats_file, std::string trace_file, bool trace_signal); // watcher thread
+    void checkConfig(std::string &last); // reloads if changed
+    std::string stamp(const Config &config) const; // of its files and config_file
+    ConfigPointer latest(void) const; // any thread; published or current
+    void dumpStats(void) const; // on stop, if stats or trace files are configured
+
     std::string config_file; // Adapter configuration file
+    std::string loaded_stamp; // stamp() of the last snapshot loaded
+    std::string shared_name; // Shared memory segment, empty for none
+    SharedStatePointer shared; // Attached to shared_name, before stats
+
+    // The host thread works with config; any thread may publish a new
+    // snapshot, which the host thread adopts on its next current() call
+    mutable ConfigPointer config; // Loaded configuration snapshot
+    mutable ConfigPointer config_pending; // Published, not yet adopted
+    mutable std::mutex config_lock; // Guards config_pending
+    mutable std::atomic<bool> config_changed;
+
+    mutable Stats stats; // Updated by transactions, and wantsUrl()
+    mutable LatencyTrace trace; // Of sampled transactions
+    BodyBudget budget; // Shared by transactions adapting bodies
+    LookupQueue lookups; // Of transactions waiting for lookups
+    mutable DecisionCache decisions; // Rule matches, by DecisionKey()
+
+    std::thread watcher; // Reloads config_file, dumps stats and traces
+    std::mutex watcher_lock;
+    std::condition_variable watcher_wake;
+    bool watching;
+
+    unsigned owners; // Us and ResponseServices not yet retired
+    unsigned users; // Of those, started and not yet stopped
+};
+
+// The same service under a second URI, for respmod_precache: Squid
+// configures, starts and stops it like any other, and every call goes
+// to the one Service, so rules are loaded once for both and counted
+// together; the core only stops when both have.  Transactions tell
+// requests from responses themselves.
+class ResponseService : public libecap::adapter::Service
+{
+public:
+    ResponseService(Adapter::Service &core) : core(core) { core.share(); };
+
+    // About
+    virtual std::string uri() const;
+    virtual std::string tag() const { return core.tag(); };
+    virtual void describe(std::ostream &os) const { core.describe(os); };
 
-    std::HeaderMap headers; // Custom headers map
+    // Configuration
+    virtual void configure(const libecap::Options &config) { core.configure(config); };
+    virtual void reconfigure(const libecap::Options &config) { core.reconfigure(config); };
+
+    // Lifecycle
+    virtual void start() { core.start(); };
+    virtual void stop() { core.stop(); };
+    virtual void retire() { core.retire(); };
+
+    // Scope
+    virtual bool wantsUrl(const char *url) const
+        { return core.wantsResponses() && core.wantsUrl(url); };
+
+    // Asynchronous transactions
+    virtual bool makesAsyncXactions() const { return core.makesAsyncXactions(); };
+    virtual void suspend(timeval &timeout) { core.suspend(timeout); };
+    virtual void resume() { core.resume(); };
+
+    // Work
+    virtual libecap::adapter::Service::MadeXactionPointer makeXaction(libecap::host::Xaction *hostx)
+        { return core.makeXaction(hostx); };
+
+protected:
+    Adapter::Service &core; // registered before us, and gone after
 };
 
-class Xaction : public libecap::adapter::Xaction
+class Xaction : public libecap::adapter::Xaction, public LookupClient
 {
 public:
-    Xaction(libecap::host::Xaction *x, const std::HeaderMap &headers);
+    Xaction(libecap::host::Xaction *x, const MessageMeta &meta,
+        const ConfigPointer &config, BodyMode bodyMode, Stats &stats,
+        BodyBudget &budget, LookupQueue &lookups, DecisionCache &decisions,
+        LatencyTrace &trace);
     virtual ~Xaction();
 
+    // transactions come and go at request rate; recycle their memory
+    static void *operator new(size_t size) { return Pool::Allocate(size); };
+    static void operator delete(void *p, size_t size) { Pool::Release(p, size); };
+
     // meta-information for the host transaction
     virtual const libecap::Area option(const libecap::Name &name) const;
     virtual void visitEachOption(libecap::NamedValueVisitor &visitor) const;
@@ -111,6 +249,10 @@ public:
     // lifecycle
     virtual void start();
     virtual void stop();
+    virtual void resume(); // once the host learns that lookups are done
+
+    // LookupClient API, while start() waits
+    virtual void noteLookup(unsigned number, const std::string &value);
 
     // adapted body transmission control
     virtual void abDiscard();
@@ -130,17 +272,46 @@ public:
     virtual bool callable() const;
 
 protected:
-    void adaptContent(std::string &chunk) const; // converts vb to ab
+    void adaptContent(const libecap::Area &chunk); // converts vb to ab
+    void pullVb(); // moves available vb into the ab buffer
     void stopVb(); // stops receiving vb (if we are receiving it)
+    void finishAb(); // tells the host that all ab has been made
     libecap::host::Xaction *lastHostCall(); // clears hostx
+    void collectValues(unsigned uses, TemplateValues &values) const;
+    void matchRules(); // selects the configured headers for this request
+    void planHeaders(); // turns the selected headers into edits
+    bool reserveBody(); // false if the body is too large to adapt
+    bool lookUp(); // false while the values of some templates are looked up
+    void adaptHeader(const std::chrono::steady_clock::time_point &begin);
     void getUri();
+    HeaderDirection direction() const; // of the virgin message
+    void noteStarted(const std::chrono::steady_clock::time_point &begin);
 
 private:
     libecap::host::Xaction *hostx; // Host transaction rep
-
-    std::string buffer; // for content adaptation
-
-    const std::HeaderMap headers;
+    const MessageMeta meta; // about the virgin message and its request
+
+    BodyBuffer buffer; // for content adaptation
+    HtmlScanner *scanner; // for HTML responses
+
+    const ConfigPointer config; // pinned for the whole transaction
+    RuleMatches matches; // configured headers that apply, by rule number
+    HeaderEdits edits; // what they do to this message
+
+    BodyMode bodyMode; // bodyAdapt may fall back to bodyRelay in start()
+    Stats &stats; // of the service that made us
+    BodyBudget &budget; // of the service that made us
+    size_type reserved; // our share of the budget
+    LookupQueue &lookups; // of the service that made us
+    LookupResults *looked; // NULL unless templates use lookups
+    DecisionCache &decisions; // of the service that made us
+    LatencyTrace &trace; // of the service that made us
+    TraceSpan traceSpan; // ours, if sampled
+    unsigned headersAdded; // custom headers added to the adapted message
+
+    bool vbAvailable; // vb content waiting at the host
+    bool vbDone; // the host has no more vb to produce
+    bool vbAtEnd; // and it has produced all of it
 
     typedef enum
     {
@@ -154,269 +325,800 @@ private:
     OperationState sendingAb;
 };
 
+// deletes transactions through their own class, so that they go back
+// to the pool with the right size
+class XactionDeleter
+{
+public:
+    void operator()(Xaction *xaction) const { delete xaction; };
+};
+
 } // namespace Adapter
 
-ConfigParser::ConfigParser(const std::string &filename)
-    : ExpatXmlParser(), filename(filename) { }
+Adapter::Service::Service()
+    : config_file(PACKAGE_CONFIG), config(new Config),
+    config_changed(false), watching(false), owners(1), users(0)
+{
+    Log::Open();
+}
 
-void ConfigParser::Reset(void)
+Adapter::Service::~Service()
 {
-    ExpatXmlParser::Reset();
+    stopWatcher();
+    Log::Close();
 }
 
-void ConfigParser::Parse(void)
+std::string Adapter::Service::uri() const
 {
-    std::ifstream config(PACKAGE_CONFIG);
-    if (!config.is_open()) throw std::runtime_error("Open error");
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    return "ecap://clearfoundation.com/ecap-adapter";
+}
 
-    std::string buffer;
-    buffer.reserve(4096);
+std::string Adapter::ResponseService::uri() const
+{
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    return "ecap://clearfoundation.com/ecap-adapter/response";
+}
 
-    do {
-        std::getline(config, buffer);
-        done = config.eof();
-        ExpatXmlParser::Parse(buffer);
-    } while (!done);
+std::string Adapter::Service::tag() const
+{
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    return PACKAGE_VERSION;
 }
 
-void ConfigParser::ParseElementOpen(ExpatXmlTag *tag)
+void Adapter::Service::describe(std::ostream &os) const
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, "%s: %s",
-        __PRETTY_FUNCTION__, tag->GetName().c_str());
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    os << PACKAGE_NAME << " v" << PACKAGE_VERSION
+        << ": Edit HTTP headers of requests and responses.";
+}
 
-    //Adapter::Service *service = static_cast<Adapter::Service *>(priv_data);
+// squid.conf: ecap_service ... config=/path/to/ecap-adapter.conf
+//     [shared=/clearos-ecap-adapter]
+void Adapter::Service::configure(const libecap::Options &config)
+{
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
 
-    if ((*tag) == "header") {
-        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
-            ParseError("unexpected tag: " + tag->GetName());
-        if (!tag->ParamExists("name"))
-            ParseError("parameter missing: " + tag->GetName());
+    const libecap::Area file = config.option(libecap::Name("config"));
+    if (file.size)
+        config_file = file.toString();
 
-        std::string *name = new std::string(tag->GetParamValue("name"));
-        tag->SetData(static_cast<void *>(name));
-    }
+    const libecap::Area segment = config.option(libecap::Name("shared"));
+    if (segment.size)
+        shared_name = segment.toString();
 }
 
-void ConfigParser::ParseElementClose(ExpatXmlTag *tag)
+// the new file is loaded to the side; transactions already running keep
+// the snapshot they started with
+void Adapter::Service::reconfigure(const libecap::Options &config)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, "%s: %s",
-        __PRETTY_FUNCTION__, tag->GetName().c_str());
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+
+    stopWatcher();
+    configure(config);
+    attach();
+    reload();
+    current();
+    startWatcher();
+}
 
-    std::string value = tag->GetText();
-    Adapter::Service *service = static_cast<Adapter::Service *>(priv_data);
+void Adapter::Service::share(void)
+{
+    owners++;
+}
 
-    if ((*tag) == "header") {
-        if (!stack.size() || (*stack.back()) != "clearos-ecap-adapter")
-            ParseError("unexpected tag: " + tag->GetName());
-        if (!value.size())
-            ParseError("missing value for tag: " + tag->GetName());
+// with a ResponseService registered, Squid starts, stops and retires
+// the core once for each vectoring point configured; the watcher and
+// the dumps serve both, so only the first start and the last stop or
+// retire count
+void Adapter::Service::start()
+{
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    if (users++) return;
+    libecap::adapter::Service::start();
 
-        std::string *name = static_cast<std::string *>(tag->GetData());
-        service->addHeader(*name, value);
-        delete name;
-    }
+    attach();
+    reload();
+    current();
+    startWatcher();
 }
 
-Adapter::Service::Service()
+void Adapter::Service::stop()
 {
-    openlog(PACKAGE_TARNAME, LOG_PID, LOG_LOCAL0);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    if (!users || --users) return;
+    stopWatcher();
+    dumpStats();
+    stats.publish();
+    LatencyTrace::Catch(false);
+    Pool::LogStats(LOG_INFO);
+    libecap::adapter::Service::stop();
 }
 
-std::string Adapter::Service::uri() const
+void Adapter::Service::retire()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
-    return "ecap://clearfoundation.com/ecap-adapter";
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    if (owners > 1) {
+        owners--;
+        return;
+    }
+    users = 0;
+    stopWatcher();
+    dumpStats();
+    stats.publish();
+    LatencyTrace::Catch(false);
+    Pool::LogStats(LOG_INFO);
+    libecap::adapter::Service::stop();
 }
 
-std::string Adapter::Service::tag() const
+// SMP workers of one box share rules and statistics; a new name only
+// takes effect on restart, since the counters would start over
+void Adapter::Service::attach(void)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
-    return PACKAGE_VERSION;
+    if (shared || !shared_name.size()) return;
+
+    try {
+        shared = SharedState::Open(shared_name);
+        stats.share(shared.get());
+    } catch (std::runtime_error &e) {
+        ADAPTER_LOG(LOG_ERR, "%s: %s: not sharing", __PRETTY_FUNCTION__, e.what());
+    }
 }
 
-void Adapter::Service::describe(std::ostream &os) const
+// the service is started and reconfigured once for each vectoring point
+// it serves, so a file loaded already is not parsed again unless one of
+// the files it came from has changed since
+void Adapter::Service::reload(void)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
-    os << PACKAGE_NAME << " v" << PACKAGE_VERSION
-        << ": Append custom HTTP headers to requests.";
+    if (loaded_stamp.size() && stamp(*latest()) == loaded_stamp) {
+        ADAPTER_LOG(LOG_DEBUG, "%s: %s: unchanged", __PRETTY_FUNCTION__, config_file.c_str());
+        return;
+    }
+
+    try {
+        const ConfigPointer snapshot = Config::Load(config_file, shared.get());
+        publish(snapshot);
+        loaded_stamp = stamp(*snapshot);
+        ADAPTER_LOG(LOG_INFO, "%s: %s: loaded", __PRETTY_FUNCTION__, config_file.c_str());
+    } catch (ExpatXmlParseException &e) {
+        ADAPTER_LOG(LOG_ERR, "%s: %s: Parse error: %s, line: %d, column: %d",
+            __PRETTY_FUNCTION__, config_file.c_str(), e.what(), e.row, e.col);
+    } catch (std::runtime_error &e) {
+        ADAPTER_LOG(LOG_ERR, "%s: %s", __PRETTY_FUNCTION__, e.what());
+    }
 }
 
-void Adapter::Service::configure(const libecap::Options &config)
+void Adapter::Service::publish(const ConfigPointer &snapshot)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    std::lock_guard<std::mutex> lg(config_lock);
+    config_pending = snapshot;
+    config_changed.store(true, std::memory_order_release);
 }
 
-void Adapter::Service::reconfigure(const libecap::Options &config)
+// host thread only; unless something was published, this is a single load
+const Adapter::ConfigPointer &Adapter::Service::current(void) const
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    if (!config_changed.load(std::memory_order_acquire))
+        return config;
+
+    ConfigPointer previous = config;
+    {
+        std::lock_guard<std::mutex> lg(config_lock);
+        config.swap(config_pending);
+        config_pending.reset();
+        config_changed.store(false, std::memory_order_relaxed);
+    }
+
+    Log::SetLevel(config->logLevel());
+    if (config->logQueue() != previous->logQueue())
+        Log::SetAsync(config->logQueue());
+    Pool::SetLimit(config->poolLimit());
+    trace.configure(config->traceSample(), config->traceEvents());
+    LatencyTrace::Catch(config->traceSignal());
+
+    return config;
 }
 
-void Adapter::Service::addHeader(std::string &header, std::string &value)
+// the intervals and the stats and trace files are read when the watcher
+// starts, so changes to them take effect on the next reconfigure
+void Adapter::Service::startWatcher(void)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, "%s: %s: %s",
-        __PRETTY_FUNCTION__, header.c_str(), value.c_str());
+    const ConfigPointer &config = current();
+    const unsigned reload_interval = config->reloadInterval();
+    const unsigned stats_interval = (config->statsFile().size()) ? config->statsInterval() : 0;
+    const bool trace_signal = config->traceSignal();
+    if (watching || (!reload_interval && !stats_interval && !trace_signal)) return;
+
+    watching = true;
+    watcher = std::thread(&Adapter::Service::watch, this, reload_interval,
+        stats_interval, config->statsFile(), config->traceFile(), trace_signal);
+}
 
-    headers[header] = value;
+void Adapter::Service::stopWatcher(void)
+{
+    {
+        std::lock_guard<std::mutex> lg(watcher_lock);
+        if (!watching) return;
+        watching = false;
+    }
+    watcher_wake.notify_one();
+    watcher.join();
 }
 
-void Adapter::Service::start()
+// wakes up for whichever of its jobs is due next; the trace is dumped
+// with the stats, and within LATENCY_TRACE_POLL seconds of a SIGUSR2
+void Adapter::Service::watch(unsigned reload_interval, unsigned stats_interval,
+    std::string stats_file, std::string trace_file, bool trace_signal)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
-    libecap::adapter::Service::start();
+    typedef std::chrono::steady_clock Clock;
 
-    try {
-        ConfigParser parser(PACKAGE_CONFIG);
-        parser.SetPrivateData(static_cast<void *>(this));
-        parser.Parse();
-    } catch (ExpatXmlParseException &e) {
-        syslog(LOG_LOCAL0 | LOG_DEBUG,
-            "%s: %s: Parse error: %s", __PRETTY_FUNCTION__, PACKAGE_CONFIG, e.what());
-    } catch (std::runtime_error &e) {
-        syslog(LOG_LOCAL0 | LOG_DEBUG,
-            "%s: %s", __PRETTY_FUNCTION__, e.what());
+    std::string last = stamp(*latest());
+
+    Clock::time_point next_reload = Clock::now() + std::chrono::seconds(reload_interval);
+    Clock::time_point next_stats = Clock::now() + std::chrono::seconds(stats_interval);
+
+    std::unique_lock<std::mutex> ul(watcher_lock);
+    for ( ;; ) {
+        Clock::time_point wake = Clock::time_point::max();
+        if (reload_interval) wake = next_reload;
+        if (stats_interval) wake = std::min(wake, next_stats);
+        if (trace_signal)
+            wake = std::min(wake, Clock::now() + std::chrono::seconds(LATENCY_TRACE_POLL));
+
+        if (watcher_wake.wait_until(ul, wake, [this] { return !watching; }))
+            break;
+
+        const Clock::time_point now = Clock::now();
+        ul.unlock();
+        if (reload_interval && now >= next_reload) {
+            next_reload = now + std::chrono::seconds(reload_interval);
+            checkConfig(last);
+        }
+        bool dump_trace = trace_signal && LatencyTrace::Requested();
+        if (stats_interval && now >= next_stats) {
+            next_stats = now + std::chrono::seconds(stats_interval);
+            stats.dump(stats_file);
+            dump_trace = true;
+        }
+        if (dump_trace && trace_file.size())
+            trace.dump(trace_file);
+        ul.lock();
     }
+}
 
-#if 0
-    std::ifstream config(PACKAGE_CONFIG);
+// reloads the configuration file after every change to it or to the
+// list files and rule index it names (which the compiler replaces by
+// renaming); a file that fails to load is not retried until it changes
+// again
+void Adapter::Service::checkConfig(std::string &last)
+{
+    const std::string now = stamp(*latest());
+    if (now == last) return;
 
-    if (config.is_open()) {
-        Adapter::Service::headers.clear();
+    last = now;
+    reload();
+}
 
-        while (config.good()) {
-            std::string header;
-            std::getline(config, header, ':');
-            if (!header.length()) continue;
-            std::string value;
-            std::getline(config, value);
-            syslog(LOG_LOCAL0 | LOG_DEBUG, "%s: \"%s\": \"%s\"", __PRETTY_FUNCTION__,
-                header.c_str(), value.c_str());
-            Adapter::Service::headers[header] = value;
+// the name, inode, size and modification time of every file, or "-" for
+// the ones that cannot be read
+std::string Adapter::Service::stamp(const Config &config) const
+{
+    std::vector<std::string> files(1, config_file);
+    files.insert(files.end(), config.sources().begin(), config.sources().end());
+
+    std::string text;
+    for (size_t i = 0; i < files.size(); i++) {
+        struct stat st;
+        char line[96];
+        if (stat(files[i].c_str(), &st) < 0)
+            snprintf(line, sizeof(line), " -\n");
+        else {
+            snprintf(line, sizeof(line), " %lu %lu %ld.%09ld\n", (unsigned long)st.st_ino,
+                (unsigned long)st.st_size, (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
         }
-        config.close();
+        text += files[i];
+        text += line;
     }
-#endif
+    return text;
 }
 
-void Adapter::Service::stop()
+// config is only written under config_lock, so reading it there is safe
+// from any thread
+Adapter::ConfigPointer Adapter::Service::latest(void) const
 {
-    // custom code would go here, but this service does not have one
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
-    libecap::adapter::Service::stop();
+    std::lock_guard<std::mutex> lg(config_lock);
+    return (config_pending) ? config_pending : config;
 }
 
-void Adapter::Service::retire()
+void Adapter::Service::dumpStats(void) const
 {
-    // custom code would go here, but this service does not have one
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
-    libecap::adapter::Service::stop();
+    const ConfigPointer &config = current();
+    if (config->statsFile().size())
+        stats.dump(config->statsFile());
+    if (config->traceFile().size())
+        trace.dump(config->traceFile());
 }
 
+// whatever rule matching looks at: the host (case-insensitively), no
+// more of the path than the longest path prefix, the client and the user
+static void DecisionKey(std::string &key, char kind,
+    const libecap::Area &host, const libecap::Area &path, size_t path_length,
+    const libecap::Area &client, const libecap::Area &user)
+{
+    key.assign(1, kind);
+    key.append(host.start, host.size);
+    Adapter::AsciiCase::Lower(&key[1], &key[1], host.size);
+    key.push_back('\n');
+    key.append(path.start, std::min<size_t>(path.size, path_length));
+    key.push_back('\n');
+    key.append(client.start, client.size);
+    key.push_back('\n');
+    const size_t user_start = key.size();
+    key.append(user.start, user.size);
+    Adapter::AsciiCase::Lower(&key[user_start], &key[user_start], user.size);
+}
+
+static inline size_t PathLength(const Adapter::Config &config)
+{
+    const Adapter::RuleIndexPointer &index = config.index();
+    return std::max(config.urlMatcher().pathLength(), (index) ? index->pathLength() : 0);
+}
+
+// lets the host skip us for URLs none of the configured headers apply
+// to; answers are cached like rule matches, as one rule for yes.  They
+// do not tell requests from responses: the host may use this URI for
+// both, and ResponseService only asks once wantsResponses() is true.
+// Squid passes the path alone: with host scoped rules, that is always
+// a yes, and keys hold a host only if some rule is scoped by one.
 bool Adapter::Service::wantsUrl(const char *url) const
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, "%s: %s", __PRETTY_FUNCTION__, url);
-    return true; // no-op is applied to all messages
+    ADAPTER_TRACE("%s: %s", __PRETTY_FUNCTION__, url);
+    const ConfigPointer &config = current();
+    if (config->htmlScanning())
+        return true;
+
+    const char *host, *path;
+    size_t host_length, path_length;
+    UrlMatcher::SplitUrl(url, strlen(url), host, host_length, path, path_length);
+    const bool hosted = config->urlMatcher().hostScoped() ||
+        (config->index() && config->index()->hostScoped());
+    if (hosted && !host_length)
+        return true;
+
+    static thread_local std::string key;
+    RuleMatches answer;
+    const bool cached = config->cacheSize() && (config->urlMatcher().scoped() || config->index());
+    if (cached) {
+        DecisionKey(key, 'w', libecap::Area(host, (hosted) ? host_length : 0),
+            libecap::Area(path, path_length), PathLength(*config), libecap::Area(), libecap::Area());
+
+        if (decisions.find(key, config->generation(), answer)) {
+            stats.count(Stats::decisionHits);
+            return answer.size() != 0;
+        }
+        stats.count(Stats::decisionMisses);
+    }
+
+    const bool wanted = config->urlMatcher().matchesAny(url) ||
+        (config->index() && config->index()->matchesAny(url));
+    if (cached) {
+        answer.assign(wanted, 0);
+        decisions.insert(key, config->generation(), answer, config->cacheSize());
+    }
+    return wanted;
+}
+
+bool Adapter::Service::wantsResponses(void) const
+{
+    const ConfigPointer &config = current();
+    return config->htmlScanning() || config->edits(directionResponse);
+}
+
+// the host calls suspend() and resume() around every wait of its event
+// loop; lookups are few enough that polling while they run is cheap
+bool Adapter::Service::makesAsyncXactions() const
+{
+    return true;
+}
+
+void Adapter::Service::suspend(timeval &timeout)
+{
+    if (!lookups.waiting()) return;
+
+    if (timeout.tv_sec > 0 || timeout.tv_usec > LOOKUP_POLL * 1000) {
+        timeout.tv_sec = 0;
+        timeout.tv_usec = LOOKUP_POLL * 1000;
+    }
+}
+
+void Adapter::Service::resume()
+{
+    lookups.deliver();
 }
 
 libecap::adapter::Service::MadeXactionPointer Adapter::Service::makeXaction(libecap::host::Xaction *hostx)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
-    return Adapter::Service::MadeXactionPointer(new Adapter::Xaction(hostx, headers));
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    const ConfigPointer &config = current();
+
+    // the shared pointer's control block comes from the pool as well
+    const MessageMeta meta(hostx);
+    Adapter::Xaction *xaction = new Adapter::Xaction(hostx, meta, config,
+        bodyMode(*config, hostx, meta), stats, budget, lookups, decisions, trace);
+    return Adapter::Service::MadeXactionPointer(xaction,
+        XactionDeleter(), PoolAllocator<Adapter::Xaction>());
+}
+
+// header rules never need the body, so only HTML responses we can read
+// (uncompressed text/html) go through adaptContent(); everything else
+// is relayed untouched instead of passing through our own buffer
+Adapter::BodyMode Adapter::Service::bodyMode(const Config &config,
+    libecap::host::Xaction *hostx, const MessageMeta &meta) const
+{
+    if (!config.htmlScanning()) return bodyRelay;
+
+    const libecap::Message &virgin = hostx->virgin();
+    if (!virgin.body()) return bodyRelay;
+    if (meta.adaptingRequest()) return bodyRelay;
+
+    const libecap::Area &type = meta.contentType();
+    static const char html[] = "text/html";
+    const size_type length = sizeof(html) - 1;
+    if (type.size < length || !AsciiCase::Equal(type.start, html, length))
+        return bodyRelay;
+    if (type.size > length && type.start[length] != ';' && type.start[length] != ' ')
+        return bodyRelay;
+
+    const libecap::Header &header = virgin.header();
+    if (header.hasAny(headerContentEncoding)) {
+        const libecap::Area encoding = header.value(headerContentEncoding);
+        if (encoding.size != 8 || !AsciiCase::Equal(encoding.start, "identity", 8))
+            return bodyRelay;
+    }
+
+    return bodyAdapt;
 }
 
-Adapter::Xaction::Xaction(libecap::host::Xaction *x, const std::HeaderMap &headers)
-    : hostx(x), headers(headers), receivingVb(opUndecided), sendingAb(opUndecided)
+Adapter::Xaction::Xaction(libecap::host::Xaction *x, const MessageMeta &meta,
+    const ConfigPointer &config, BodyMode bodyMode, Stats &stats,
+    BodyBudget &budget, LookupQueue &lookups, DecisionCache &decisions,
+    LatencyTrace &trace)
+    : hostx(x), meta(meta), buffer(config->bodyWindow()), scanner(NULL),
+    config(config), bodyMode(bodyMode),
+    stats(stats), budget(budget), reserved(0),
+    lookups(lookups), looked(NULL), decisions(decisions), trace(trace), headersAdded(0),
+    vbAvailable(false), vbDone(false), vbAtEnd(false),
+    receivingVb(opUndecided), sendingAb(opUndecided)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+
+    if (bodyMode == bodyAdapt)
+        scanner = new HtmlScanner(config->htmlInject(), config->htmlLimit());
 }
 
 Adapter::Xaction::~Xaction()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     if (libecap::host::Xaction *x = hostx) {
         hostx = 0;
+        stats.count(Stats::xactionsAborted);
         x->adaptationAborted();
     }
+    trace.note(traceSpan, LatencyTrace::eventEnd);
+    if (reserved)
+        budget.release(reserved);
+    if (looked) {
+        if (looked->ticket)
+            lookups.detach(looked->ticket);
+        delete looked;
+    }
+    delete scanner;
 }
 
-const libecap::Area Adapter::Xaction::option(const libecap::Name &) const {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+static libecap::Area NumberArea(unsigned long number)
+{
+    char buffer[24];
+    const int length = snprintf(buffer, sizeof(buffer), "%lu", number);
+    return libecap::Area::FromTempBuffer(buffer, length);
+}
+
+static const char *body_modes[] = { "relay", "adapt" };
+
+const libecap::Area Adapter::Xaction::option(const libecap::Name &name) const {
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+
+    if (name == optionHeadersAdded)
+        return NumberArea(headersAdded);
+    if (name == optionBodyMode)
+        return libecap::Area(body_modes[bodyMode], strlen(body_modes[bodyMode]));
+
+    if (scanner && name == optionPageTitle && scanner->title().size())
+        return libecap::Area::FromTempString(scanner->title());
+
     return libecap::Area();
 }
 
-void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &) const {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &visitor) const {
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+
+    visitor.visit(optionHeadersAdded, NumberArea(headersAdded));
+    visitor.visit(optionBodyMode,
+        libecap::Area(body_modes[bodyMode], strlen(body_modes[bodyMode])));
+
+    if (!scanner) return;
+
+    if (scanner->title().size())
+        visitor.visit(optionPageTitle, libecap::Area::FromTempString(scanner->title()));
+
+    const HtmlMetaList &meta = scanner->meta();
+    for (HtmlMetaList::const_iterator i = meta.begin(); i != meta.end(); i++) {
+        const libecap::Name name(OPTION_PAGE_META_PREFIX + i->first);
+        visitor.visit(name, libecap::Area::FromTempString(i->second));
+    }
 }
 
 void Adapter::Xaction::start()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+
+    Must(hostx);
+
+    trace.begin(traceSpan);
+    std::chrono::steady_clock::time_point begin;
+    if (stats.sampleStart())
+        begin = std::chrono::steady_clock::now();
+
+#ifdef ENABLE_DEBUG_TRACE
+    // the URI and content type are only looked up to be logged
+    if (Log::Enabled(LOG_DEBUG)) {
+        getUri();
+
+        const libecap::Area &type = meta.contentType();
+        if (!type.size)
+            ADAPTER_TRACE("%s: No content type", __PRETTY_FUNCTION__);
+        else {
+            ADAPTER_TRACE("%s: Content type: %.*s",
+                __PRETTY_FUNCTION__, (int)type.size, type.start);
+        }
+    }
+#endif
+
+    // header rules for whichever message this is
+    if (config->edits(direction())) {
+        matchRules();
+        planHeaders();
+    }
+
+    const bool virginBody = hostx->virgin().body() != NULL;
+
+    // a body we cannot afford to hold passes through untouched
+    if (bodyMode == bodyAdapt && virginBody && !reserveBody()) {
+        bodyMode = bodyRelay;
+        delete scanner;
+        scanner = NULL;
+        stats.count(Stats::bodiesBypassed);
+    }
+
+    if (virginBody)
+        stats.count((bodyMode == bodyRelay) ? Stats::bodiesRelayed : Stats::bodiesAdapted);
+
+    if (edits.empty() && bodyMode == bodyRelay) {
+        // nothing to edit: let the host keep the virgin message, body and all
+        receivingVb = opNever;
+        sendingAb = opNever;
+        noteStarted(begin);
+        trace.note(traceSpan, LatencyTrace::eventUseVirgin);
+        lastHostCall()->useVirgin();
+        return;
+    }
+
+    // the host waits for resume() while values are looked up
+    if (!lookUp()) {
+        libecap::Delay delay;
+        delay.state = "lookup";
+        trace.note(traceSpan, LatencyTrace::eventDelayed);
+        hostx->adaptationDelayed(delay);
+        return;
+    }
 
-    getUri();
+    adaptHeader(begin);
+}
+
+// only transactions start() left waiting for lookups; they are not timed
+void Adapter::Xaction::resume()
+{
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
 
     Must(hostx);
+    Must(looked && !looked->pending);
+    trace.note(traceSpan, LatencyTrace::eventResumed);
+    adaptHeader(std::chrono::steady_clock::time_point());
+}
+
+void Adapter::Xaction::noteLookup(unsigned number, const std::string &value)
+{
+    ADAPTER_TRACE("%s: %u", __PRETTY_FUNCTION__, number);
+
+    looked->values[number] = value;
+    if (--looked->pending) return;
+
+    lookups.detach(looked->ticket);
+    looked->ticket = 0;
+    if (hostx)
+        hostx->resume();
+}
+
+// the lookups the planned edits need, from the cache where possible
+bool Adapter::Xaction::lookUp()
+{
+    unsigned needed = 0;
+    for (HeaderEdits::const_iterator i = edits.begin(); i != edits.end(); i++) {
+        if (i->add && i->header.value_template)
+            needed |= i->header.value_template->lookups();
+    }
+    if (!needed) return true;
+
+    const std::vector<LookupPointer> &list = config->lookups();
+    unsigned keys = 0;
+    for (size_t n = 0; n < list.size(); n++) {
+        if (needed & (1U << n))
+            keys |= TemplateValues::Bit(list[n]->key());
+    }
+    TemplateValues values;
+    collectValues(keys, values);
+
+    looked = new LookupResults;
+    for (size_t n = 0; n < list.size(); n++) {
+        if (!(needed & (1U << n))) continue;
+
+        // no key, no value
+        const libecap::Area &area = values.values[list[n]->key()];
+        if (!area.size) continue;
+        const std::string key(area.start, area.size);
+        if (list[n]->cached(key, looked->values[n])) continue;
+
+        if (!looked->ticket)
+            looked->ticket = lookups.attach(this);
+        lookups.submit(looked->ticket, list[n], n, key);
+        looked->pending++;
+    }
+
+    return !looked->pending;
+}
 
-    if (hostx->virgin().body()) {
+// everything start() does once the values of the templates are known
+void Adapter::Xaction::adaptHeader(const std::chrono::steady_clock::time_point &begin)
+{
+    const bool virginBody = hostx->virgin().body() != NULL;
+    if (virginBody) {
         receivingVb = opOn;
+        trace.note(traceSpan, LatencyTrace::eventVbOn);
         hostx->vbMake(); // ask host to supply virgin body
     } else {
         // we are not interested in vb if there is not one
         receivingVb = opNever;
     }
 
-    std::string content_type("application/octect-stream");
-    const libecap::Name content_type_header("Content-Type");
-    const libecap::Header &header = hostx->virgin().header();
-    if (!header.hasAny(content_type_header))
-        syslog(LOG_LOCAL0 | LOG_DEBUG, "%s: No content type", __PRETTY_FUNCTION__);
-    else {
-        const libecap::Area type = header.value(content_type_header);
-        content_type = std::string(type.start, type.size);
-        syslog(LOG_LOCAL0 | LOG_DEBUG, "%s: Content type: %s",
-            __PRETTY_FUNCTION__, content_type.c_str());
-    }
-
     // adapt message header
     libecap::shared_ptr<libecap::Message> adapted = hostx->virgin().clone();
     Must(adapted != 0);
 
     // delete ContentLength header because we may change the length
     // unknown length may have performance implications for the host
-    // adapted->header().removeAny(libecap::headerContentLength);
+    if (scanner && config->htmlInject() != HtmlScanner::injectNone)
+        adapted->header().removeAny(libecap::headerContentLength);
+
+    // edit custom header(s)
+    libecap::Header &header = adapted->header();
 
-    // add custom header(s)
-    for (std::HeaderMap::const_iterator i = headers.begin(); i != headers.end(); i++) {
-        const libecap::Name name(i->first);
-        const libecap::Header::Value value = libecap::Area::FromTempString(i->second);
-        adapted->header().add(name, value);
+    // request data for templated values, looked up once and only if used
+    unsigned uses = 0;
+    for (HeaderEdits::const_iterator i = edits.begin(); i != edits.end(); i++) {
+        if (i->add && i->header.value_template)
+            uses |= i->header.value_template->uses();
     }
+    TemplateValues values;
+    if (uses)
+        collectValues(uses, values);
+    for (size_t n = 0; looked && n < TEMPLATE_LOOKUPS; n++)
+        values.lookups[n] = libecap::Area(looked->values[n].data(), looked->values[n].size());
+
+    // the host copies added values, so one buffer per thread will do
+    static thread_local std::string scratch;
+
+    unsigned removed = 0;
+    for (HeaderEdits::const_iterator i = edits.begin(); i != edits.end(); i++) {
+        const HeaderRef &entry = i->header;
+        if (i->remove) {
+            header.removeAny(*entry.name);
+            removed++;
+        }
+        if (!i->add) continue;
+
+        if (entry.value_template) {
+            entry.value_template->evaluate(values, scratch);
+            header.add(*entry.name, libecap::Area(scratch.data(), scratch.size()));
+        } else
+            header.add(*entry.name, entry.value);
+        headersAdded++;
+    }
+    stats.count(Stats::headersInjected, headersAdded);
+    stats.count(Stats::headersRemoved, removed);
 
+    // the last host call may delete us, so account for it beforehand
+    noteStarted(begin);
+
+    trace.note(traceSpan, LatencyTrace::eventUseAdapted);
     if (!adapted->body()) {
         sendingAb = opNever; // there is nothing to send
+        trace.note(traceSpan, LatencyTrace::eventAbNever);
         lastHostCall()->useAdapted(adapted);
     } else {
         hostx->useAdapted(adapted);
     }
 }
 
+// the window is all we ever hold, or less when the body size is known;
+// injection adds the snippet on top
+bool Adapter::Xaction::reserveBody()
+{
+    size_type size = config->bodyWindow();
+
+    // hosts that do not know the size yet may still have been told it
+    const libecap::BodySize body_size = hostx->virgin().body()->bodySize();
+    uint64_t length = 0;
+    const bool sized = body_size.known() || meta.contentLength(length);
+    if (body_size.known())
+        length = body_size.value();
+    if (sized) {
+        if (config->bodyBypass() && length > config->bodyBypass())
+            return false;
+        size = std::min<size_type>(size, length);
+    }
+    if (config->htmlInject() != HtmlScanner::injectNone)
+        size += config->htmlSnippet().size;
+
+    if (!config->bodyBudget()) return true;
+    if (!budget.reserve(size, config->bodyBudget())) return false;
+
+    reserved = size;
+    return true;
+}
+
+// begin is only set for the transactions sampled for timing
+void Adapter::Xaction::noteStarted(const std::chrono::steady_clock::time_point &begin)
+{
+    stats.count(Stats::xactionsStarted);
+    if (begin != std::chrono::steady_clock::time_point()) {
+        stats.noteStartTime(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin).count());
+    }
+}
+
 void Adapter::Xaction::stop()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    // the host gave up while the body was still moving
+    if (receivingVb == opOn || sendingAb == opOn)
+        stats.count(Stats::xactionsAborted);
+    trace.note(traceSpan, LatencyTrace::eventStop);
     hostx = 0;
     // the caller will delete
 }
 
 void Adapter::Xaction::abDiscard()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     Must(sendingAb == opUndecided); // have not started yet
     sendingAb = opNever;
+    trace.note(traceSpan, LatencyTrace::eventAbNever);
     // we do not need more vb if the host is not interested in ab
     stopVb();
 }
 
 void Adapter::Xaction::abMake()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     Must(sendingAb == opUndecided); // have not yet started or decided not to send
     Must(hostx->virgin().body()); // that is our only source of ab content
 
@@ -424,20 +1126,30 @@ void Adapter::Xaction::abMake()
     Must(receivingVb == opOn || receivingVb == opComplete);
     
     sendingAb = opOn;
-    if (!buffer.empty())
+    trace.note(traceSpan, LatencyTrace::eventAbOn);
+    if (bodyMode == bodyRelay ? vbAvailable : !buffer.empty())
         hostx->noteAbContentAvailable();
+    finishAb();
 }
 
 void Adapter::Xaction::abMakeMore()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     Must(receivingVb == opOn); // a precondition for receiving more vb
+    if (bodyMode == bodyAdapt) {
+        pullVb();
+        // the host has nothing more to give or we have no room for it
+        if (vbDone || !buffer.room())
+            return;
+    }
     hostx->vbMakeMore();
 }
 
 void Adapter::Xaction::abStopMaking()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    if (sendingAb == opOn)
+        trace.note(traceSpan, LatencyTrace::eventAbDone);
     sendingAb = opComplete;
     // we do not need more vb if the host is not interested in more ab
     stopVb();
@@ -446,53 +1158,120 @@ void Adapter::Xaction::abStopMaking()
 
 libecap::Area Adapter::Xaction::abContent(size_type offset, size_type size)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     Must(sendingAb == opOn || sendingAb == opComplete);
-    return libecap::Area::FromTempString(buffer.substr(offset, size));
+    if (bodyMode == bodyRelay)
+        return hostx->vbContent(offset, size);
+    return buffer.content(offset, size);
 }
 
 void Adapter::Xaction::abContentShift(size_type size)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     Must(sendingAb == opOn || sendingAb == opComplete);
-    buffer.erase(0, size);
+    if (bodyMode == bodyRelay)
+        hostx->vbContentShift(size);
+    else {
+        buffer.shift(size);
+        pullVb(); // the window may have room again
+    }
 }
 
 void Adapter::Xaction::noteVbContentDone(bool atEnd)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     Must(receivingVb == opOn);
-    stopVb();
-    if (sendingAb == opOn) {
-        hostx->noteAbContentDone(atEnd);
-        sendingAb = opComplete;
-    }
+    vbDone = true;
+    vbAtEnd = atEnd;
+    trace.note(traceSpan, LatencyTrace::eventVbDone);
+    if (bodyMode == bodyRelay) {
+        // unconsumed vb must stay with the host until abContentShift()
+        receivingVb = opComplete;
+        trace.note(traceSpan, LatencyTrace::eventVbComplete);
+        finishAb();
+    } else
+        pullVb();
 }
 
 void Adapter::Xaction::noteVbContentAvailable()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     Must(receivingVb == opOn);
 
-    const libecap::Area vb = hostx->vbContent(0, libecap::nsize); // get all vb
-    std::string chunk = vb.toString(); // expensive, but simple
-    hostx->vbContentShift(vb.size); // we have a copy; do not need vb any more
-    adaptContent(chunk);
-    buffer += chunk; // buffer what we got
+    vbAvailable = true;
+    trace.note(traceSpan, LatencyTrace::eventVbAvailable);
+    if (bodyMode == bodyRelay) {
+        // leave vb where it is; abContent() serves it straight from the host
+        if (sendingAb == opOn)
+            hostx->noteAbContentAvailable();
+        return;
+    }
 
-    if (sendingAb == opOn)
-        hostx->noteAbContentAvailable();
+    pullVb();
 }
 
-void Adapter::Xaction::adaptContent(std::string &chunk) const
+// queues the chunk as ab, with the configured snippet spliced in where
+// the scanner finds the document head; nothing is copied either way
+void Adapter::Xaction::adaptContent(const libecap::Area &chunk)
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
-    // not modifying the virgin body (if any)
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+
+    stats.count(Stats::bytesBuffered, chunk.size);
+
+    if (!scanner || scanner->done()) {
+        buffer.append(chunk);
+        stats.noteBuffered(buffer.size());
+        return;
+    }
+
+    const size_type at = scanner->scan(chunk.start, chunk.size);
+    if (at == libecap::nsize) {
+        buffer.append(chunk);
+    } else {
+        buffer.append(libecap::Area(chunk.start, at, chunk.details));
+        buffer.append(config->htmlSnippet());
+        buffer.append(libecap::Area(chunk.start + at, chunk.size - at, chunk.details));
+        stats.count(Stats::htmlInjected);
+    }
+    stats.noteBuffered(buffer.size());
+
+    if (scanner->done() && Log::Enabled(LOG_DEBUG))
+        ADAPTER_LOG(LOG_DEBUG, "%s: title: %s, meta: %lu", __PRETTY_FUNCTION__,
+            scanner->title().c_str(), (unsigned long)scanner->meta().size());
+}
+
+// vb left at the host while our window is full is what throttles the
+// client: the host stops reading once its own buffer fills up
+void Adapter::Xaction::pullVb()
+{
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+
+    bool pulled = false;
+    while (vbAvailable && buffer.room()) {
+        const size_type room = buffer.room();
+        const libecap::Area vb = hostx->vbContent(0, room);
+        if (!vb.size) {
+            // a short area only means the host buffer is not contiguous
+            vbAvailable = false; // got all there is for now
+            break;
+        }
+        adaptContent(vb); // keeps a reference, not a copy
+        hostx->vbContentShift(vb.size);
+        pulled = true;
+    }
+
+    if (pulled && sendingAb == opOn)
+        hostx->noteAbContentAvailable();
+
+    if (vbDone && !vbAvailable && receivingVb == opOn) {
+        stopVb();
+        finishAb();
+    }
 }
 
 bool Adapter::Xaction::callable() const
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     return hostx != 0; // no point to call us if we are done
 }
 
@@ -500,50 +1279,230 @@ bool Adapter::Xaction::callable() const
 // if the host does not know that already
 void Adapter::Xaction::stopVb()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     if (receivingVb == opOn) {
         hostx->vbStopMaking();
         receivingVb = opComplete;
+        trace.note(traceSpan, LatencyTrace::eventVbComplete);
     } else {
         // we already got the entire body or refused it earlier
         Must(receivingVb != opUndecided);
     }
 }
 
+// tells the host that no more ab is coming, once all vb has reached us
+void Adapter::Xaction::finishAb()
+{
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+    if (sendingAb == opOn && receivingVb == opComplete) {
+        trace.note(traceSpan, LatencyTrace::eventAbDone);
+        hostx->noteAbContentDone(vbAtEnd);
+        sendingAb = opComplete;
+    }
+}
+
 // this method is used to make the last call to hostx transaction
 // last call may delete adapter transaction if the host no longer needs it
 // TODO: replace with hostx-independent "done" method
 libecap::host::Xaction *Adapter::Xaction::lastHostCall()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
     libecap::host::Xaction *x = hostx;
     Must(x);
     hostx = 0;
     return x;
 }
 
+void Adapter::Xaction::collectValues(unsigned uses, TemplateValues &values) const
+{
+    if (uses & TemplateValues::Bit(TemplateValues::varClientIp))
+        values.values[TemplateValues::varClientIp] = hostx->option(libecap::metaClientIp);
+
+    if (uses & (TemplateValues::Bit(TemplateValues::varHost) | TemplateValues::Bit(TemplateValues::varPath))) {
+        values.values[TemplateValues::varHost] = meta.host();
+        values.values[TemplateValues::varPath] = meta.path();
+    }
+
+    if (uses & TemplateValues::Bit(TemplateValues::varUser))
+        values.values[TemplateValues::varUser] = hostx->option(libecap::metaUserName);
+
+    if (uses & TemplateValues::Bit(TemplateValues::varGroups))
+        values.values[TemplateValues::varGroups] = hostx->option(libecap::metaAuthenticatedGroups);
+
+    if (uses & TemplateValues::Bit(TemplateValues::varTime)) {
+        const int length = snprintf(values.time_text, sizeof(values.time_text),
+            "%lu", (unsigned long)time(NULL));
+        values.values[TemplateValues::varTime] = libecap::Area(values.time_text, length);
+    }
+
+    if (uses & TemplateValues::Bit(TemplateValues::varRequestId)) {
+        HeaderTemplate::NextRequestId(values.request_id_text, sizeof(values.request_id_text));
+        values.values[TemplateValues::varRequestId] = libecap::Area(
+            values.request_id_text, strlen(values.request_id_text));
+    }
+}
+
+void Adapter::Xaction::matchRules()
+{
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+
+    const UrlMatcher &matcher = config->urlMatcher();
+    const RuleIndexPointer &index = config->index();
+    const ClientMatcher &clients = config->clientMatcher();
+
+    static const libecap::Area none;
+    const bool hosted = matcher.scoped() || index;
+    const libecap::Area &host = (hosted) ? meta.host() : none;
+    const libecap::Area &path = (hosted) ? meta.path() : none;
+    libecap::Area client, user;
+    if (clients.hasClients() || (index && index->hasClients()))
+        client = hostx->option(libecap::metaClientIp);
+    if (clients.hasUsers() || (index && index->hasUsers()))
+        user = hostx->option(libecap::metaUserName);
+
+    // with nothing to tell requests apart, matching is cheaper than a key
+    static thread_local std::string key;
+    const HeaderDirection wanted = direction();
+    const bool cached = config->cacheSize() && (hosted || clients.scoped());
+    if (cached) {
+        DecisionKey(key, (wanted == directionRequest) ? 'x' : 'y',
+            host, path, PathLength(*config), client, user);
+        if (decisions.find(key, config->generation(), matches)) {
+            stats.count(Stats::decisionHits);
+            return;
+        }
+        stats.count(Stats::decisionMisses);
+    }
+
+    matcher.match(host.start, host.size, path.start, path.size, matches);
+
+    // client scopes add their own rules and narrow down the others
+    if (clients.scoped())
+        clients.match(client, user, matcher, path.start, path.size, matches);
+
+    // index rules are numbered after the XML ones, keeping matches sorted
+    if (index)
+        index->match(host.start, host.size, path.start, path.size,
+            client, user, config->headers().size(), matches);
+
+    // rules for the other direction never compete with ours (they have
+    // slots of their own), so they can go last
+    const HeaderDirection other = (wanted == directionRequest) ? directionResponse : directionRequest;
+    if (config->edits(other)) {
+        size_t kept = 0;
+        for (size_t m = 0; m < matches.size(); m++) {
+            if (config->direction(matches[m]) == wanted)
+                matches[kept++] = matches[m];
+        }
+        matches.resize(kept);
+    }
+
+    if (cached)
+        decisions.insert(key, config->generation(), matches, config->cacheSize());
+}
+
+// a plain append needs nothing from the message; for anything else, one
+// walk over the virgin header finds which names are present, and the
+// edits are then resolved in configuration order, each seeing what the
+// ones before it did.  No-ops (removing an absent header, or adding a
+// present one conditionally) are dropped.
+void Adapter::Xaction::planHeaders()
+{
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
+
+    // one edit per match, filled in place: values are shared, not copied
+    edits.resize(matches.size());
+    bool conditional = false;
+    for (size_t m = 0; m < matches.size(); m++) {
+        config->header(matches[m], edits[m].header);
+        if (edits[m].header.action != headerAdd)
+            conditional = true;
+    }
+    if (!conditional) return;
+
+    HeaderPresence present(edits.size(), 0);
+    HeaderPresenceVisitor visitor(edits, present);
+    hostx->virgin().header().visitEach(visitor);
+
+    size_t kept = 0;
+    for (size_t m = 0; m < edits.size(); m++) {
+        HeaderEdit &edit = edits[m];
+        edit.remove = false;
+        edit.add = false;
+
+        switch (edit.header.action) {
+        case headerAdd:
+            edit.add = true;
+            break;
+        case headerSet:
+            edit.remove = present[m];
+            edit.add = true;
+            break;
+        case headerRemove:
+            edit.remove = present[m];
+            break;
+        case headerAddIfAbsent:
+            edit.add = !present[m];
+            break;
+        }
+
+        // later entries with the same name see the result: an
+        // add-if-absent that adds nothing leaves the header present
+        const bool result = edit.add || (present[m] && !edit.remove);
+        for (size_t later = m + 1; later < edits.size(); later++) {
+            if (edits[later].header.slot == edit.header.slot)
+                present[later] = result;
+        }
+
+        if (!edit.remove && !edit.add) continue;
+        if (kept != m) edits[kept] = edit;
+        kept++;
+    }
+    edits.resize(kept);
+}
+
+void Adapter::HeaderPresenceVisitor::visit(const libecap::Name &name, const libecap::Area &)
+{
+    const std::string &image = name.image();
+    for (size_t m = 0; m < edits.size(); m++) {
+        if (present[m]) continue;
+        const std::string &wanted = edits[m].header.name->image();
+        if (wanted.size() == image.size() && AsciiCase::Equal(wanted.data(), image.data(), image.size()))
+            present[m] = 1;
+    }
+}
+
+Adapter::HeaderDirection Adapter::Xaction::direction() const
+{
+    return (meta.adaptingRequest()) ? directionRequest : directionResponse;
+}
+
 void Adapter::Xaction::getUri()
 {
-    syslog(LOG_LOCAL0 | LOG_DEBUG, __PRETTY_FUNCTION__);
+    ADAPTER_TRACE("%s", __PRETTY_FUNCTION__);
 
     if (!hostx)
         return;
 
-    libecap::Area uri_area;
-    typedef const libecap::RequestLine *CLRLP;
-    if (CLRLP requestLine = dynamic_cast<CLRLP>(&hostx->virgin().firstLine()))
-        uri_area = requestLine->uri();
-    else
-    if (CLRLP requestLine = dynamic_cast<CLRLP>(&hostx->cause().firstLine()))
-        uri_area = requestLine->uri();
+    const libecap::Area &uri_area = meta.uri();
 
-    std::string uri;
-    uri = std::string(uri_area.start, uri_area.size);
+    ADAPTER_TRACE("%s: request URI: %.*s",
+        __PRETTY_FUNCTION__, (int)uri_area.size, uri_area.start);
+}
 
-    syslog(LOG_LOCAL0 | LOG_DEBUG, "%s: request URI: %s", __PRETTY_FUNCTION__, uri.c_str());
+// create the adapter and register with libecap to reach the host
+// application; Squid warns about services it loads but has no
+// ecap_service for, so the response URI is a build option
+static bool RegisterServices(void)
+{
+    Adapter::Service *service = new Adapter::Service;
+    libecap::RegisterVersionedService(service);
+#ifdef ENABLE_RESPONSE_SERVICE
+    libecap::RegisterVersionedService(new Adapter::ResponseService(*service));
+#endif
+    return true;
 }
 
-// create the adapter and register with libecap to reach the host application
-static const bool Registered = (libecap::RegisterVersionedService(new Adapter::Service), true);
+static const bool Registered = RegisterServices();
 
 // vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
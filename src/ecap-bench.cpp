@@ -0,0 +1,474 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <iostream>
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <new>
+
+#include <libecap/common/registry.h>
+#include <libecap/common/errors.h>
+#include <libecap/common/message.h>
+#include <libecap/common/header.h>
+#include <libecap/common/names.h>
+#include <libecap/host/host.h>
+#include <libecap/adapter/service.h>
+#include <libecap/adapter/xaction.h>
+#include <libecap/host/xaction.h>
+
+#include <syslog.h>
+#include <expat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "expat-xml.h"
+#include "pool.h"
+#include "ascii-case.h"
+#include "url-matcher.h"
+#include "client-matcher.h"
+#include "html-scanner.h"
+#include "header-template.h"
+#include "adapter-config.h"
+#include "rule-index.h"
+#include "mock-host.h"
+
+// Counts adapter-side allocations; see Mock::HostCall.  Kept out of line
+// so that the compiler does not pair malloc() with inlined new-expressions
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    if (Mock::counting)
+        Mock::allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+namespace Bench
+{
+
+class Scenario
+{
+public:
+    Scenario(const std::string &name, unsigned long requests)
+        : name(name), requests(requests) { };
+
+    std::string name;
+    unsigned long requests;
+    std::string config; // body of the <clearos-ecap-adapter> element
+    libecap::shared_ptr<Mock::Message> virgin;
+    libecap::shared_ptr<Mock::Message> cause;
+    Mock::Chunks chunks;
+    std::string client_ip; // client-ip meta-information, if any
+    Adapter::HeaderRuleList indexed; // compiled into a rule index, if any
+    std::string lookup_map; // "key value" lines of lookup "map", if any
+    std::string service; // URI of the service to use, if not the first
+};
+
+static const char *CONFIG_HEAD =
+    "<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>\n"
+    "<clearos-ecap-adapter version=\"1\">\n"
+    "  <log level=\"error\"/>\n";
+static const char *CONFIG_TAIL =
+    "</clearos-ecap-adapter>\n";
+
+static std::string WriteFile(const std::string &text)
+{
+    char path[] = "/tmp/ecap-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+
+    if (write(fd, text.data(), text.size()) != (ssize_t)text.size()) {
+        perror("write");
+        exit(1);
+    }
+    close(fd);
+
+    return path;
+}
+
+static std::string WriteConfig(const std::string &body)
+{
+    return WriteFile(CONFIG_HEAD + body + CONFIG_TAIL);
+}
+
+static libecap::shared_ptr<Mock::Message> MakeRequest(
+    const std::string &method, const std::string &host, const std::string &path)
+{
+    libecap::shared_ptr<Mock::Message> request(
+        new Mock::Message(method, "http://" + host + path));
+    request->header().add(libecap::Name("Host"), Mock::MakeArea(host));
+    request->header().add(libecap::Name("User-Agent"), Mock::MakeArea("ecap-bench/1.0"));
+    request->header().add(libecap::Name("Accept"), Mock::MakeArea("*/*"));
+    return request;
+}
+
+static Mock::Chunks MakeBody(const std::string &content, size_t chunk)
+{
+    Mock::Chunks chunks;
+    for (size_t offset = 0; offset < content.size(); offset += chunk)
+        chunks.push_back(Mock::MakeArea(content.substr(offset, chunk)));
+    return chunks;
+}
+
+static void AddBody(Scenario &scenario, size_t size, size_t chunk)
+{
+    scenario.virgin->setBodySize(size);
+    scenario.virgin->header().add(libecap::headerContentLength,
+        Mock::MakeArea(std::to_string(size)));
+    scenario.chunks = MakeBody(std::string(size, 'x'), chunk);
+}
+
+static std::vector<Scenario> MakeScenarios(unsigned long requests)
+{
+    std::vector<Scenario> scenarios;
+
+    {
+        Scenario s("GET, no rules", requests);
+        s.virgin = MakeRequest("GET", "www.example.com", "/index.html");
+        scenarios.push_back(s);
+    }
+
+    {
+        Scenario s("GET, 1 header", requests);
+        s.config = "  <header name=\"X-Bench\">value</header>\n";
+        s.virgin = MakeRequest("GET", "www.example.com", "/index.html");
+        scenarios.push_back(s);
+    }
+
+    {
+        Scenario s("GET, 32 headers", requests);
+        for (int i = 0; i < 32; i++)
+            s.config += "  <header name=\"X-Bench-" + std::to_string(i) + "\">value</header>\n";
+        s.virgin = MakeRequest("GET", "www.example.com", "/index.html");
+        scenarios.push_back(s);
+    }
+
+    {
+        // the dump only happens on stop, when a later scenario is loaded
+        Scenario s("GET, 1 header, traced", requests);
+        s.config = "  <trace file=\"/dev/null\" sample=\"16\"/>\n"
+            "  <header name=\"X-Bench\">value</header>\n";
+        s.virgin = MakeRequest("GET", "www.example.com", "/index.html");
+        scenarios.push_back(s);
+    }
+
+    {
+        Scenario s("GET, 1 templated header", requests);
+        s.config = "  <header name=\"X-Bench\">${host}${path} ${request_id}</header>\n";
+        s.virgin = MakeRequest("GET", "www.example.com", "/index.html");
+        scenarios.push_back(s);
+    }
+
+    // answered from the cache after the warm-up
+    {
+        Scenario s("GET, 1 looked-up header", requests);
+        s.config = "  <header name=\"X-Bench\">${lookup:map}</header>\n";
+        s.lookup_map = "10.1.2.3 district-42\n";
+        s.client_ip = "10.1.2.3";
+        s.virgin = MakeRequest("GET", "www.example.com", "/index.html");
+        scenarios.push_back(s);
+    }
+
+    {
+        Scenario s("GET, 1000 domains", requests);
+        for (int i = 0; i < 1000; i++) {
+            s.config += "  <header name=\"X-Bench\" domain=\"site" + std::to_string(i) +
+                ".example.com\">value</header>\n";
+        }
+        s.virgin = MakeRequest("GET", "www.site500.example.com", "/index.html");
+        scenarios.push_back(s);
+    }
+
+    {
+        Scenario s("GET, 10000 subnets", requests);
+        for (int i = 0; i < 10000; i++) {
+            s.config += "  <header name=\"X-Bench\" client=\"10." + std::to_string(i / 256) +
+                "." + std::to_string(i % 256) + ".0/24\">value</header>\n";
+        }
+        s.virgin = MakeRequest("GET", "www.example.com", "/index.html");
+        s.client_ip = "10.20.30.40";
+        scenarios.push_back(s);
+    }
+
+    {
+        Scenario s("GET, 100000 indexed", requests);
+        Adapter::HeaderRule rule;
+        rule.name = "X-Bench";
+        rule.value = "value";
+        rule.domains.resize(1);
+        for (int i = 0; i < 100000; i++) {
+            rule.domains[0] = "site" + std::to_string(i) + ".example.com";
+            s.indexed.push_back(rule);
+        }
+        s.virgin = MakeRequest("GET", "www.site50000.example.com", "/index.html");
+        scenarios.push_back(s);
+    }
+
+    const size_t sizes[] = { 1024, 65536, 1048576 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        // keep the bytes moved per scenario roughly constant
+        const unsigned long count = std::max(1UL, requests * 1024 / sizes[i] / 4);
+        Scenario s("POST " + std::to_string(sizes[i] / 1024) + " KB, 1 header", count);
+        s.config = "  <header name=\"X-Bench\">value</header>\n";
+        s.virgin = MakeRequest("POST", "upload.example.com", "/form");
+        AddBody(s, sizes[i], 16384);
+        scenarios.push_back(s);
+    }
+
+    {
+        Scenario s("HTML 64 KB, inject", std::max(1UL, requests / 256));
+        s.config = "  <html inject=\"head\">&lt;script src=\"/x.js\"&gt;&lt;/script&gt;</html>\n";
+        s.cause = MakeRequest("GET", "www.example.com", "/");
+        s.virgin.reset(new Mock::Message(200));
+        s.virgin->header().add(libecap::Name("Content-Type"), Mock::MakeArea("text/html; charset=utf-8"));
+        std::string html = "<!DOCTYPE html>\n<html><head><title>Bench</title>"
+            "<meta name=\"description\" content=\"bench\"></head><body>";
+        while (html.size() < 65536)
+            html += "<p>Lorem ipsum dolor sit amet, consectetur adipiscing elit.</p>\n";
+        s.virgin->setBodySize(html.size());
+        s.chunks = MakeBody(html, 16384);
+        s.service = "ecap://clearfoundation.com/ecap-adapter/response";
+        scenarios.push_back(s);
+    }
+
+    {
+        Scenario s("Response, 3 headers", requests);
+        s.config =
+            "  <header name=\"Server\" action=\"remove\" direction=\"response\"/>\n"
+            "  <header name=\"X-Powered-By\" action=\"remove\" direction=\"response\"/>\n"
+            "  <header name=\"Strict-Transport-Security\" action=\"set\""
+            " direction=\"response\">max-age=31536000</header>\n"
+            "  <header name=\"X-Bench\">value</header>\n";
+        s.cause = MakeRequest("GET", "www.example.com", "/index.html");
+        s.virgin.reset(new Mock::Message(200));
+        s.virgin->header().add(libecap::Name("Server"), Mock::MakeArea("Apache/2.4.6"));
+        s.virgin->header().add(libecap::Name("X-Powered-By"), Mock::MakeArea("PHP/5.4.16"));
+        s.virgin->header().add(libecap::Name("Content-Type"), Mock::MakeArea("text/plain"));
+        s.service = "ecap://clearfoundation.com/ecap-adapter/response";
+        scenarios.push_back(s);
+    }
+
+    return scenarios;
+}
+
+static void Run(libecap::adapter::Service &service, const Scenario &scenario)
+{
+    std::string config = scenario.config;
+    std::string index;
+    if (scenario.indexed.size()) {
+        index = WriteConfig("");
+        Adapter::RuleIndex::Write(scenario.indexed, index);
+        config += "  <index file=\"" + index + "\"/>\n";
+    }
+    std::string map;
+    if (scenario.lookup_map.size()) {
+        map = WriteFile(scenario.lookup_map);
+        config = "  <lookup name=\"map\" key=\"client_ip\" file=\"" + map + "\"/>\n" + config;
+    }
+
+    const std::string path = WriteConfig(config);
+    Mock::Options options;
+    options.set("config", path);
+    service.reconfigure(options);
+    unlink(path.c_str());
+    if (index.size())
+        unlink(index.c_str()); // stays mapped
+
+    Mock::Xaction xaction(service);
+    if (scenario.client_ip.size())
+        xaction.setOption("client-ip", scenario.client_ip);
+
+    // warm up pools and caches
+    for (int i = 0; i < 100; i++)
+        xaction.run(scenario.virgin, scenario.cause, scenario.chunks);
+
+    Mock::allocations = 0;
+    unsigned long copied = 0;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < scenario.requests; i++) {
+        xaction.run(scenario.virgin, scenario.cause, scenario.chunks);
+        copied += xaction.ab_copied;
+    }
+    const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+
+    const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    std::cout << std::left << std::setw(26) << scenario.name << std::right
+        << std::setw(10) << scenario.requests
+        << std::fixed << std::setprecision(1)
+        << std::setw(12) << ns / scenario.requests
+        << std::setw(12) << (double)Mock::allocations / scenario.requests
+        << std::setw(14) << (double)copied / scenario.requests
+        << std::endl;
+
+    if (map.size())
+        unlink(map.c_str());
+}
+
+// What the adapter did before AsciiCase, for comparison
+static void LowerLibc(char *to, const char *from, size_t length)
+{
+    for (size_t i = 0; i < length; i++) to[i] = tolower(from[i]);
+}
+
+static bool EqualLibc(const char *a, const char *b, size_t length)
+{
+    return !strncasecmp(a, b, length);
+}
+
+static uint64_t HashLibc(const char *text, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)tolower(text[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// each string kernel this CPU has, on a header name, a host name and a
+// long path-like string; "libc" is tolower(), strncasecmp() and FNV-1a
+static void RunKernels(unsigned long requests)
+{
+    static const char *texts[] = {
+        "X-YouTube-Edu-Filter",
+        "Static.CDN.Example-Video.COM",
+        "/Watch/Playlists/Shared/With-Me/Recently-Added/Videos/Index.HTML",
+    };
+    static const char *kernels[] = { "libc", "scalar", "sse2", "avx2" };
+    const std::string selected = Adapter::AsciiCase::Kernel();
+
+    std::cout << std::endl << std::left << std::setw(10) << "kernel"
+        << std::setw(8) << "op" << std::right
+        << std::setw(8) << "bytes" << std::setw(12) << "ns/op" << std::endl;
+
+    volatile uint64_t sink = 0;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        const bool libc = k == 0;
+        if (!libc && !Adapter::AsciiCase::Use(kernels[k])) continue;
+
+        for (size_t t = 0; t < sizeof(texts) / sizeof(texts[0]); t++) {
+            const size_t length = strlen(texts[t]);
+            // read through a volatile, so that no call is hoisted out
+            const char *volatile text = texts[t];
+            std::string other(texts[t]);
+            LowerLibc(&other[0], other.data(), length);
+            char lowered[128];
+
+            for (int op = 0; op < 3; op++) {
+                const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                for (unsigned long i = 0; i < requests; i++) {
+                    switch (op) {
+                    case 0:
+                        if (libc) LowerLibc(lowered, text, length);
+                        else Adapter::AsciiCase::Lower(lowered, text, length);
+                        sink += lowered[0];
+                        break;
+                    case 1:
+                        sink += (libc) ? EqualLibc(text, other.data(), length) :
+                            Adapter::AsciiCase::Equal(text, other.data(), length);
+                        break;
+                    case 2:
+                        sink += (libc) ? HashLibc(text, length) :
+                            Adapter::AsciiCase::Hash(text, length);
+                        break;
+                    }
+                }
+                const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+
+                static const char *ops[] = { "lower", "equal", "hash" };
+                const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+                std::cout << std::left << std::setw(10) << kernels[k]
+                    << std::setw(8) << ops[op] << std::right
+                    << std::setw(8) << length
+                    << std::fixed << std::setprecision(1)
+                    << std::setw(12) << ns / requests << std::endl;
+            }
+        }
+    }
+
+    Adapter::AsciiCase::Use(selected);
+}
+
+} // namespace Bench
+
+int main(int argc, char *argv[])
+{
+    unsigned long requests = 1000000;
+    if (argc > 1)
+        requests = strtoul(argv[1], NULL, 10);
+    if (!requests) {
+        std::cerr << "usage: " << argv[0] << " [requests]" << std::endl;
+        return 1;
+    }
+
+    libecap::shared_ptr<Mock::Host> host(new Mock::Host);
+    libecap::RegisterHost(host);
+    libecap::shared_ptr<libecap::adapter::Service> service = host->service();
+    if (!service) {
+        std::cerr << argv[0] << ": no adapter service registered" << std::endl;
+        return 1;
+    }
+
+    Mock::Options options;
+    options.set("config", Bench::WriteConfig(""));
+    service->configure(options);
+    service->start();
+    unlink(options.option(libecap::Name("config")).toString().c_str());
+
+    std::cout << std::left << std::setw(26) << "scenario" << std::right
+        << std::setw(10) << "requests"
+        << std::setw(12) << "ns/req"
+        << std::setw(12) << "allocs/req"
+        << std::setw(14) << "copied B/req"
+        << std::endl;
+
+    const std::vector<Bench::Scenario> scenarios = Bench::MakeScenarios(requests);
+    for (size_t i = 0; i < scenarios.size(); i++) {
+        if (scenarios[i].service.size() && !host->service(scenarios[i].service)) {
+            std::cerr << argv[0] << ": " << scenarios[i].name << ": no service "
+                << scenarios[i].service << " (configure --enable-response-service)"
+                << std::endl;
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < scenarios.size(); i++) {
+        const libecap::shared_ptr<libecap::adapter::Service> used =
+            scenarios[i].service.size() ? host->service(scenarios[i].service) : service;
+        Bench::Run(*used, scenarios[i]);
+    }
+
+    Bench::RunKernels(requests);
+
+    service->stop();
+    service->retire();
+
+    return 0;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
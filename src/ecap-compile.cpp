@@ -0,0 +1,102 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <atomic>
+#include <new>
+
+#include <libecap/common/area.h>
+#include <libecap/common/name.h>
+#include <libecap/common/header.h>
+#include <libecap/common/memory.h>
+
+#include <syslog.h>
+#include <expat.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "expat-xml.h"
+#include "adapter-log.h"
+#include "pool.h"
+#include "url-matcher.h"
+#include "client-matcher.h"
+#include "html-scanner.h"
+#include "header-template.h"
+#include "adapter-config.h"
+#include "rule-index.h"
+
+// Default rule index written by clearos-ecap-compile
+#define DEFAULT_INDEX_FILE      "/var/lib/clearos-ecap-adapter/rules.idx"
+
+static void Usage(const char *program)
+{
+    std::cerr << "usage: " << program << " [-o index] rules.xml" << std::endl
+        << "       " << program << " -t index" << std::endl
+        << std::endl
+        << "Compiles the <header> and <list> rules of an adapter configuration" << std::endl
+        << "file into a rule index (default: " DEFAULT_INDEX_FILE ")," << std::endl
+        << "or checks an existing index with -t." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string output = DEFAULT_INDEX_FILE;
+    std::string test;
+
+    int option;
+    while ((option = getopt(argc, argv, "o:t:h")) != -1) {
+        switch (option) {
+        case 'o':
+            output = optarg;
+            break;
+        case 't':
+            test = optarg;
+            break;
+        default:
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    try {
+        if (test.size()) {
+            if (optind != argc) {
+                Usage(argv[0]);
+                return 1;
+            }
+            Adapter::RuleIndexPointer index = Adapter::RuleIndex::Map(test);
+            std::cout << test << ": " << index->size() << " rules, "
+                << index->names().size() << " header names" << std::endl;
+            return 0;
+        }
+
+        if (optind + 1 != argc) {
+            Usage(argv[0]);
+            return 1;
+        }
+
+        Adapter::ConfigPointer config = Adapter::Config::Load(argv[optind]);
+        Adapter::RuleIndex::Write(config->rules(), output);
+
+        Adapter::RuleIndexPointer index = Adapter::RuleIndex::Map(output);
+        std::cout << output << ": " << index->size() << " rules, "
+            << index->names().size() << " header names" << std::endl;
+    } catch (ExpatXmlParseException &e) {
+        std::cerr << argv[0] << ": " << argv[optind] << ": Parse error: " << e.what()
+            << ", line: " << e.row << ", column: " << e.col << std::endl;
+        return 1;
+    } catch (std::runtime_error &e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
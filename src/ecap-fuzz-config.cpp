@@ -0,0 +1,250 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <exception>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <new>
+
+#include <libecap/common/area.h>
+#include <libecap/common/name.h>
+#include <libecap/common/header.h>
+#include <libecap/common/memory.h>
+
+#include <syslog.h>
+#include <expat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "expat-xml.h"
+#include "adapter-log.h"
+#include "pool.h"
+#include "url-matcher.h"
+#include "client-matcher.h"
+#include "html-scanner.h"
+#include "header-template.h"
+#include "adapter-config.h"
+#include "rule-index.h"
+
+// Fuzz target for the configuration parser: every input is loaded as a
+// configuration file, and rules that load are compiled into an index
+// image too.  Parse and configuration errors are expected; anything else
+// escaping, a crash or a sanitizer report is a bug.
+//
+// Built with -DLIBFUZZER and -fsanitize=fuzzer, libFuzzer drives it.
+// Otherwise, given files it loads each once (for AFL, "@@", or to replay
+// a crash), and without them it mutates the built-in seeds by itself.
+
+namespace Fuzz
+{
+
+static const char *seeds[] = {
+    "<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>\n"
+    "<clearos-ecap-adapter version=\"1\">\n"
+    "  <log level=\"error\" queue=\"0\"/>\n"
+    "  <reload interval=\"10\"/>\n"
+    "  <body window=\"65536\" budget=\"1048576\" bypass=\"0\"/>\n"
+    "  <cache size=\"128\"/>\n"
+    "  <header name=\"X-YouTube-Edu-Filter\" domain=\"youtube.com\">abcdefghijklmnopqrstuv</header>\n"
+    "  <header name=\"X-Forwarded-For\" action=\"remove\"/>\n"
+    "  <header name=\"Server\" action=\"remove\" direction=\"response\"/>\n"
+    "</clearos-ecap-adapter>\n",
+
+    "<clearos-ecap-adapter version=\"1\">\n"
+    "  <header name=\"X-Client\" client=\"10.0.0.0/8 2001:db8::/32\" user=\"alice,bob\">${client_ip} ${user}</header>\n"
+    "  <header name=\"X-Path\" host=\"www.example.com\" path=\"/a /b/c\" action=\"set\">${host}${path} $$ ${time}</header>\n"
+    "  <header name=\"X-Id\" action=\"add-if-absent\">${request_id} ${groups}</header>\n"
+    "  <lookup name=\"map\" key=\"client_ip\" file=\"/dev/null\" ttl=\"5\"/>\n"
+    "  <header name=\"X-Map\">${lookup:map}</header>\n"
+    "</clearos-ecap-adapter>\n",
+
+    "<clearos-ecap-adapter version=\"1\">\n"
+    "  <html inject=\"head\" limit=\"4096\">&lt;script src=\"/x.js\"&gt;&lt;/script&gt;</html>\n"
+    "  <stats file=\"/dev/null\" interval=\"60\"/>\n"
+    "  <trace file=\"/dev/null\" sample=\"100\" events=\"64\" signal=\"none\"/>\n"
+    "  <pool limit=\"8\"/>\n"
+    "  <list name=\"X-Policy\" type=\"domain\" file=\"@LIST@\" direction=\"response\">default</list>\n"
+    "</clearos-ecap-adapter>\n"
+};
+
+// pieces the mutator inserts, as a dictionary would for libFuzzer
+static const char *tokens[] = {
+    "<", ">", "/>", "</", "\"", "=", "&amp;", "&lt;", "<![CDATA[", "]]>", "<!--", "-->",
+    "clearos-ecap-adapter", "header", "list", "html", "lookup", "index", "body",
+    "log", "reload", "pool", "cache", "stats", "trace",
+    " name=\"X\"", " action=\"remove\"", " action=\"set\"", " direction=\"response\"",
+    " domain=\"\"", " host=\"a,,b\"", " path=\"/\"", " client=\"::/0\"", " client=\"1.2.3.4/33\"",
+    " user=\"\"", " window=\"0\"", " limit=\"18446744073709551616\"", " size=\"-1\"",
+    " inject=\"body\"", " key=\"user\"", " socket=\"/nonexistent\"", " signal=\"usr2\"",
+    "${", "}", "$$", "${lookup:", "${host}", "${nothing}", "\xff\xfe", "\x00"
+};
+
+static std::string scratch; // file each input is written to
+static std::string list; // a list file for the seeds, "@LIST@" in them
+
+static void RemoveScratch(void)
+{
+    unlink(scratch.c_str());
+    unlink(list.c_str());
+}
+
+static std::string MakeFile(const std::string &text)
+{
+    char path[] = "/tmp/ecap-fuzz-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, text.data(), text.size()) != (ssize_t)text.size()) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    return path;
+}
+
+static void Setup(void)
+{
+    if (scratch.size()) return;
+
+    Adapter::Log::SetLevel(-1);
+
+    scratch = MakeFile("");
+    list = MakeFile("example.com\n# comment\nexample.org school\n");
+    atexit(RemoveScratch);
+}
+
+// true if the input loaded
+static bool Load(const uint8_t *data, size_t size)
+{
+    Setup();
+
+    FILE *file = fopen(scratch.c_str(), "w");
+    if (!file || (size && fwrite(data, size, 1, file) != 1)) {
+        perror(scratch.c_str());
+        exit(1);
+    }
+    fclose(file);
+
+    try {
+        Adapter::ConfigPointer config = Adapter::Config::Load(scratch);
+        std::vector<unsigned char> image;
+        Adapter::RuleIndex::Build(config->rules(), image);
+        return true;
+    } catch (ExpatXmlParseException &e) {
+    } catch (std::runtime_error &e) {
+    }
+    return false;
+}
+
+static void Mutate(std::string &input, std::mt19937 &random)
+{
+    const unsigned rounds = 1 + random() % 4;
+    for (unsigned r = 0; r < rounds; r++) {
+        const size_t at = (input.size()) ? random() % (input.size() + 1) : 0;
+        const size_t length = std::min<size_t>(input.size() - at, random() % 16);
+        switch (random() % 6) {
+        case 0:
+            if (at < input.size())
+                input[at] ^= 1 << (random() % 8);
+            break;
+        case 1:
+            input.insert(at, 1, (char)random());
+            break;
+        case 2:
+            input.erase(at, length);
+            break;
+        case 3:
+            input.insert(at, input.substr(at, length));
+            break;
+        default: {
+            const char *token = tokens[random() % (sizeof(tokens) / sizeof(tokens[0]))];
+            input.insert(at, (*token) ? token : std::string(1, '\0'));
+            break;
+        }
+        }
+    }
+}
+
+static int Run(unsigned long iterations, unsigned long seed)
+{
+    Setup();
+    std::mt19937 random(seed);
+    const size_t count = sizeof(seeds) / sizeof(seeds[0]);
+
+    unsigned long loaded = 0;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        std::string input = seeds[random() % count];
+        const size_t at = input.find("@LIST@");
+        if (at != std::string::npos)
+            input.replace(at, 6, list);
+        Mutate(input, random);
+        if (Load((const uint8_t *)input.data(), input.size()))
+            loaded++;
+    }
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::cout << iterations << " inputs (seed " << seed << "), " << loaded << " loaded, "
+        << (unsigned long)(iterations / seconds) << " inputs/s" << std::endl;
+    return 0;
+}
+
+} // namespace Fuzz
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    Fuzz::Load(data, size);
+    return 0;
+}
+
+#ifndef LIBFUZZER
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = 100000, seed = 1;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (option) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [-n inputs] [-s seed] [file...]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (optind == argc)
+        return Fuzz::Run(iterations, seed);
+
+    for (int i = optind; i < argc; i++) {
+        std::ifstream file(argv[i], std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << argv[0] << ": " << argv[i] << ": cannot open" << std::endl;
+            return 1;
+        }
+        std::stringstream input;
+        input << file.rdbuf();
+        const std::string data = input.str();
+        std::cout << argv[i] << ": "
+            << (Fuzz::Load((const uint8_t *)data.data(), data.size()) ? "loaded" : "rejected")
+            << std::endl;
+    }
+    return 0;
+}
+#endif
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
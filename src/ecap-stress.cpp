@@ -0,0 +1,580 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <new>
+
+#include <libecap/common/registry.h>
+#include <libecap/common/errors.h>
+#include <libecap/common/message.h>
+#include <libecap/common/header.h>
+#include <libecap/common/names.h>
+#include <libecap/host/host.h>
+#include <libecap/adapter/service.h>
+#include <libecap/adapter/xaction.h>
+#include <libecap/host/xaction.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "mock-host.h"
+
+// Drives the adapter through random but legal host call sequences: a few
+// transactions at once, each a step at a time (virgin body chunks, the
+// end of the body, abMake/abDiscard, adapted body reads of random sizes,
+// abMakeMore, abStopMaking, an early stop()), with the configuration
+// replaced under them.  Adapted bodies that were read whole are checked
+// against the virgin ones; wantsUrl() is asked what Squid asks, and a
+// few header rule sequences are checked first.  Meant to run under
+// ASan/UBSan, see Makefile.am; exits non-zero if any check failed.
+
+namespace Stress
+{
+
+// where the body snippet is injected; comments survive any HTML
+#define STRESS_SNIPPET          "<!--ecap-->"
+
+// Steps one transaction may take before it counts as stalled
+#define STRESS_STEPS            20000
+
+static const char *configs[] = {
+    "  <header name=\"X-Stress\">a</header>\n"
+    "  <header name=\"X-Where\" domain=\"example.com\" action=\"set\">${host}${path}</header>\n"
+    "  <header name=\"User-Agent\" action=\"remove\"/>\n",
+
+    "  <body window=\"64\"/>\n"
+    "  <html inject=\"head\" limit=\"256\">&lt;!--ecap--&gt;</html>\n"
+    "  <header name=\"X-Stress\" action=\"add-if-absent\">b</header>\n",
+
+    "  <body window=\"128\" budget=\"512\" bypass=\"3000\"/>\n"
+    "  <html inject=\"body\">&lt;!--ecap--&gt;</html>\n"
+    "  <header name=\"Server\" action=\"remove\" direction=\"response\"/>\n",
+
+    "  <html/>\n"
+    "  <header name=\"X-Map\">${lookup:map}</header>\n"
+    "  <header name=\"X-Frame-Options\" action=\"set\" direction=\"response\">DENY</header>\n"
+};
+
+static std::string WriteFile(const std::string &text)
+{
+    char path[] = "/tmp/ecap-stress-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, text.data(), text.size()) != (ssize_t)text.size()) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    return path;
+}
+
+class Totals
+{
+public:
+    Totals() : transactions(0), steps(0), verified(0), stopped(0),
+        aborted(0), failures(0) { };
+
+    unsigned long transactions;
+    unsigned long steps;
+    unsigned long verified; // adapted bodies read whole and checked
+    unsigned long stopped; // by the host, early
+    unsigned long aborted; // by the adapter
+    unsigned long failures;
+};
+
+class HeaderValues : public libecap::NamedValueVisitor
+{
+public:
+    HeaderValues(const std::string &name) : name(name) { };
+
+    virtual void visit(const libecap::Name &n, const libecap::Area &value)
+    {
+        if (strcasecmp(n.image().c_str(), name.c_str())) return;
+        if (values.size()) values += ", ";
+        values += value.toString();
+    };
+
+    const std::string name;
+    std::string values;
+};
+
+static void Reconfigure(libecap::adapter::Service &service, const std::string &rules)
+{
+    const std::string file = WriteFile("<clearos-ecap-adapter version=\"1\">\n  " +
+        rules + "\n</clearos-ecap-adapter>\n");
+    Mock::Options options;
+    options.set("config", file);
+    service.reconfigure(options);
+    unlink(file.c_str());
+}
+
+// Squid asks wantsUrl() with the path alone, never the host: host and
+// domain scoped rules must not turn transactions away, path scoped ones
+// may.  Each URL is asked twice, the second answer coming from the
+// decision cache.
+static void CheckWantsUrl(libecap::adapter::Service &service, Totals &totals)
+{
+    static const struct {
+        const char *rules;
+        const char *url;
+        bool wanted;
+    } checks[] = {
+        { "<header name=\"X-YouTube-Edu-Filter\" domain=\"youtube.com\">a</header>", "/watch?v=abc", true },
+        { "<header name=\"X-YouTube-Edu-Filter\" domain=\"youtube.com\">a</header>", "/", true },
+        { "<header name=\"X-Host\" host=\"www.example.com\" path=\"/a\">a</header>", "/b", true },
+        { "<header name=\"X-Client\" client=\"10.0.0.0/8\">a</header>", "/b", true },
+        { "<header name=\"X-Path\" path=\"/a\">a</header>", "/a/b", true },
+        { "<header name=\"X-Path\" path=\"/a\">a</header>", "/b", false }
+    };
+
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        Reconfigure(service, checks[i].rules);
+        for (int pass = 0; pass < 2; pass++) {
+            if (service.wantsUrl(checks[i].url) == checks[i].wanted) continue;
+            totals.failures++;
+            std::cerr << "failure: wantsUrl(\"" << checks[i].url << "\") with "
+                << checks[i].rules << " is " << !checks[i].wanted << std::endl;
+        }
+    }
+}
+
+// Header rules apply in the order written, each seeing what the ones
+// before it did.  The result is the X-A values of the request, after
+// "virgin: " if the adapter kept it as it was.
+static void CheckHeaders(libecap::adapter::Service &service, Totals &totals)
+{
+    static const struct {
+        const char *rules;
+        const char *virgin; // X-A of the request, if any
+        const char *result;
+    } checks[] = {
+        { "<header name=\"X-A\" action=\"add-if-absent\">one</header>"
+          "<header name=\"X-A\" action=\"add-if-absent\">two</header>", "v", "virgin: v" },
+        { "<header name=\"X-A\" action=\"add-if-absent\">one</header>"
+          "<header name=\"X-A\" action=\"add-if-absent\">two</header>", NULL, "one" },
+        { "<header name=\"X-A\" action=\"add-if-absent\">one</header>"
+          "<header name=\"X-A\" action=\"remove\"/>", "v", "" },
+        { "<header name=\"X-A\" action=\"add-if-absent\">one</header>"
+          "<header name=\"X-A\" action=\"remove\"/>", NULL, "" },
+        { "<header name=\"X-A\" action=\"add-if-absent\">one</header>"
+          "<header name=\"X-A\" action=\"set\">s</header>", "v", "s" },
+        { "<header name=\"X-A\" action=\"add-if-absent\">one</header>"
+          "<header name=\"X-A\" action=\"set\">s</header>", NULL, "s" },
+        { "<header name=\"X-A\" action=\"set\">1</header><header name=\"X-A\">2</header>"
+          "<header name=\"X-A\" action=\"set\">3</header>", "v", "3" },
+        { "<header name=\"X-A\" action=\"set\">1</header><header name=\"X-A\">2</header>"
+          "<header name=\"X-A\" action=\"set\">3</header>", NULL, "3" },
+        { "<header name=\"X-A\" action=\"remove\"/><header name=\"X-A\">2</header>"
+          "<header name=\"X-A\" action=\"remove\"/>", "v", "" },
+        { "<header name=\"X-A\" action=\"remove\"/><header name=\"X-A\">2</header>"
+          "<header name=\"X-A\" action=\"remove\"/>", NULL, "" }
+    };
+
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        Reconfigure(service, checks[i].rules);
+
+        libecap::shared_ptr<Mock::Message> request(new Mock::Message("GET", "http://www.example.com/"));
+        if (checks[i].virgin)
+            request->header().add(libecap::Name("X-A"), Mock::MakeArea(checks[i].virgin));
+        Mock::Xaction xaction(service);
+        xaction.run(request, libecap::shared_ptr<Mock::Message>(), Mock::Chunks());
+
+        HeaderValues values("X-A");
+        const libecap::Message &seen = (xaction.used_virgin || !xaction.adapted_message) ?
+            *request : *xaction.adapted_message;
+        seen.header().visitEach(values);
+        const std::string result = ((xaction.used_virgin) ? "virgin: " : "") + values.values;
+        if (result == checks[i].result) continue;
+
+        totals.failures++;
+        std::cerr << "failure: " << checks[i].rules << " with X-A: "
+            << ((checks[i].virgin) ? checks[i].virgin : "(none)") << " gives \""
+            << result << "\", not \"" << checks[i].result << "\"" << std::endl;
+    }
+}
+
+// One host transaction, moved forward a random step at a time
+class Xaction : public Mock::Xaction
+{
+public:
+    typedef enum
+    {
+        actVbDeliver,
+        actVbDone,
+        actVbTruncate,
+        actAbMake,
+        actAbDiscard,
+        actAbRead,
+        actAbMakeMore,
+        actAbStop,
+        actResume,
+        actStop,
+        actMax
+    } Action;
+
+    Xaction(libecap::adapter::Service &service, std::mt19937 &random);
+
+    // false once the transaction is over; throws what the adapter throws
+    bool step(void);
+    void finish(Totals &totals); // stops the adapter, checks the body
+    void fail(Totals &totals, const std::string &what);
+
+private:
+    void makeMessage(void);
+    void enable(Action action, unsigned weight);
+
+    std::mt19937 &random;
+    std::string body; // the whole virgin body
+    Mock::Chunks chunks;
+    size_t next; // chunk to deliver
+    bool vb_ended; // noteVbContentDone() called
+    bool vb_at_end;
+    bool ab_decided;
+    bool ab_stopped; // abStopMaking() called
+    bool ab_read; // and found nothing left after noteAbContentDone()
+    bool host_stopped;
+    std::string ab_text;
+    unsigned steps;
+    std::vector<Action> enabled;
+    std::deque<Action> history; // the latest steps, for failures
+};
+
+static const char *action_names[] = {
+    "vb-deliver", "vb-done", "vb-truncate", "ab-make", "ab-discard",
+    "ab-read", "ab-make-more", "ab-stop", "resume", "stop"
+};
+
+Xaction::Xaction(libecap::adapter::Service &service, std::mt19937 &random)
+    : Mock::Xaction(service), random(random), next(0), vb_ended(false),
+    vb_at_end(false), ab_decided(false), ab_stopped(false), ab_read(false),
+    host_stopped(false), steps(0)
+{
+    makeMessage();
+    setOption("client-ip", (random() % 2) ? "10.1.2.3" : "192.0.2.7");
+
+    virgin_chunks = &chunks;
+    adapter = service.makeXaction(this);
+    adapter->start();
+}
+
+// requests with and without bodies, HTML responses (with or without a
+// head, compressed or not) and other responses; bodies of known or
+// unknown size, cut into random chunks
+void Xaction::makeMessage(void)
+{
+    const std::string host = (random() % 2) ? "www.example.com" : "other.example.org";
+    libecap::shared_ptr<Mock::Message> request(new Mock::Message(
+        (random() % 3) ? "GET" : "POST", "http://" + host + "/path/" + std::to_string(random() % 100)));
+    request->header().add(libecap::Name("Host"), Mock::MakeArea(host));
+    request->header().add(libecap::Name("User-Agent"), Mock::MakeArea("ecap-stress/1.0"));
+
+    const unsigned kind = random() % 4;
+    if (kind == 0) {
+        virgin_message = request;
+        return;
+    }
+
+    if (kind == 1) {
+        virgin_message = request;
+        body = std::string(random() % 5000, 'p');
+    } else {
+        virgin_message.reset(new Mock::Message(200));
+        cause_message = request;
+        virgin_message->header().add(libecap::Name("Server"), Mock::MakeArea("Apache"));
+        if (kind == 2) {
+            virgin_message->header().add(libecap::Name("Content-Type"),
+                Mock::MakeArea("text/html; charset=utf-8"));
+            if (!(random() % 8))
+                virgin_message->header().add(libecap::Name("Content-Encoding"), Mock::MakeArea("gzip"));
+            if (random() % 4)
+                body = "<!DOCTYPE html>\n<html><head><title>Stress</title></head><body>";
+            else
+                body = "<p>no head</p>";
+            const size_t size = random() % 6000;
+            while (body.size() < size)
+                body += "<p>Lorem ipsum dolor sit amet.</p>\n";
+            body += "</body></html>\n";
+        } else {
+            virgin_message->header().add(libecap::Name("Content-Type"), Mock::MakeArea("text/plain"));
+            body = std::string(random() % 5000, 't');
+        }
+    }
+
+    if (random() % 2)
+        virgin_message->setBodySize(body.size());
+    else
+        virgin_message->addBody();
+    if (random() % 2)
+        virgin_message->header().add(libecap::headerContentLength,
+            Mock::MakeArea(std::to_string(body.size())));
+
+    for (size_t offset = 0; offset < body.size(); ) {
+        const size_t size = 1 + random() % std::max<size_t>(1, body.size() / 2);
+        chunks.push_back(Mock::MakeArea(body.substr(offset, size)));
+        offset += size;
+    }
+}
+
+void Xaction::enable(Action action, unsigned weight)
+{
+    for (unsigned i = 0; i < weight; i++)
+        enabled.push_back(action);
+}
+
+bool Xaction::step(void)
+{
+    if (aborted || host_stopped || used_virgin) return false;
+    if (adapted_message && !adapted_message->body()) return false;
+    if (ab_decided && !making_ab && !making_vb) return false;
+    if (++steps > STRESS_STEPS)
+        throw std::runtime_error("stalled");
+
+    enabled.clear();
+    if (delayed && !resumed)
+        enable(actResume, 1);
+    if (making_vb && next < chunks.size())
+        enable(actVbDeliver, 8);
+    if (making_vb && !vb_ended)
+        enable((next < chunks.size()) ? actVbTruncate : actVbDone, (next < chunks.size()) ? 1 : 4);
+    if (adapted_message && !ab_decided) {
+        enable(actAbMake, 7);
+        enable(actAbDiscard, 1);
+    }
+    if (making_ab) {
+        enable(actAbRead, 8);
+        if (!ab_done) {
+            enable(actAbMakeMore, 2);
+            if (!(random() % 16))
+                enable(actAbStop, 1);
+        }
+    }
+    if (!(random() % 64))
+        enable(actStop, 1);
+    if (enabled.empty()) return false;
+
+    const Action action = enabled[random() % enabled.size()];
+    history.push_back(action);
+    if (history.size() > 32)
+        history.pop_front();
+
+    switch (action) {
+    case actVbDeliver:
+        vb.push_back(chunks[next++]);
+        adapter->noteVbContentAvailable();
+        break;
+    case actVbDone:
+    case actVbTruncate:
+        vb_ended = true;
+        vb_at_end = action == actVbDone && (random() % 8);
+        making_vb = false;
+        adapter->noteVbContentDone(vb_at_end);
+        break;
+    case actAbMake:
+        ab_decided = true;
+        making_ab = true;
+        adapter->abMake();
+        break;
+    case actAbDiscard:
+        ab_decided = true;
+        adapter->abDiscard();
+        break;
+    case actAbRead: {
+        const libecap::size_type size = (random() % 2) ? libecap::nsize : 1 + random() % 512;
+        const libecap::Area ab = adapter->abContent(0, size);
+        if (!ab.size) {
+            if (ab_done) {
+                ab_read = true;
+                making_ab = false;
+            }
+            break;
+        }
+        const libecap::size_type shift = (random() % 4) ? ab.size : 1 + random() % ab.size;
+        ab_text.append(ab.start, shift);
+        adapter->abContentShift(shift);
+        break;
+    }
+    case actAbMakeMore:
+        adapter->abMakeMore();
+        break;
+    case actAbStop:
+        ab_stopped = true;
+        making_ab = false;
+        adapter->abStopMaking();
+        break;
+    case actResume:
+        service.resume(); // delivers lookup answers
+        if (resume_pending) {
+            resume_pending = false;
+            resumed = true;
+            adapter->resume();
+        } else
+            usleep(100);
+        break;
+    case actStop:
+        host_stopped = true;
+        break;
+    case actMax:
+        break;
+    }
+    return true;
+}
+
+void Xaction::finish(Totals &totals)
+{
+    totals.transactions++;
+    totals.steps += steps;
+    if (aborted) totals.aborted++;
+    if (host_stopped) totals.stopped++;
+
+    adapter->stop();
+    adapter.reset();
+
+    // the adapter may splice the snippet in once, anywhere
+    if (!ab_read || ab_stopped || host_stopped || !vb_at_end || next < chunks.size())
+        return;
+    std::string text = ab_text;
+    if (text != body) {
+        const size_t at = text.find(STRESS_SNIPPET);
+        if (at != std::string::npos)
+            text.erase(at, strlen(STRESS_SNIPPET));
+    }
+    if (text != body) {
+        fail(totals, "adapted body of " + std::to_string(ab_text.size()) +
+            " bytes does not match the virgin body of " + std::to_string(body.size()));
+        return;
+    }
+    totals.verified++;
+}
+
+void Xaction::fail(Totals &totals, const std::string &what)
+{
+    if (totals.failures++ >= 10) return;
+
+    std::cerr << "failure: " << what << "; last steps:";
+    for (size_t i = 0; i < history.size(); i++)
+        std::cerr << " " << action_names[history[i]];
+    std::cerr << std::endl;
+}
+
+} // namespace Stress
+
+int main(int argc, char *argv[])
+{
+    unsigned long transactions = 100000, seed = 1;
+    if (argc > 1)
+        transactions = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        seed = strtoul(argv[2], NULL, 10);
+    if (!transactions || argc > 3) {
+        std::cerr << "usage: " << argv[0] << " [transactions [seed]]" << std::endl;
+        return 1;
+    }
+
+    libecap::shared_ptr<Mock::Host> host(new Mock::Host);
+    libecap::RegisterHost(host);
+    libecap::shared_ptr<libecap::adapter::Service> service = host->service();
+    if (!service) {
+        std::cerr << argv[0] << ": no adapter service registered" << std::endl;
+        return 1;
+    }
+    // the HTML and response rules below are rejected without it
+    if (!host->service("ecap://clearfoundation.com/ecap-adapter/response")) {
+        std::cerr << argv[0] << ": no response service (configure --enable-response-service)"
+            << std::endl;
+        return 1;
+    }
+
+    const std::string map = Stress::WriteFile("10.1.2.3 school\n");
+    std::vector<std::string> files;
+    const size_t count = sizeof(Stress::configs) / sizeof(Stress::configs[0]);
+    for (size_t i = 0; i < count; i++) {
+        files.push_back(Stress::WriteFile(
+            "<clearos-ecap-adapter version=\"1\">\n"
+            "  <log level=\"error\"/>\n"
+            "  <lookup name=\"map\" key=\"client_ip\" file=\"" + map + "\" ttl=\"1\"/>\n" +
+            Stress::configs[i] + "</clearos-ecap-adapter>\n"));
+    }
+
+    std::mt19937 random(seed);
+    Mock::Options options;
+    options.set("config", files[0]);
+    service->configure(options);
+    service->start();
+
+    Stress::Totals totals;
+    Stress::CheckWantsUrl(*service, totals);
+    Stress::CheckHeaders(*service, totals);
+    service->reconfigure(options);
+
+    std::vector<Stress::Xaction *> live;
+    unsigned long started = 0;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (started < transactions || live.size()) {
+        // a new snapshot every so often; live transactions keep theirs
+        if (!(random() % 512)) {
+            options.set("config", files[random() % count]);
+            service->reconfigure(options);
+        }
+
+        while (started < transactions && live.size() < 4) {
+            started++;
+            try {
+                live.push_back(new Stress::Xaction(*service, random));
+            } catch (const std::exception &e) {
+                totals.transactions++;
+                if (totals.failures++ < 10)
+                    std::cerr << "failure: start(): " << e.what() << std::endl;
+            }
+        }
+        if (live.empty()) continue;
+
+        const size_t i = random() % live.size();
+        Stress::Xaction *xaction = live[i];
+        bool more;
+        try {
+            more = xaction->step();
+        } catch (const std::exception &e) {
+            xaction->fail(totals, e.what());
+            more = false;
+        }
+        if (more) continue;
+
+        try {
+            xaction->finish(totals);
+        } catch (const std::exception &e) {
+            xaction->fail(totals, std::string("stop(): ") + e.what());
+        }
+        delete xaction;
+        live.erase(live.begin() + i);
+    }
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    service->stop();
+    service->retire();
+    for (size_t i = 0; i < files.size(); i++)
+        unlink(files[i].c_str());
+    unlink(map.c_str());
+
+    std::cout << totals.transactions << " transactions (seed " << seed << "), "
+        << totals.steps << " host steps, "
+        << (unsigned long)(totals.transactions / seconds) << " transactions/s" << std::endl
+        << "verified " << totals.verified << ", stopped by host " << totals.stopped
+        << ", aborted by adapter " << totals.aborted
+        << ", failed " << totals.failures << std::endl;
+    return (totals.failures) ? 1 : 0;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
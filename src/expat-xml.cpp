@@ -4,10 +4,15 @@
 
 #include <string>
 #include <vector>
-#include <map>
 #include <stdexcept>
+#include <exception>
 
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <expat.h>
 
 #include "expat-xml.h"
@@ -15,22 +20,41 @@
 ExpatXmlTag::ExpatXmlTag(const char *name, const char **attr)
     : name(name), text(""), data(NULL)
 {
-    for (int i = 0; attr[i]; i += 2) param[attr[i]] = attr[i + 1];
+    int count = 0;
+    while (attr[count]) count += 2;
+
+    // Expat rejects duplicate attributes, so there is one of each
+    param.reserve(count / 2);
+    for (int i = 0; i < count; i += 2)
+        param.push_back(std::make_pair(attr[i], attr[i + 1]));
+}
+
+bool ExpatXmlTag::ParamExists(const std::string &key) const
+{
+    for (ParamList::const_iterator i = param.begin(); i != param.end(); i++)
+        if (i->first == key) return true;
+    return false;
 }
 
-bool ExpatXmlTag::ParamExists(const std::string &key)
+const std::string &ExpatXmlTag::GetParamValue(const std::string &key) const
 {
-    ParamMap::iterator i;
-    i = param.find(key);
-    return (bool)(i != param.end());
+    for (ParamList::const_iterator i = param.begin(); i != param.end(); i++)
+        if (i->first == key) return i->second;
+    throw ExpatXmlKeyNotFound(key);
 }
 
-std::string ExpatXmlTag::GetParamValue(const std::string &key)
+// line breaks and other unprintable characters are dropped, as they
+// were when files were fed to Expat a line at a time; printable runs are
+// appended whole
+void ExpatXmlTag::AppendText(const char *text, size_t length)
 {
-    ParamMap::iterator i;
-    i = param.find(key);
-    if (i == param.end()) throw ExpatXmlKeyNotFound(key);
-    return i->second;
+    size_t start = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (isprint((unsigned char)text[i])) continue;
+        if (i > start) this->text.append(text + start, i - start);
+        start = i + 1;
+    }
+    if (length > start) this->text.append(text + start, length - start);
 }
 
 bool ExpatXmlTag::operator==(const char *tag)
@@ -49,18 +73,27 @@ static void ExpatXmlElementOpen(
     void *data, const char *element, const char **attr)
 {
     ExpatXmlParser *csp = (ExpatXmlParser *)data;
+    if (csp->ParseAborted()) return;
 
     ExpatXmlTag *tag = new ExpatXmlTag(element, attr);
 #ifdef _CS_DEBUG
     csLog::Log(csLog::Debug, "Element open: %s", tag->GetName().c_str());
 #endif
-    csp->ParseElementOpen(tag);
+    try {
+        csp->ParseElementOpen(tag);
+    } catch (...) {
+        delete tag;
+        csp->ParseAbort();
+        return;
+    }
     csp->stack.push_back(tag);
 }
 
 static void ExpatXmlElementClose(void *data, const char *element)
 {
     ExpatXmlParser *csp = (ExpatXmlParser *)data;
+    if (csp->ParseAborted() || !csp->stack.size()) return;
+
     ExpatXmlTag *tag = csp->stack.back();
 #ifdef _CS_DEBUG
     csLog::Log(csLog::Debug, "Element close: %s", tag->GetName().c_str());
@@ -73,7 +106,13 @@ static void ExpatXmlElementClose(void *data, const char *element)
     }
 #endif
     csp->stack.pop_back();
-    csp->ParseElementClose(tag);
+    try {
+        csp->ParseElementClose(tag);
+    } catch (...) {
+        delete tag;
+        csp->ParseAbort();
+        return;
+    }
     delete tag;
 }
 
@@ -82,14 +121,9 @@ static void ExpatXmlText(void *data, const char *txt, int length)
     if (length == 0) return;
 
     ExpatXmlParser *csp = (ExpatXmlParser *)data;
+    if (csp->ParseAborted() || !csp->stack.size()) return;
 
-    ExpatXmlTag *tag = csp->stack.back();
-    std::string text = tag->GetText();
-    for (int i = 0; i < length; i++) {
-        if (txt[i] == '\n' || txt[i] == '\r' || !isprint(txt[i])) continue;
-        text.append(1, txt[i]);
-    }
-    tag->SetText(text);
+    csp->stack.back()->AppendText(txt, length);
 }
 
 ExpatXmlParser::ExpatXmlParser(void)
@@ -107,6 +141,7 @@ ExpatXmlParser::~ExpatXmlParser()
 void ExpatXmlParser::Reset(void)
 {
     done = 0;
+    failure = std::exception_ptr();
 
     if (p != NULL) XML_ParserFree(p);
 
@@ -122,7 +157,42 @@ void ExpatXmlParser::Reset(void)
 void ExpatXmlParser::Parse(const std::string &chunk)
 {
     if (!XML_Parse(p, chunk.c_str(), chunk.length(), done))
-        ParseError(XML_ErrorString(XML_GetErrorCode(p)));
+        ParseFailed();
+}
+
+// reads straight into Expat's own buffer, so a regular file is copied
+// once and parsed in a single call; the final empty read ends the parse
+void ExpatXmlParser::ParseFile(const std::string &filename)
+{
+    const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Open error: " + filename);
+
+    struct stat st;
+    size_t chunk = 65536;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        chunk = st.st_size + 1;
+
+    try {
+        do {
+            void *buffer = XML_GetBuffer(p, chunk);
+            if (!buffer) ParseFailed();
+
+            ssize_t length;
+            do {
+                length = read(fd, buffer, chunk);
+            } while (length < 0 && errno == EINTR);
+            if (length < 0) throw std::runtime_error("Read error: " + filename);
+
+            done = (length == 0);
+            if (!XML_ParseBuffer(p, length, done))
+                ParseFailed();
+        } while (!done);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
 }
 
 void ExpatXmlParser::ParseError(const std::string &what)
@@ -133,4 +203,23 @@ void ExpatXmlParser::ParseError(const std::string &what)
         XML_GetCurrentColumnNumber(p));
 }
 
+// only the first exception is kept; the handlers ignore what Expat may
+// still report after it is stopped, such as the end of an empty element
+void ExpatXmlParser::ParseAbort(void)
+{
+    if (!failure)
+        failure = std::current_exception();
+    XML_StopParser(p, XML_FALSE);
+}
+
+void ExpatXmlParser::ParseFailed(void)
+{
+    if (failure) {
+        std::exception_ptr e = failure;
+        failure = std::exception_ptr();
+        std::rethrow_exception(e);
+    }
+    ParseError(XML_ErrorString(XML_GetErrorCode(p)));
+}
+
 // vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
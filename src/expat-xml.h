@@ -6,11 +6,12 @@ class ExpatXmlTag
 public:
     ExpatXmlTag(const char *name, const char **attr);
 
-    inline std::string GetName(void) const { return name; };
-    bool ParamExists(const std::string &key);
-    std::string GetParamValue(const std::string &key);
-    inline std::string GetText(void) const { return text; };
+    inline const std::string &GetName(void) const { return name; };
+    bool ParamExists(const std::string &key) const;
+    const std::string &GetParamValue(const std::string &key) const;
+    inline const std::string &GetText(void) const { return text; };
     inline void SetText(const std::string &text) { this->text = text; };
+    void AppendText(const char *text, size_t length);
     void *GetData(void) { return data; };
     inline void SetData(void *data) { this->data = data; };
 
@@ -18,8 +19,9 @@ public:
     bool operator!=(const char *tag);
 
 protected:
-    typedef std::map<std::string, std::string> ParamMap;
-    ParamMap param;
+    // elements have a handful of attributes, so a scan beats a map
+    typedef std::vector<std::pair<std::string, std::string> > ParamList;
+    ParamList param;
 
     std::string name;
     std::string text;
@@ -35,8 +37,13 @@ public:
     virtual void Reset(void);
     void SetPrivateData(void *priv_data) { this->priv_data = priv_data; }
     virtual void Parse(const std::string &chunk);
+    void ParseFile(const std::string &filename);
 
     void ParseError(const std::string &what);
+    // from the element handlers: stops Expat, which is C and cannot be
+    // unwound through, and has Parse() rethrow the current exception
+    void ParseAbort(void);
+    inline bool ParseAborted(void) const { return static_cast<bool>(failure); };
 
     virtual void ParseElementOpen(ExpatXmlTag *tag) = 0;
     virtual void ParseElementClose(ExpatXmlTag *tag) = 0;
@@ -48,7 +55,10 @@ public:
     TagStack stack;
 
 protected:
+    void ParseFailed(void); // throws, after Expat reports an error
+
     void *priv_data;
+    std::exception_ptr failure; // set by ParseAbort()
 };
 
 class ExpatXmlParseException : public std::runtime_error
@@ -0,0 +1,128 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <atomic>
+
+#include <libecap/common/area.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "header-template.h"
+
+// by TemplateValues::Variable
+static const char *variable_names[] = {
+    "client_ip",
+    "host",
+    "path",
+    "user",
+    "groups",
+    "time",
+    "request_id",
+    "lookup"
+};
+
+static std::atomic<unsigned long> request_sequence(0);
+
+// "$$" is a literal '$', and so is a '$' that does not start "${"
+Adapter::HeaderTemplate::HeaderTemplate(const std::string &text,
+    const std::vector<std::string> &lookups)
+    : variables(0), lookup_numbers(0)
+{
+    size_t position = 0;
+    while (position < text.size()) {
+        const size_t dollar = text.find('$', position);
+        const size_t end = (dollar == std::string::npos) ? text.size() : dollar;
+
+        if (end > position) {
+            Segment literal = { -1, literals.size(), end - position };
+            literals.append(text, position, end - position);
+            if (segments.size() && segments.back().variable < 0)
+                segments.back().length += literal.length;
+            else
+                segments.push_back(literal);
+        }
+        if (dollar == std::string::npos) break;
+
+        if (dollar + 1 < text.size() && text[dollar + 1] == '{') {
+            const size_t close = text.find('}', dollar + 2);
+            if (close == std::string::npos)
+                throw std::runtime_error("Unterminated template variable: " + text);
+
+            const std::string name = text.substr(dollar + 2, close - dollar - 2);
+            int variable = ParseVariable(name);
+            size_t lookup = 0;
+            if (variable < 0 && !name.compare(0, 7, "lookup:")) {
+                variable = TemplateValues::varLookup;
+                while (lookup < lookups.size() && name.compare(7, std::string::npos, lookups[lookup]))
+                    lookup++;
+                if (lookup == lookups.size())
+                    throw std::runtime_error("Unknown lookup: " + name.substr(7));
+                lookup_numbers |= 1U << lookup;
+            }
+            if (variable < 0)
+                throw std::runtime_error("Unknown template variable: " + name);
+
+            Segment segment = { variable, lookup, 0 };
+            segments.push_back(segment);
+            variables |= TemplateValues::Bit(static_cast<TemplateValues::Variable>(variable));
+            position = close + 1;
+            continue;
+        }
+
+        // a literal '$', merged into the literal segment before it
+        Segment literal = { -1, literals.size(), 1 };
+        literals.push_back('$');
+        if (segments.size() && segments.back().variable < 0)
+            segments.back().length++;
+        else
+            segments.push_back(literal);
+        position = dollar + ((dollar + 1 < text.size() && text[dollar + 1] == '$') ? 2 : 1);
+    }
+}
+
+// request data comes from the client; control characters are dropped so
+// that a value cannot end the header line
+void Adapter::HeaderTemplate::evaluate(const TemplateValues &values, std::string &out) const
+{
+    out.clear();
+    for (std::vector<Segment>::const_iterator i = segments.begin(); i != segments.end(); i++) {
+        if (i->variable < 0) {
+            out.append(literals, i->offset, i->length);
+            continue;
+        }
+
+        const libecap::Area &value = (i->variable == TemplateValues::varLookup) ?
+            values.lookups[i->offset] : values.values[i->variable];
+        size_t start = 0;
+        for (size_t c = 0; c < value.size; c++) {
+            const unsigned char ch = value.start[c];
+            if (ch >= 0x20 || ch == '\t') continue;
+            out.append(value.start + start, c - start);
+            start = c + 1;
+        }
+        out.append(value.start + start, value.size - start);
+    }
+}
+
+int Adapter::HeaderTemplate::ParseVariable(const std::string &name)
+{
+    for (int variable = 0; variable < TemplateValues::varMax; variable++) {
+        if (variable != TemplateValues::varLookup && name == variable_names[variable])
+            return variable;
+    }
+    return -1;
+}
+
+void Adapter::HeaderTemplate::NextRequestId(char *text, size_t size)
+{
+    snprintf(text, size, "%lx-%lx", (unsigned long)getpid(),
+        request_sequence.fetch_add(1, std::memory_order_relaxed) + 1);
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
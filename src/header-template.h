@@ -0,0 +1,81 @@
+#ifndef _HEADER_TEMPLATE_H
+#define _HEADER_TEMPLATE_H
+
+// Most <lookup> elements a configuration can have
+#define TEMPLATE_LOOKUPS        8
+
+namespace Adapter
+{
+
+// Request data a template can refer to, collected once per transaction
+// and only for the variables some template actually uses
+class TemplateValues
+{
+public:
+    typedef enum
+    {
+        varClientIp, // ${client_ip}
+        varHost, // ${host}
+        varPath, // ${path}
+        varUser, // ${user}
+        varGroups, // ${groups}
+        varTime, // ${time}, seconds since the epoch
+        varRequestId, // ${request_id}, unique within the process
+        varLookup, // ${lookup:name}, any of them, see Lookup
+        varMax
+    } Variable;
+
+    inline static unsigned Bit(Variable variable) { return 1U << variable; };
+
+    libecap::Area values[varMax];
+    libecap::Area lookups[TEMPLATE_LOOKUPS]; // by lookup number
+
+    // backing store for the values made up here rather than by the host
+    char time_text[24];
+    char request_id_text[40];
+};
+
+// A header value with ${...} placeholders, compiled once into a list of
+// literal and variable segments, so that requests only copy bytes
+class HeaderTemplate
+{
+public:
+    // throws std::runtime_error for an unknown variable; lookups
+    // numbers the names ${lookup:name} may refer to
+    HeaderTemplate(const std::string &text,
+        const std::vector<std::string> &lookups = std::vector<std::string>());
+
+    inline bool dynamic(void) const { return variables != 0; };
+    // TemplateValues::Bit() of every variable used
+    inline unsigned uses(void) const { return variables; };
+    // 1 << n for every lookup number n used
+    inline unsigned lookups(void) const { return lookup_numbers; };
+
+    // a variable by name, or -1; not varLookup, which takes a name
+    static int ParseVariable(const std::string &name);
+
+    // replaces out with the value for this request
+    void evaluate(const TemplateValues &values, std::string &out) const;
+
+    static void NextRequestId(char *text, size_t size);
+
+protected:
+    class Segment
+    {
+    public:
+        int variable; // TemplateValues::Variable, or -1 for literal text
+        size_t offset; // into literals, or the lookup number
+        size_t length;
+    };
+
+    std::vector<Segment> segments;
+    std::string literals;
+    unsigned variables;
+    unsigned lookup_numbers;
+};
+
+} // namespace Adapter
+
+#endif // _HEADER_TEMPLATE_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,243 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <new>
+
+#include <libecap/common/forward.h>
+
+#include <ctype.h>
+
+#include "pool.h"
+#include "html-scanner.h"
+
+// Bounds on what is kept from a document
+#define MAX_TAG_NAME            16
+#define MAX_TAG_ATTRS           1024
+#define MAX_TITLE               512
+#define MAX_META                16
+
+Adapter::HtmlScanner::HtmlScanner(InjectSite inject, size_type limit)
+    : state(stText), inject(inject), limit(limit), scanned(0),
+    closing(false), quote(0), dashes(0), raw_matched(0),
+    in_title(false), injected(false) { }
+
+Adapter::size_type Adapter::HtmlScanner::scan(const char *data, size_type size)
+{
+    size_type at = libecap::nsize;
+
+    for (size_type i = 0; i < size && state != stDone; i++) {
+        const char c = data[i];
+
+        switch (state) {
+        case stText:
+            if (c == '<') {
+                state = stTagOpen;
+                tag_name.clear();
+                tag_attrs.clear();
+                closing = false;
+            }
+            else if (in_title && title_text.size() < MAX_TITLE)
+                title_text.append(1, c);
+            break;
+
+        case stTagOpen:
+            if (c == '/' && !closing)
+                closing = true;
+            else if (c == '!' && !closing) {
+                state = stBang;
+                dashes = 0;
+            }
+            else if (isalpha(c)) {
+                tag_name.append(1, tolower(c));
+                state = stTagName;
+            }
+            else {
+                // not markup after all, e.g. "a < b"
+                if (in_title) title_text.append(1, '<');
+                state = stText;
+            }
+            break;
+
+        case stTagName:
+            if (isalnum(c) || c == '-') {
+                if (tag_name.size() < MAX_TAG_NAME) tag_name.append(1, tolower(c));
+            }
+            else if (c == '>') {
+                if (noteTag() && at == libecap::nsize) at = i + 1;
+            }
+            else {
+                state = stTagAttrs;
+                quote = 0;
+                if (tag_name == "meta") tag_attrs.append(1, c);
+            }
+            break;
+
+        case stTagAttrs:
+            if (quote) {
+                if (c == quote) quote = 0;
+            }
+            else if (c == '"' || c == '\'')
+                quote = c;
+            else if (c == '>') {
+                if (noteTag() && at == libecap::nsize) at = i + 1;
+                break;
+            }
+            if (tag_name == "meta" && tag_attrs.size() < MAX_TAG_ATTRS)
+                tag_attrs.append(1, c);
+            break;
+
+        case stBang:
+            if (c == '-' && ++dashes == 2) {
+                state = stComment;
+                dashes = 0;
+            }
+            else if (c != '-')
+                state = (c == '>') ? stText : stDeclaration;
+            break;
+
+        case stComment:
+            if (c == '-')
+                dashes++;
+            else if (c == '>' && dashes >= 2)
+                state = stText;
+            else
+                dashes = 0;
+            break;
+
+        case stDeclaration:
+            if (c == '>') state = stText;
+            break;
+
+        case stRawText:
+            if (tolower(c) == raw_end[raw_matched]) {
+                if (++raw_matched == raw_end.size()) {
+                    // skip the rest of the end tag
+                    tag_name = raw_end.substr(2);
+                    closing = true;
+                    quote = 0;
+                    state = stTagAttrs;
+                }
+            }
+            else
+                raw_matched = (c == '<') ? 1 : 0;
+            break;
+
+        case stDone:
+            break;
+        }
+
+        if (++scanned >= limit && state != stDone) {
+            finishTitle();
+            state = stDone;
+        }
+    }
+
+    return at;
+}
+
+// handles a complete tag and decides whether the head is over
+bool Adapter::HtmlScanner::noteTag(void)
+{
+    bool here = false;
+    bool head_over = false;
+
+    state = stText;
+
+    if (closing) {
+        if (tag_name == "title")
+            finishTitle();
+        else if (tag_name == "head")
+            head_over = true;
+    }
+    else if (tag_name == "title") {
+        if (title_text.empty()) in_title = true;
+    }
+    else if (tag_name == "meta")
+        noteMeta();
+    else if (tag_name == "script" || tag_name == "style") {
+        raw_end = "</" + tag_name;
+        raw_matched = 0;
+        state = stRawText;
+    }
+    else if (tag_name == "head") {
+        here = (inject == injectHead && !injected);
+    }
+    else if (tag_name == "body") {
+        // a document without <head> still gets its snippet
+        here = (inject != injectNone && !injected);
+        head_over = true;
+    }
+
+    if (here) injected = true;
+
+    if (head_over && (injected || inject != injectBody)) {
+        finishTitle();
+        state = stDone;
+    }
+
+    return here;
+}
+
+void Adapter::HtmlScanner::noteMeta(void)
+{
+    if (meta_list.size() >= MAX_META) return;
+
+    std::string name, content;
+    size_type i = 0;
+    const size_type length = tag_attrs.size();
+
+    while (i < length) {
+        while (i < length && (isspace(tag_attrs[i]) || tag_attrs[i] == '/')) i++;
+
+        std::string key;
+        while (i < length && tag_attrs[i] != '=' && !isspace(tag_attrs[i]))
+            key.append(1, tolower(tag_attrs[i++]));
+        while (i < length && isspace(tag_attrs[i])) i++;
+
+        std::string value;
+        if (i < length && tag_attrs[i] == '=') {
+            for (i++; i < length && isspace(tag_attrs[i]); i++);
+            if (i < length && (tag_attrs[i] == '"' || tag_attrs[i] == '\'')) {
+                const char q = tag_attrs[i++];
+                while (i < length && tag_attrs[i] != q) value.append(1, tag_attrs[i++]);
+                i++;
+            }
+            else {
+                while (i < length && !isspace(tag_attrs[i])) value.append(1, tag_attrs[i++]);
+            }
+        }
+
+        if (key == "name" || key == "property" || key == "http-equiv")
+            name = value;
+        else if (key == "content")
+            content = value;
+    }
+
+    if (name.size())
+        meta_list.push_back(std::make_pair(name, content));
+}
+
+// trims and collapses white space in the title
+void Adapter::HtmlScanner::finishTitle(void)
+{
+    if (!in_title) return;
+    in_title = false;
+
+    std::string text;
+    for (std::string::const_iterator i = title_text.begin(); i != title_text.end(); i++) {
+        if (isspace(*i)) {
+            if (text.size() && text[text.size() - 1] != ' ') text.append(1, ' ');
+        }
+        else
+            text.append(1, *i);
+    }
+    if (text.size() && text[text.size() - 1] == ' ') text.erase(text.size() - 1);
+
+    title_text = text;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
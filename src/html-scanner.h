@@ -0,0 +1,80 @@
+#ifndef _HTML_SCANNER_H
+#define _HTML_SCANNER_H
+
+namespace Adapter
+{
+using libecap::size_type;
+
+// <meta> name (or property, or http-equiv) and content
+typedef std::vector<std::pair<std::string, std::string> > HtmlMetaList;
+
+// Incremental HTML tokenizer for response bodies.  It is fed one chunk
+// at a time, keeps only its state plus the (bounded) title and meta
+// data, and reports where a snippet should be injected.  Scanning stops
+// at the end of the document head or after a configured byte limit.
+class HtmlScanner
+{
+public:
+    typedef enum
+    {
+        injectNone,
+        injectHead, // right after <head>
+        injectBody // right after <body>
+    } InjectSite;
+
+    HtmlScanner(InjectSite inject, size_type limit);
+
+    // one per HTML response; keep them off the heap allocator
+    static void *operator new(size_t size) { return Pool::Allocate(size); };
+    static void operator delete(void *p, size_t size) { Pool::Release(p, size); };
+
+    // returns the chunk offset to inject at, or libecap::nsize
+    size_type scan(const char *data, size_type size);
+
+    inline bool done(void) const { return state == stDone; };
+    inline const std::string &title(void) const { return title_text; };
+    inline const HtmlMetaList &meta(void) const { return meta_list; };
+
+protected:
+    bool noteTag(void); // true if the snippet goes after this tag
+    void noteMeta(void);
+    void finishTitle(void);
+
+    typedef enum
+    {
+        stText,
+        stTagOpen, // after '<'
+        stTagName,
+        stTagAttrs,
+        stBang, // after "<!"
+        stComment,
+        stDeclaration,
+        stRawText, // script or style content
+        stDone
+    } State;
+
+    State state;
+    InjectSite inject;
+    size_type limit; // bytes to scan at most
+    size_type scanned;
+
+    std::string tag_name; // lower case, truncated
+    std::string tag_attrs; // kept for <meta> only, truncated
+    bool closing; // an end tag
+    char quote; // quote character of the current attribute value
+    size_type dashes; // run of '-' in a comment or after "<!"
+
+    std::string raw_end; // end tag that closes raw text, e.g. "</script"
+    size_type raw_matched;
+
+    bool in_title;
+    bool injected;
+    std::string title_text;
+    HtmlMetaList meta_list;
+};
+
+} // namespace Adapter
+
+#endif // _HTML_SCANNER_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,330 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+#include <syslog.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "adapter-log.h"
+#include "dump-file.h"
+#include "latency-trace.h"
+
+namespace
+{
+
+// by LatencyTrace::Event
+const char *event_names[] = {
+    "start",
+    "delayed",
+    "resumed",
+    "use_virgin",
+    "use_adapted",
+    "vb_on",
+    "vb_available",
+    "vb_done",
+    "vb_complete",
+    "ab_on",
+    "ab_done",
+    "ab_never",
+    "stop",
+    "end"
+};
+
+// the stretches shown as nested slices of each transaction: from the
+// first event to the first of the events after it
+class Phase
+{
+public:
+    const char *name;
+    Adapter::LatencyTrace::Event from;
+    Adapter::LatencyTrace::Event to[3];
+};
+
+const Phase phases[] = {
+    { "header", Adapter::LatencyTrace::eventStart,
+        { Adapter::LatencyTrace::eventUseVirgin, Adapter::LatencyTrace::eventUseAdapted,
+            Adapter::LatencyTrace::eventEnd } },
+    { "lookup", Adapter::LatencyTrace::eventDelayed,
+        { Adapter::LatencyTrace::eventResumed, Adapter::LatencyTrace::eventEnd,
+            Adapter::LatencyTrace::eventEnd } },
+    { "virgin body", Adapter::LatencyTrace::eventVbOn,
+        { Adapter::LatencyTrace::eventVbComplete, Adapter::LatencyTrace::eventEnd,
+            Adapter::LatencyTrace::eventEnd } },
+    { "adapted body", Adapter::LatencyTrace::eventAbOn,
+        { Adapter::LatencyTrace::eventAbDone, Adapter::LatencyTrace::eventEnd,
+            Adapter::LatencyTrace::eventEnd } }
+};
+
+// one event read back from a ring
+class Record
+{
+public:
+    uint64_t id;
+    uint64_t time;
+    unsigned event;
+    unsigned thread;
+
+    bool operator <(const Record &other) const
+        { return (id != other.id) ? id < other.id : time < other.time; };
+};
+
+std::atomic<bool> requested(false); // always lock-free on Linux
+bool caught = false; // host thread only
+struct sigaction previous;
+
+void NoteSignal(int signo, siginfo_t *info, void *context)
+{
+    requested.store(true, std::memory_order_relaxed);
+
+    if (previous.sa_flags & SA_SIGINFO) {
+        if (previous.sa_sigaction)
+            previous.sa_sigaction(signo, info, context);
+    } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+        previous.sa_handler(signo);
+}
+
+// microseconds, as Chrome traces count them
+void PrintTime(std::ostream &os, uint64_t ns)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%llu.%03u",
+        (unsigned long long)(ns / 1000), (unsigned)(ns % 1000));
+    os << buffer;
+}
+
+void PrintEvent(std::ostream &os, bool &first, const char *phase, const char *name,
+    const Record &record, pid_t pid)
+{
+    os << ((first) ? "\n" : ",\n");
+    first = false;
+    os << "    {\"ph\": \"" << phase << "\", \"cat\": \"xaction\", \"name\": \"" << name
+        << "\", \"id\": \"0x" << std::hex << record.id << std::dec
+        << "\", \"pid\": " << pid << ", \"tid\": " << record.thread << ", \"ts\": ";
+    PrintTime(os, record.time);
+    os << "}";
+}
+
+} // namespace
+
+static std::atomic<unsigned long> last_id(0);
+
+__thread unsigned long Adapter::LatencyTrace::cached_id = 0;
+__thread Adapter::LatencyTrace::Shard *Adapter::LatencyTrace::cached_shard = NULL;
+
+Adapter::LatencyTrace::Shard::Shard(unsigned number, size_t capacity)
+    : number(number), capacity(capacity), ring(2 * capacity), head(0),
+    sample(0), serial(0)
+{
+    for (int e = 0; e < eventMax; e++) {
+        for (int b = 0; b < LATENCY_TRACE_BUCKETS; b++)
+            latency[e][b].store(0, std::memory_order_relaxed);
+    }
+}
+
+Adapter::LatencyTrace::LatencyTrace()
+    : id(++last_id), sample_rate(0), capacity(0)
+{
+}
+
+// threads that still cache a shard of ours never see our id again
+Adapter::LatencyTrace::~LatencyTrace()
+{
+    for (size_t i = 0; i < shards.size(); i++)
+        delete shards[i];
+}
+
+void Adapter::LatencyTrace::configure(unsigned sample, size_t events)
+{
+    capacity.store(std::max<size_t>(events, 1), std::memory_order_relaxed);
+    sample_rate.store(sample, std::memory_order_relaxed);
+}
+
+Adapter::LatencyTrace::Shard &Adapter::LatencyTrace::attach(void)
+{
+    std::lock_guard<std::mutex> lg(shards_lock);
+    Shard *shard = new Shard(shards.size(), capacity.load(std::memory_order_relaxed));
+    shards.push_back(shard);
+
+    cached_id = id;
+    cached_shard = shard;
+    return *shard;
+}
+
+uint64_t Adapter::LatencyTrace::Now(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// transaction numbers are unique across threads without a shared
+// counter: the thread number sits above the thread's own count
+void Adapter::LatencyTrace::sample(TraceSpan &span)
+{
+    Shard &s = shard();
+    if (++s.sample < sample_rate.load(std::memory_order_relaxed)) return;
+    s.sample = 0;
+
+    span.id = ((uint64_t)(s.number + 1) << 40) | (++s.serial & ((1ULL << 40) - 1));
+    span.begin = Now();
+    record(span, eventStart);
+}
+
+// single writer: the entry is filled in before head moves past it
+void Adapter::LatencyTrace::record(const TraceSpan &span, Event event)
+{
+    const uint64_t now = Now();
+    Shard &s = shard();
+
+    const uint64_t n = s.head.load(std::memory_order_relaxed);
+    const size_t at = 2 * (n % s.capacity);
+    s.ring[at].store(span.id << 8 | event, std::memory_order_relaxed);
+    s.ring[at + 1].store(now, std::memory_order_relaxed);
+    s.head.store(n + 1, std::memory_order_release);
+
+    const uint64_t ns = now - span.begin;
+    int bucket = (ns) ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= LATENCY_TRACE_BUCKETS)
+        bucket = LATENCY_TRACE_BUCKETS - 1;
+    std::atomic<unsigned long> &counter = s.latency[event][bucket];
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void Adapter::LatencyTrace::format(std::ostream &os) const
+{
+    std::vector<Record> records;
+    unsigned long latency[eventMax][LATENCY_TRACE_BUCKETS];
+    memset(latency, 0, sizeof(latency));
+
+    {
+        std::lock_guard<std::mutex> lg(shards_lock);
+        for (size_t i = 0; i < shards.size(); i++) {
+            const Shard &s = *shards[i];
+            const uint64_t head = s.head.load(std::memory_order_acquire);
+            const uint64_t first = (head > s.capacity) ? head - s.capacity : 0;
+            const size_t start = records.size();
+            for (uint64_t n = first; n < head; n++) {
+                const size_t at = 2 * (n % s.capacity);
+                const uint64_t word = s.ring[at].load(std::memory_order_relaxed);
+                Record record;
+                record.id = word >> 8;
+                record.event = word & 0xff;
+                record.time = s.ring[at + 1].load(std::memory_order_relaxed);
+                record.thread = s.number;
+                records.push_back(record);
+            }
+
+            // entries the owner overwrote while we read them are dropped,
+            // and so is the one it may be writing
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const uint64_t now = s.head.load(std::memory_order_relaxed) + 1;
+            const uint64_t kept = (now > s.capacity) ? now - s.capacity : 0;
+            if (kept > first) {
+                const size_t lost = std::min<uint64_t>(kept - first, head - first);
+                records.erase(records.begin() + start, records.begin() + start + lost);
+            }
+
+            for (int e = 0; e < eventMax; e++) {
+                for (int b = 0; b < LATENCY_TRACE_BUCKETS; b++)
+                    latency[e][b] += s.latency[e][b].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::stable_sort(records.begin(), records.end());
+
+    const pid_t pid = getpid();
+    os << "{\n  \"displayTimeUnit\": \"ns\",\n  \"traceEvents\": [";
+    bool first = true;
+    for (size_t i = 0; i < records.size(); ) {
+        size_t end = i;
+        while (end < records.size() && records[end].id == records[i].id)
+            end++;
+
+        // the whole transaction, its phases, then each event
+        PrintEvent(os, first, "b", "xaction", records[i], pid);
+        for (size_t p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+            size_t from = i;
+            while (from < end && records[from].event != (unsigned)phases[p].from)
+                from++;
+            if (from == end) continue;
+            size_t to = from + 1;
+            while (to < end && records[to].event != (unsigned)phases[p].to[0] &&
+                records[to].event != (unsigned)phases[p].to[1] &&
+                records[to].event != (unsigned)phases[p].to[2])
+                to++;
+            if (to == end) continue;
+            PrintEvent(os, first, "b", phases[p].name, records[from], pid);
+            PrintEvent(os, first, "e", phases[p].name, records[to], pid);
+        }
+        for (size_t r = i; r < end; r++) {
+            if (records[r].event < eventMax)
+                PrintEvent(os, first, "n", event_names[records[r].event], records[r], pid);
+        }
+        PrintEvent(os, first, "e", "xaction", records[end - 1], pid);
+
+        i = end;
+    }
+    os << "\n  ],\n";
+
+    // as Stats shows start() times: only the buckets in use
+    os << "  \"latency_ns\": {\n";
+    os << "    \"sample\": " << sample_rate.load(std::memory_order_relaxed);
+    for (int e = 0; e < eventMax; e++) {
+        unsigned long count = 0;
+        os << ",\n    \"" << event_names[e] << "\": [";
+        for (int b = 0; b < LATENCY_TRACE_BUCKETS; b++) {
+            if (!latency[e][b]) continue;
+            os << ((count) ? ", " : " ") << "[" << (1ULL << b) << ", " << latency[e][b] << "]";
+            count += latency[e][b];
+        }
+        os << " ]";
+    }
+    os << "\n  }\n}\n";
+}
+
+bool Adapter::LatencyTrace::dump(const std::string &filename) const
+{
+    std::ostringstream os;
+    format(os);
+    return DumpFile(filename, os.str());
+}
+
+// the handler only sets a flag, which the watcher thread polls
+void Adapter::LatencyTrace::Catch(bool on)
+{
+    if (on == caught) return;
+
+    if (on) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = NoteSignal;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGUSR2, &action, &previous) < 0) {
+            ADAPTER_LOG(LOG_ERR, "%s: %s", __PRETTY_FUNCTION__, strerror(errno));
+            return;
+        }
+    } else
+        sigaction(SIGUSR2, &previous, NULL);
+    caught = on;
+}
+
+bool Adapter::LatencyTrace::Requested(void)
+{
+    return requested.exchange(false, std::memory_order_relaxed);
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,125 @@
+#ifndef _LATENCY_TRACE_H
+#define _LATENCY_TRACE_H
+
+// Buckets of the per-event latency histograms; as for Stats, bucket n
+// counts events less than 2^n nanoseconds after start(), the last one
+// everything later
+#define LATENCY_TRACE_BUCKETS   40
+
+// How often the watcher thread checks for a dump requested with
+// SIGUSR2, in seconds
+#define LATENCY_TRACE_POLL      1
+
+namespace Adapter
+{
+
+// Where one traced transaction is: its number (0 if it is not traced)
+// and when start() was called, in steady clock nanoseconds
+class TraceSpan
+{
+public:
+    TraceSpan() : id(0), begin(0) { };
+
+    uint64_t id;
+    uint64_t begin;
+};
+
+// Timestamps of the state transitions of sampled transactions, so that
+// the time a request spends with us can be told from the time it spends
+// waiting for Squid.  Like Stats, every thread writes to a shard of its
+// own, here a ring of the latest events, without locks; dump() writes
+// what the rings hold as a Chrome trace (chrome://tracing, Perfetto),
+// with a histogram per event of its time since start() for all the
+// transactions ever sampled.
+class LatencyTrace
+{
+public:
+    typedef enum
+    {
+        eventStart, // start() called
+        eventDelayed, // waiting for lookups
+        eventResumed, // lookups done
+        eventUseVirgin, // the host keeps the virgin message
+        eventUseAdapted, // the adapted header went to the host
+        eventVbOn, // receivingVb: the host makes the virgin body
+        eventVbAvailable, // virgin body content arrived
+        eventVbDone, // the host made all of it
+        eventVbComplete, // receivingVb: no more virgin body wanted
+        eventAbOn, // sendingAb: the host takes the adapted body
+        eventAbDone, // sendingAb: all of it was made
+        eventAbNever, // sendingAb: the host wants none
+        eventStop, // the host is done with us
+        eventEnd, // the transaction is gone
+        eventMax
+    } Event;
+
+    LatencyTrace();
+    ~LatencyTrace();
+
+    // one in sample transactions is traced, 0 for none; a shard keeps
+    // the latest events of its thread, as set when it is made
+    void configure(unsigned sample, size_t events);
+    inline bool enabled(void) const
+        { return sample_rate.load(std::memory_order_relaxed) != 0; };
+
+    // starts span if this transaction is sampled
+    inline void begin(TraceSpan &span)
+        { if (enabled()) sample(span); };
+    inline void note(const TraceSpan &span, Event event)
+        { if (span.id) record(span, event); };
+
+    // writes the Chrome trace to a temporary file renamed over filename
+    bool dump(const std::string &filename) const;
+    void format(std::ostream &os) const;
+
+    // dumps are requested with SIGUSR2, if caught; a handler Squid had
+    // is still called
+    static void Catch(bool on);
+    static bool Requested(void); // and clears the request
+
+protected:
+    class Shard
+    {
+    public:
+        Shard(unsigned number, size_t capacity);
+
+        const unsigned number; // in the order threads came
+        const size_t capacity;
+
+        // an event is id << 8 | Event, then the time; an entry is only
+        // read after head says it was written, and rechecked after
+        std::vector<std::atomic<uint64_t> > ring;
+        std::atomic<uint64_t> head; // events ever written
+
+        std::atomic<unsigned long> latency[eventMax][LATENCY_TRACE_BUCKETS];
+        unsigned sample; // owner thread only
+        uint64_t serial; // owner thread only
+    };
+
+    void sample(TraceSpan &span);
+    void record(const TraceSpan &span, Event event);
+
+    static uint64_t Now(void);
+
+    inline Shard &shard(void)
+        { return (cached_id == id) ? *cached_shard : attach(); };
+    Shard &attach(void); // creates the calling thread's shard
+
+    const unsigned long id; // never reused, unlike addresses
+
+    std::atomic<unsigned> sample_rate;
+    std::atomic<size_t> capacity; // of shards made from now on
+
+    mutable std::mutex shards_lock; // Guards shards
+    std::vector<Shard *> shards;
+
+    // the shard the calling thread used last, and whose it is
+    static __thread unsigned long cached_id;
+    static __thread Shard *cached_shard;
+};
+
+} // namespace Adapter
+
+#endif // _LATENCY_TRACE_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,238 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+
+#include <libecap/common/area.h>
+#include <libecap/common/memory.h>
+
+#include <syslog.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "adapter-log.h"
+#include "pool.h"
+#include "header-template.h"
+#include "lookup.h"
+
+Adapter::Lookup::Lookup(const std::string &name, TemplateValues::Variable key,
+    Resolver resolver, const std::string &path, unsigned ttl, unsigned timeout)
+    : lookup_name(name), lookup_key(key), resolver(resolver),
+    path(path), ttl(ttl), timeout(timeout) { }
+
+bool Adapter::Lookup::cached(const std::string &key, std::string &value) const
+{
+    std::lock_guard<std::mutex> lg(cache_lock);
+
+    std::map<std::string, Answer>::const_iterator i = cache.find(key);
+    if (i == cache.end() || i->second.expires <= time(NULL)) return false;
+
+    value = i->second.value;
+    return true;
+}
+
+// answers that are not there are cached too; errors are not
+void Adapter::Lookup::resolve(const std::string &key, std::string &value) const
+{
+    value.clear();
+    const bool answered = (resolver == resolverFile) ?
+        resolveFile(key, value) : resolveSocket(key, value);
+    if (!answered || !ttl) return;
+
+    const time_t now = time(NULL);
+
+    std::lock_guard<std::mutex> lg(cache_lock);
+    if (cache.size() >= LOOKUP_CACHE_SIZE) {
+        for (std::map<std::string, Answer>::iterator i = cache.begin(); i != cache.end(); ) {
+            if (i->second.expires <= now) cache.erase(i++);
+            else i++;
+        }
+        if (cache.size() >= LOOKUP_CACHE_SIZE) cache.clear();
+    }
+
+    Answer &answer = cache[key];
+    answer.value = value;
+    answer.expires = now + ttl;
+}
+
+// read on every miss, so that edits apply without a reload
+bool Adapter::Lookup::resolveFile(const std::string &key, std::string &value) const
+{
+    std::ifstream file(path.c_str());
+    if (!file.is_open()) {
+        ADAPTER_LOG(LOG_WARNING, "%s: %s: %s: %s", __PRETTY_FUNCTION__,
+            lookup_name.c_str(), path.c_str(), strerror(errno));
+        return false;
+    }
+
+    const char *blanks = " \t\r";
+    std::string line;
+    while (std::getline(file, line)) {
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+
+        const size_t start = line.find_first_not_of(blanks);
+        if (start == std::string::npos) continue;
+        const size_t end = line.find_first_of(blanks, start);
+        if (line.compare(start, end - start, key)) continue;
+
+        const size_t value_start = line.find_first_not_of(blanks, end);
+        if (value_start != std::string::npos) {
+            const size_t value_end = line.find_last_not_of(blanks);
+            value = line.substr(value_start, value_end - value_start + 1);
+        }
+        break;
+    }
+
+    return true;
+}
+
+bool Adapter::Lookup::resolveSocket(const std::string &key, std::string &value) const
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        ADAPTER_LOG(LOG_WARNING, "%s: %s: socket path too long",
+            __PRETTY_FUNCTION__, lookup_name.c_str());
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ADAPTER_LOG(LOG_WARNING, "%s: %s: socket: %s",
+            __PRETTY_FUNCTION__, lookup_name.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    const std::string request = key + "\n";
+    bool answered = false;
+    errno = 0;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size()) {
+        char buffer[512];
+        ssize_t length;
+        while ((length = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            const char *newline = (const char *)memchr(buffer, '\n', length);
+            value.append(buffer, (newline) ? newline - buffer : length);
+            if (newline) {
+                answered = true;
+                break;
+            }
+        }
+    }
+    if (!answered) {
+        ADAPTER_LOG(LOG_WARNING, "%s: %s: %s: %s", __PRETTY_FUNCTION__,
+            lookup_name.c_str(), path.c_str(), (errno) ? strerror(errno) : "no answer");
+        value.clear();
+    }
+    close(fd);
+
+    if (value.size() && value[value.size() - 1] == '\r')
+        value.erase(value.size() - 1);
+    return answered;
+}
+
+Adapter::LookupQueue::LookupQueue()
+    : stopping(false), last_ticket(0) { }
+
+// answers still being looked up are dropped
+Adapter::LookupQueue::~LookupQueue()
+{
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+uint64_t Adapter::LookupQueue::attach(LookupClient *client)
+{
+    clients[++last_ticket] = client;
+    return last_ticket;
+}
+
+void Adapter::LookupQueue::detach(uint64_t ticket)
+{
+    clients.erase(ticket);
+}
+
+void Adapter::LookupQueue::submit(uint64_t ticket, const LookupPointer &lookup,
+    unsigned number, const std::string &key)
+{
+    Job job;
+    job.ticket = ticket;
+    job.lookup = lookup;
+    job.number = number;
+    job.key = key;
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        jobs.push_back(job);
+    }
+    wake.notify_one();
+
+    while (workers.size() < LOOKUP_THREADS)
+        workers.push_back(std::thread(&Adapter::LookupQueue::work, this));
+}
+
+// a client may detach itself, or others, while being told
+void Adapter::LookupQueue::deliver(void)
+{
+    std::deque<Job> ready;
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        if (!answers.size()) return;
+        ready.swap(answers);
+    }
+
+    for (std::deque<Job>::const_iterator i = ready.begin(); i != ready.end(); i++) {
+        std::map<uint64_t, LookupClient *>::const_iterator client = clients.find(i->ticket);
+        if (client != clients.end())
+            client->second->noteLookup(i->number, i->value);
+    }
+}
+
+void Adapter::LookupQueue::work(void)
+{
+    std::unique_lock<std::mutex> ul(lock);
+    for ( ;; ) {
+        wake.wait(ul, [this] { return stopping || jobs.size(); });
+        if (stopping) break;
+
+        Job job = jobs.front();
+        jobs.pop_front();
+
+        ul.unlock();
+        job.lookup->resolve(job.key, job.value);
+        ul.lock();
+
+        answers.push_back(job);
+    }
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
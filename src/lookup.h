@@ -0,0 +1,139 @@
+#ifndef _LOOKUP_H
+#define _LOOKUP_H
+
+// Threads resolving lookups, started with the first one
+#define LOOKUP_THREADS          4
+
+// Default seconds an answer is cached, and resolver timeout in ms
+#define DEFAULT_LOOKUP_TTL      300
+#define DEFAULT_LOOKUP_TIMEOUT  1000
+
+// Answers cached per lookup; a full cache drops the expired ones, or
+// everything if none has expired
+#define LOOKUP_CACHE_SIZE       65536
+
+// Host event loop timeout while answers are outstanding, in ms
+#define LOOKUP_POLL             1
+
+namespace Adapter
+{
+
+// A <lookup> element: values for ${lookup:name} that depend on a key
+// from the request (a user, say) and come from a resolver too slow to
+// ask on the host thread.  A file resolver holds "key value" lines; a
+// socket resolver is sent "key\n" on a Unix stream socket and answers
+// "value\n", or an empty line for none.
+class Lookup
+{
+public:
+    typedef enum
+    {
+        resolverFile,
+        resolverSocket
+    } Resolver;
+
+    Lookup(const std::string &name, TemplateValues::Variable key,
+        Resolver resolver, const std::string &path, unsigned ttl, unsigned timeout);
+
+    inline const std::string &name(void) const { return lookup_name; };
+    inline TemplateValues::Variable key(void) const { return lookup_key; };
+
+    // any thread; false unless the answer for key is cached
+    bool cached(const std::string &key, std::string &value) const;
+    // blocks; an empty value if there is none, or on errors
+    void resolve(const std::string &key, std::string &value) const;
+
+protected:
+    bool resolveFile(const std::string &key, std::string &value) const;
+    bool resolveSocket(const std::string &key, std::string &value) const;
+
+    class Answer
+    {
+    public:
+        std::string value;
+        time_t expires;
+    };
+
+    const std::string lookup_name;
+    const TemplateValues::Variable lookup_key;
+    const Resolver resolver;
+    const std::string path; // File or socket
+    const unsigned ttl; // Seconds
+    const unsigned timeout; // Milliseconds, socket resolver only
+
+    mutable std::mutex cache_lock; // Guards cache
+    mutable std::map<std::string, Answer> cache;
+};
+
+typedef libecap::shared_ptr<const Lookup> LookupPointer;
+
+// Told of answers, on the host thread
+class LookupClient
+{
+public:
+    virtual ~LookupClient() { };
+    virtual void noteLookup(unsigned number, const std::string &value) = 0;
+};
+
+// What a transaction looked up, by lookup number
+class LookupResults
+{
+public:
+    LookupResults() : pending(0), ticket(0) { };
+
+    // one per transaction that uses lookups
+    static void *operator new(size_t size) { return Pool::Allocate(size); };
+    static void operator delete(void *p, size_t size) { Pool::Release(p, size); };
+
+    std::string values[TEMPLATE_LOOKUPS];
+    unsigned pending; // answers still to come
+    uint64_t ticket; // LookupQueue::attach(), 0 once detached
+};
+
+// Lookups handed to worker threads by the host thread, whose answers
+// wait for the host to call deliver().  Clients are known by ticket,
+// so that an answer for one that is gone is dropped, whatever took its
+// place in memory.
+class LookupQueue
+{
+public:
+    LookupQueue();
+    ~LookupQueue();
+
+    // host thread only
+    uint64_t attach(LookupClient *client);
+    void detach(uint64_t ticket);
+    void submit(uint64_t ticket, const LookupPointer &lookup,
+        unsigned number, const std::string &key);
+    void deliver(void); // answers to their clients
+    inline bool waiting(void) const { return clients.size() != 0; };
+
+protected:
+    class Job
+    {
+    public:
+        uint64_t ticket;
+        LookupPointer lookup;
+        unsigned number;
+        std::string key;
+        std::string value;
+    };
+
+    void work(void); // worker threads
+
+    std::mutex lock; // Guards jobs, answers and stopping
+    std::condition_variable wake;
+    std::deque<Job> jobs;
+    std::deque<Job> answers;
+    bool stopping;
+    std::vector<std::thread> workers;
+
+    std::map<uint64_t, LookupClient *> clients; // host thread only
+    uint64_t last_ticket;
+};
+
+} // namespace Adapter
+
+#endif // _LOOKUP_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,153 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <libecap/common/area.h>
+#include <libecap/common/message.h>
+#include <libecap/common/header.h>
+#include <libecap/common/names.h>
+#include <libecap/host/xaction.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pool.h"
+#include "url-matcher.h"
+#include "message-meta.h"
+
+namespace
+{
+
+const libecap::Name headerHost("Host", libecap::Name::NextId());
+const libecap::Name headerContentType("Content-Type", libecap::Name::NextId());
+
+} // namespace
+
+Adapter::MessageMeta::MessageMeta(libecap::host::Xaction *hostx)
+    : hostx(hostx), known(0), adapting_request(false),
+    request_message(NULL), request_line(NULL),
+    content_length(0), has_content_length(false) { }
+
+bool Adapter::MessageMeta::adaptingRequest(void) const
+{
+    if (!(known & knownRequest)) findRequest();
+    return adapting_request;
+}
+
+const libecap::Message &Adapter::MessageMeta::request(void) const
+{
+    if (!(known & knownRequest)) findRequest();
+    return *request_message;
+}
+
+const libecap::Area &Adapter::MessageMeta::uri(void) const
+{
+    if (!(known & knownUri)) {
+        if (!(known & knownRequest)) findRequest();
+        uri_area = request_line->uri();
+        known |= knownUri;
+    }
+    return uri_area;
+}
+
+const libecap::Area &Adapter::MessageMeta::host(void) const
+{
+    if (!(known & knownHostPath)) findHostPath();
+    return host_area;
+}
+
+const libecap::Area &Adapter::MessageMeta::path(void) const
+{
+    if (!(known & knownHostPath)) findHostPath();
+    return path_area;
+}
+
+const libecap::Area &Adapter::MessageMeta::contentType(void) const
+{
+    if (!(known & knownContentType)) {
+        const libecap::Header &header = hostx->virgin().header();
+        if (header.hasAny(headerContentType))
+            content_type = header.value(headerContentType);
+        known |= knownContentType;
+    }
+    return content_type;
+}
+
+bool Adapter::MessageMeta::contentLength(uint64_t &length) const
+{
+    if (!(known & knownContentLength)) findContentLength();
+    length = content_length;
+    return has_content_length;
+}
+
+// the one type check per transaction: the cause of a response is the
+// request for it, so only the virgin message needs one
+void Adapter::MessageMeta::findRequest(void) const
+{
+    const libecap::Message &virgin = hostx->virgin();
+    request_line = dynamic_cast<const libecap::RequestLine *>(&virgin.firstLine());
+    adapting_request = request_line != NULL;
+    if (adapting_request)
+        request_message = &virgin;
+    else {
+        request_message = &hostx->cause();
+        request_line = static_cast<const libecap::RequestLine *>(&request_message->firstLine());
+    }
+    known |= knownRequest;
+}
+
+void Adapter::MessageMeta::findHostPath(void) const
+{
+    const libecap::Area &whole = uri();
+    const char *host_start, *path_start;
+    size_t host_length, path_length;
+    UrlMatcher::SplitUrl(whole.start, whole.size, host_start, host_length, path_start, path_length);
+
+    known |= knownHostPath;
+    path_area = libecap::Area(path_start, path_length, whole.details);
+    if (host_length) {
+        host_area = libecap::Area(host_start, host_length, whole.details);
+        return;
+    }
+
+    const libecap::Header &header = request_message->header();
+    if (!header.hasAny(headerHost)) return;
+
+    const libecap::Area host_header = header.value(headerHost);
+    const char *ignored;
+    size_t ignored_length;
+    UrlMatcher::SplitUrl(host_header.start, host_header.size,
+        host_start, host_length, ignored, ignored_length);
+    host_area = libecap::Area(host_start, host_length, host_header.details);
+}
+
+// digits only, as a sender may not put anything else there
+void Adapter::MessageMeta::findContentLength(void) const
+{
+    known |= knownContentLength;
+
+    const libecap::Header &header = hostx->virgin().header();
+    if (!header.hasAny(libecap::headerContentLength)) return;
+
+    const libecap::Area value = header.value(libecap::headerContentLength);
+    size_t i = 0;
+    while (i < value.size && (value.start[i] == ' ' || value.start[i] == '\t')) i++;
+    if (i == value.size) return;
+
+    uint64_t length = 0;
+    for ( ; i < value.size && value.start[i] >= '0' && value.start[i] <= '9'; i++) {
+        if (length > (UINT64_MAX - 9) / 10) return;
+        length = length * 10 + (value.start[i] - '0');
+    }
+    while (i < value.size && (value.start[i] == ' ' || value.start[i] == '\t')) i++;
+    if (i != value.size) return;
+
+    content_length = length;
+    has_content_length = true;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,65 @@
+#ifndef _MESSAGE_META_H
+#define _MESSAGE_META_H
+
+namespace Adapter
+{
+
+// What rules, decisions and logging want to know about the message of
+// one transaction.  Each item is worked out the first time it is asked
+// for and remembered, so that a transaction no rule looks at does not
+// pay for it.  The areas share storage with the host messages and are
+// only valid while the host transaction is.
+class MessageMeta
+{
+public:
+    explicit MessageMeta(libecap::host::Xaction *hostx);
+
+    // the virgin message is a request, rather than a response to one
+    bool adaptingRequest(void) const;
+    // the virgin message when adapting requests, its cause otherwise
+    const libecap::Message &request(void) const;
+
+    // of the request; the host and path come from its URI or, for
+    // origin-form URIs as intercepted requests have, the Host header
+    const libecap::Area &uri(void) const;
+    const libecap::Area &host(void) const;
+    const libecap::Area &path(void) const;
+
+    // of the virgin message; empty, or false, if it has none
+    const libecap::Area &contentType(void) const;
+    bool contentLength(uint64_t &length) const;
+
+protected:
+    typedef enum
+    {
+        knownRequest = 1 << 0,
+        knownUri = 1 << 1,
+        knownHostPath = 1 << 2,
+        knownContentType = 1 << 3,
+        knownContentLength = 1 << 4
+    } Known;
+
+    void findRequest(void) const;
+    void findHostPath(void) const;
+    void findContentLength(void) const;
+
+    libecap::host::Xaction *hostx;
+    mutable unsigned known; // Known bits
+
+    mutable bool adapting_request;
+    mutable const libecap::Message *request_message;
+    mutable const libecap::RequestLine *request_line;
+
+    mutable libecap::Area uri_area;
+    mutable libecap::Area host_area;
+    mutable libecap::Area path_area;
+    mutable libecap::Area content_type;
+    mutable uint64_t content_length;
+    mutable bool has_content_length;
+};
+
+} // namespace Adapter
+
+#endif // _MESSAGE_META_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
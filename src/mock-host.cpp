@@ -0,0 +1,448 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <iostream>
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <libecap/common/registry.h>
+#include <libecap/common/errors.h>
+#include <libecap/common/message.h>
+#include <libecap/common/header.h>
+#include <libecap/common/names.h>
+#include <libecap/common/delay.h>
+#include <libecap/host/host.h>
+#include <libecap/adapter/service.h>
+#include <libecap/adapter/xaction.h>
+#include <libecap/host/xaction.h>
+
+#include <strings.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "mock-host.h"
+
+bool Mock::counting = false;
+unsigned long Mock::allocations = 0;
+
+libecap::Area Mock::MakeArea(const std::string &text)
+{
+    libecap::shared_ptr<StringDetails> details(new StringDetails(text));
+    return libecap::Area(details->text.data(), details->text.size(), details);
+}
+
+// Header
+
+bool Mock::Header::hasAny(const libecap::Name &name) const
+{
+    HostCall call;
+    for (Fields::const_iterator i = fields.begin(); i != fields.end(); i++) {
+        if (strcasecmp(i->first.c_str(), name.image().c_str()) == 0)
+            return true;
+    }
+    return false;
+}
+
+Mock::Header::Value Mock::Header::value(const libecap::Name &name) const
+{
+    HostCall call;
+    for (Fields::const_iterator i = fields.begin(); i != fields.end(); i++) {
+        if (strcasecmp(i->first.c_str(), name.image().c_str()) == 0)
+            return i->second;
+    }
+    return Value();
+}
+
+// like Squid, keeps a copy of values it does not share ownership of
+void Mock::Header::add(const libecap::Name &name, const Value &value)
+{
+    HostCall call;
+    fields.push_back(std::make_pair(name.image(),
+        (value.details) ? value : MakeArea(value.toString())));
+}
+
+void Mock::Header::removeAny(const libecap::Name &name)
+{
+    HostCall call;
+    Fields::iterator i = fields.begin();
+    while (i != fields.end()) {
+        if (strcasecmp(i->first.c_str(), name.image().c_str()) == 0)
+            i = fields.erase(i);
+        else
+            i++;
+    }
+}
+
+void Mock::Header::visitEach(libecap::NamedValueVisitor &visitor) const
+{
+    for (Fields::const_iterator i = fields.begin(); i != fields.end(); i++) {
+        libecap::Name name;
+        {
+            HostCall call;
+            name = libecap::Name(i->first);
+        }
+        visitor.visit(name, i->second);
+    }
+}
+
+libecap::Area Mock::Header::image() const
+{
+    HostCall call;
+    std::string text;
+    for (Fields::const_iterator i = fields.begin(); i != fields.end(); i++)
+        text += i->first + ": " + i->second.toString() + "\r\n";
+    return MakeArea(text);
+}
+
+void Mock::Header::parse(const libecap::Area &)
+{
+    Must(false); // the adapter never parses headers
+}
+
+// RequestLine
+
+Mock::RequestLine::RequestLine(const std::string &method, const std::string &uri)
+    : request_method(method), request_uri(MakeArea(uri))
+{
+}
+
+// Message
+
+Mock::Message::Message(const std::string &method, const std::string &uri)
+    : first_line(new RequestLine(method, uri)), message_body(NULL)
+{
+}
+
+Mock::Message::Message(int status)
+    : first_line(new StatusLine(status)), message_body(NULL)
+{
+}
+
+Mock::Message::Message(const Message &other)
+    : first_line(NULL), message_header(other.message_header), message_body(NULL)
+{
+    const RequestLine *request = dynamic_cast<const RequestLine *>(other.first_line);
+    if (request)
+        first_line = new RequestLine(*request);
+    else
+        first_line = new StatusLine(dynamic_cast<const StatusLine &>(*other.first_line));
+
+    if (other.message_body)
+        message_body = new Body(*other.message_body);
+}
+
+Mock::Message::~Message()
+{
+    delete first_line;
+    delete message_body;
+}
+
+libecap::shared_ptr<libecap::Message> Mock::Message::clone() const
+{
+    HostCall call;
+    return libecap::shared_ptr<libecap::Message>(new Message(*this));
+}
+
+void Mock::Message::addBody()
+{
+    HostCall call;
+    if (!message_body)
+        message_body = new Body;
+}
+
+void Mock::Message::setBodySize(libecap::BodySize::size_type size)
+{
+    addBody();
+    message_body->size = libecap::BodySize(size);
+}
+
+// Options
+
+const libecap::Area Mock::Options::option(const libecap::Name &name) const
+{
+    HostCall call;
+    std::map<std::string, std::string>::const_iterator i = values.find(name.image());
+    if (i == values.end())
+        return libecap::Area();
+    return libecap::Area(i->second.data(), i->second.size());
+}
+
+void Mock::Options::visitEachOption(libecap::NamedValueVisitor &visitor) const
+{
+    std::map<std::string, std::string>::const_iterator i;
+    for (i = values.begin(); i != values.end(); i++)
+        visitor.visit(libecap::Name(i->first), libecap::Area(i->second.data(), i->second.size()));
+}
+
+void Mock::Options::set(const std::string &name, const std::string &value)
+{
+    values[name] = value;
+}
+
+// Host
+
+void Mock::Host::noteVersionedService(const char *,
+    const libecap::weak_ptr<libecap::adapter::Service> &s)
+{
+    adapter_services.push_back(s);
+}
+
+libecap::shared_ptr<libecap::Message> Mock::Host::newRequest() const
+{
+    HostCall call;
+    return libecap::shared_ptr<libecap::Message>(new Message("GET", "/"));
+}
+
+libecap::shared_ptr<libecap::Message> Mock::Host::newResponse() const
+{
+    HostCall call;
+    return libecap::shared_ptr<libecap::Message>(new Message(200));
+}
+
+libecap::shared_ptr<libecap::adapter::Service> Mock::Host::service(void) const
+{
+    if (adapter_services.empty())
+        return libecap::shared_ptr<libecap::adapter::Service>();
+    return adapter_services.front().lock();
+}
+
+libecap::shared_ptr<libecap::adapter::Service> Mock::Host::service(const std::string &uri) const
+{
+    for (size_t i = 0; i < adapter_services.size(); i++) {
+        const libecap::shared_ptr<libecap::adapter::Service> s = adapter_services[i].lock();
+        if (s && s->uri() == uri)
+            return s;
+    }
+    return libecap::shared_ptr<libecap::adapter::Service>();
+}
+
+// Xaction
+
+Mock::Xaction::Xaction(libecap::adapter::Service &service)
+    : used_virgin(false), aborted(false), ab_bytes(0), ab_copied(0),
+    delayed(false), resumed(false), service(service), virgin_chunks(NULL), vb_offset(0),
+    making_vb(false), making_ab(false), ab_available(false), ab_done(false),
+    resume_pending(false)
+{
+}
+
+void Mock::Xaction::run(libecap::shared_ptr<Message> virgin,
+    libecap::shared_ptr<Message> cause, const Chunks &chunks)
+{
+    virgin_message = virgin;
+    cause_message = cause;
+    virgin_chunks = &chunks;
+    vb.clear();
+    vb_offset = 0;
+    making_vb = making_ab = ab_available = ab_done = false;
+    used_virgin = aborted = delayed = resumed = resume_pending = false;
+    adapted_message.reset();
+    ab_bytes = ab_copied = 0;
+
+    counting = true;
+    adapter = service.makeXaction(this);
+    adapter->start();
+
+    // a delayed transaction waits in the event loop, which resumes the
+    // adapter on the turn after it asked
+    while (delayed && !resumed && !aborted) {
+        timeval timeout = { 0, 10000 };
+        service.suspend(timeout);
+        usleep(timeout.tv_sec * 1000000 + timeout.tv_usec);
+        service.resume();
+        if (resume_pending) {
+            resume_pending = false;
+            resumed = true;
+            adapter->resume();
+        }
+    }
+
+    if (adapted_message && adapted_message->body() && !aborted) {
+        making_ab = true;
+        adapter->abMake();
+    }
+
+    // deliver the virgin body for as long as the adapter wants it
+    for (Chunks::const_iterator i = chunks.begin(); i != chunks.end() && making_vb; i++) {
+        counting = false;
+        vb.push_back(*i);
+        counting = true;
+        adapter->noteVbContentAvailable();
+        drainAb();
+    }
+
+    if (making_vb) {
+        making_vb = false;
+        adapter->noteVbContentDone(true);
+    }
+    drainAb();
+
+    adapter->stop();
+    adapter.reset();
+    counting = false;
+
+    vb.clear();
+    virgin_chunks = NULL;
+}
+
+// takes everything the adapter has made so far, like a fast client would
+void Mock::Xaction::drainAb(void)
+{
+    while (making_ab && ab_available) {
+        ab_available = false;
+        for (;;) {
+            const libecap::Area ab = adapter->abContent(0, libecap::nsize);
+            if (!ab.size)
+                break;
+            ab_bytes += ab.size;
+            if (!fromVirgin(ab))
+                ab_copied += ab.size;
+            adapter->abContentShift(ab.size);
+        }
+    }
+}
+
+bool Mock::Xaction::fromVirgin(const libecap::Area &area) const
+{
+    HostCall call;
+    for (Chunks::const_iterator i = virgin_chunks->begin(); i != virgin_chunks->end(); i++) {
+        if (area.start >= i->start && area.start + area.size <= i->start + i->size)
+            return true;
+    }
+    return false;
+}
+
+const libecap::Area Mock::Xaction::option(const libecap::Name &name) const
+{
+    return meta.option(name);
+}
+
+void Mock::Xaction::visitEachOption(libecap::NamedValueVisitor &visitor) const
+{
+    meta.visitEachOption(visitor);
+}
+
+void Mock::Xaction::setOption(const std::string &name, const std::string &value)
+{
+    meta.set(name, value);
+}
+
+libecap::Message &Mock::Xaction::virgin()
+{
+    return *virgin_message;
+}
+
+const libecap::Message &Mock::Xaction::cause()
+{
+    Must(cause_message);
+    return *cause_message;
+}
+
+libecap::Message &Mock::Xaction::adapted()
+{
+    Must(adapted_message);
+    return *adapted_message;
+}
+
+void Mock::Xaction::useVirgin()
+{
+    HostCall call;
+    used_virgin = true;
+    making_vb = false; // the host relays the body on its own
+}
+
+void Mock::Xaction::useAdapted(const libecap::shared_ptr<libecap::Message> &msg)
+{
+    HostCall call;
+    adapted_message = msg;
+}
+
+void Mock::Xaction::blockVirgin()
+{
+    HostCall call;
+    aborted = true;
+}
+
+void Mock::Xaction::adaptationDelayed(const libecap::Delay &)
+{
+    delayed = true;
+}
+
+void Mock::Xaction::adaptationAborted()
+{
+    HostCall call;
+    aborted = true;
+    making_vb = making_ab = false;
+}
+
+void Mock::Xaction::resume()
+{
+    resume_pending = true;
+}
+
+void Mock::Xaction::vbDiscard()
+{
+    making_vb = false;
+}
+
+void Mock::Xaction::vbMake()
+{
+    making_vb = virgin_message->body() != NULL;
+}
+
+void Mock::Xaction::vbStopMaking()
+{
+    making_vb = false;
+}
+
+void Mock::Xaction::vbMakeMore()
+{
+}
+
+// like the host, returns whatever is contiguous at the given offset
+libecap::Area Mock::Xaction::vbContent(size_type offset, size_type size)
+{
+    HostCall call;
+    offset += vb_offset;
+    for (std::deque<libecap::Area>::const_iterator i = vb.begin(); i != vb.end(); i++) {
+        if (offset < i->size) {
+            const size_type length = std::min(size, i->size - offset);
+            return libecap::Area(i->start + offset, length, i->details);
+        }
+        offset -= i->size;
+    }
+    return libecap::Area();
+}
+
+void Mock::Xaction::vbContentShift(size_type size)
+{
+    HostCall call;
+    while (size) {
+        Must(!vb.empty());
+        const size_type left = vb.front().size - vb_offset;
+        if (size < left) {
+            vb_offset += size;
+            return;
+        }
+        size -= left;
+        vb.pop_front();
+        vb_offset = 0;
+    }
+}
+
+void Mock::Xaction::noteAbContentDone(bool)
+{
+    ab_done = true;
+    ab_available = true; // whatever is left in the adapter
+}
+
+void Mock::Xaction::noteAbContentAvailable()
+{
+    ab_available = true;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,234 @@
+#ifndef _MOCK_HOST_H
+#define _MOCK_HOST_H
+
+// In-process stand-in for the libecap host (Squid), used to drive the
+// adapter without a proxy.  Only what the adapter touches is modelled.
+namespace Mock
+{
+using libecap::size_type;
+
+// Allocation accounting; the bench counts only allocations made while
+// counting is on, and every host-side call turns it off for its duration
+extern bool counting;
+extern unsigned long allocations;
+
+class HostCall
+{
+public:
+    HostCall() : saved(counting) { counting = false; };
+    ~HostCall() { counting = saved; };
+
+private:
+    bool saved;
+};
+
+// Shares an immutable string as the backing store of areas
+class StringDetails : public libecap::AreaDetails
+{
+public:
+    StringDetails(const std::string &text) : text(text) { };
+
+    std::string text;
+};
+
+libecap::Area MakeArea(const std::string &text);
+
+class Header : public libecap::Header
+{
+public:
+    virtual bool hasAny(const libecap::Name &name) const;
+    virtual Value value(const libecap::Name &name) const;
+    virtual void add(const libecap::Name &name, const Value &value);
+    virtual void removeAny(const libecap::Name &name);
+    virtual void visitEach(libecap::NamedValueVisitor &visitor) const;
+    virtual libecap::Area image() const;
+    virtual void parse(const libecap::Area &buf);
+
+protected:
+    typedef std::vector<std::pair<std::string, libecap::Area> > Fields;
+    Fields fields;
+};
+
+class RequestLine : public libecap::RequestLine
+{
+public:
+    RequestLine(const std::string &method, const std::string &uri);
+
+    virtual libecap::Version version() const { return libecap::Version(); };
+    virtual void version(const libecap::Version &) { };
+    virtual libecap::Name protocol() const { return libecap::Name("HTTP"); };
+    virtual void protocol(const libecap::Name &) { };
+    virtual void uri(const libecap::Area &aUri) { request_uri = aUri; };
+    virtual libecap::Area uri() const { return request_uri; };
+    virtual void method(const libecap::Name &aMethod) { request_method = aMethod; };
+    virtual libecap::Name method() const { return request_method; };
+
+protected:
+    libecap::Name request_method;
+    libecap::Area request_uri;
+};
+
+class StatusLine : public libecap::StatusLine
+{
+public:
+    StatusLine(int code) : code(code) { };
+
+    virtual libecap::Version version() const { return libecap::Version(); };
+    virtual void version(const libecap::Version &) { };
+    virtual libecap::Name protocol() const { return libecap::Name("HTTP"); };
+    virtual void protocol(const libecap::Name &) { };
+    virtual void statusCode(int aCode) { code = aCode; };
+    virtual int statusCode() const { return code; };
+    virtual void reasonPhrase(const libecap::Area &) { };
+    virtual libecap::Area reasonPhrase() const { return libecap::Area(); };
+
+protected:
+    int code;
+};
+
+class Body : public libecap::Body
+{
+public:
+    virtual libecap::BodySize bodySize() const { return size; };
+
+    libecap::BodySize size;
+};
+
+class Message : public libecap::Message
+{
+public:
+    Message(const std::string &method, const std::string &uri); // request
+    Message(int status); // response
+    Message(const Message &other);
+    virtual ~Message();
+
+    virtual libecap::shared_ptr<libecap::Message> clone() const;
+    virtual libecap::FirstLine &firstLine() { return *first_line; };
+    virtual const libecap::FirstLine &firstLine() const { return *first_line; };
+    virtual libecap::Header &header() { return message_header; };
+    virtual const libecap::Header &header() const { return message_header; };
+    virtual void addBody();
+    virtual libecap::Body *body() { return message_body; };
+    virtual const libecap::Body *body() const { return message_body; };
+    virtual void addTrailer() { };
+    virtual libecap::Header *trailer() { return NULL; };
+    virtual const libecap::Header *trailer() const { return NULL; };
+
+    void setBodySize(libecap::BodySize::size_type size);
+
+protected:
+    libecap::FirstLine *first_line;
+    Header message_header;
+    Body *message_body;
+
+private:
+    Message &operator=(const Message &);
+};
+
+class Options : public libecap::Options
+{
+public:
+    virtual const libecap::Area option(const libecap::Name &name) const;
+    virtual void visitEachOption(libecap::NamedValueVisitor &visitor) const;
+
+    void set(const std::string &name, const std::string &value);
+
+protected:
+    std::map<std::string, std::string> values;
+};
+
+class Host : public libecap::host::Host
+{
+public:
+    virtual std::string uri() const { return "ecap://clearfoundation.com/mock-host"; };
+    virtual void describe(std::ostream &os) const { os << "mock host"; };
+    virtual void noteVersionedService(const char *libEcapVersion,
+        const libecap::weak_ptr<libecap::adapter::Service> &s);
+    virtual std::ostream *openDebug(libecap::LogVerbosity) { return NULL; };
+    virtual void closeDebug(std::ostream *) { };
+    virtual libecap::shared_ptr<libecap::Message> newRequest() const;
+    virtual libecap::shared_ptr<libecap::Message> newResponse() const;
+
+    // the first one registered, or the one with uri; NULL if none
+    libecap::shared_ptr<libecap::adapter::Service> service(void) const;
+    libecap::shared_ptr<libecap::adapter::Service> service(const std::string &uri) const;
+
+protected:
+    std::vector<libecap::weak_ptr<libecap::adapter::Service> > adapter_services;
+};
+
+typedef std::vector<libecap::Area> Chunks;
+
+// One host transaction: feeds the virgin message and body chunks to an
+// adapter transaction and consumes whatever it produces, the way the
+// host would, but synchronously
+class Xaction : public libecap::host::Xaction
+{
+public:
+    Xaction(libecap::adapter::Service &service);
+
+    // runs a complete transaction; cause may be NULL for requests
+    void run(libecap::shared_ptr<Message> virgin,
+        libecap::shared_ptr<Message> cause, const Chunks &chunks);
+
+    // meta-information for the adapter
+    virtual const libecap::Area option(const libecap::Name &name) const;
+    virtual void visitEachOption(libecap::NamedValueVisitor &visitor) const;
+    void setOption(const std::string &name, const std::string &value);
+
+    // libecap::host::Xaction API
+    virtual libecap::Message &virgin();
+    virtual const libecap::Message &cause();
+    virtual libecap::Message &adapted();
+    virtual void useVirgin();
+    virtual void useAdapted(const libecap::shared_ptr<libecap::Message> &msg);
+    virtual void blockVirgin();
+    virtual void adaptationDelayed(const libecap::Delay &);
+    virtual void adaptationAborted();
+    virtual void resume();
+    virtual void vbDiscard();
+    virtual void vbMake();
+    virtual void vbStopMaking();
+    virtual void vbMakeMore();
+    virtual libecap::Area vbContent(size_type offset, size_type size);
+    virtual void vbContentShift(size_type size);
+    virtual void noteAbContentDone(bool atEnd);
+    virtual void noteAbContentAvailable();
+
+    // results of the last run()
+    bool used_virgin;
+    bool aborted;
+    libecap::shared_ptr<libecap::Message> adapted_message;
+    size_type ab_bytes; // adapted body bytes received
+    size_type ab_copied; // of those, bytes not served from virgin chunks
+
+    // an asynchronous adapter has delayed, and then resumed, its transaction
+    bool delayed;
+    bool resumed;
+
+protected:
+    void drainAb(void);
+    bool fromVirgin(const libecap::Area &area) const;
+
+    libecap::adapter::Service &service;
+    libecap::shared_ptr<libecap::adapter::Xaction> adapter;
+
+    libecap::shared_ptr<Message> virgin_message;
+    libecap::shared_ptr<Message> cause_message;
+    Mock::Options meta;
+
+    const Chunks *virgin_chunks;
+    std::deque<libecap::Area> vb; // delivered, not yet shifted
+    size_type vb_offset; // shifted bytes of vb.front()
+    bool making_vb;
+    bool making_ab;
+    bool ab_available;
+    bool ab_done;
+    bool resume_pending; // resume() called, adapter not yet resumed
+};
+
+} // namespace Mock
+
+#endif // _MOCK_HOST_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,138 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <vector>
+#include <atomic>
+#include <string>
+#include <new>
+
+#include <syslog.h>
+#include <stdlib.h>
+
+#include "adapter-log.h"
+#include "pool.h"
+
+// Size classes are multiples of POOL_GRANULE bytes, up to POOL_CLASSES of them
+#define POOL_GRANULE            64
+#define POOL_CLASSES            32
+
+std::atomic<size_t> Adapter::Pool::limit(DEFAULT_POOL_LIMIT);
+
+namespace
+{
+
+struct FreeBlock
+{
+    FreeBlock *next;
+};
+
+// plain data, so that it can live in thread-local storage
+struct FreeList
+{
+    FreeBlock *head;
+    unsigned long free;
+    unsigned long in_use;
+    unsigned long high_water;
+    unsigned long allocations;
+    unsigned long misses;
+};
+
+__thread FreeList lists[POOL_CLASSES];
+
+inline size_t SizeClass(size_t size)
+{
+    return (size) ? (size - 1) / POOL_GRANULE : 0;
+}
+
+} // namespace
+
+void *Adapter::Pool::Allocate(size_t size)
+{
+    const size_t c = SizeClass(size);
+    if (c >= POOL_CLASSES) {
+        void *block = malloc(size);
+        if (!block) throw std::bad_alloc();
+        return block;
+    }
+
+    FreeList &list = lists[c];
+    list.allocations++;
+    if (++list.in_use > list.high_water) list.high_water = list.in_use;
+
+    if (FreeBlock *block = list.head) {
+        list.head = block->next;
+        list.free--;
+        return block;
+    }
+
+    list.misses++;
+    void *block = malloc((c + 1) * POOL_GRANULE);
+    if (!block) {
+        list.in_use--;
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void Adapter::Pool::Release(void *block, size_t size)
+{
+    if (!block) return;
+
+    const size_t c = SizeClass(size);
+    if (c >= POOL_CLASSES) {
+        free(block);
+        return;
+    }
+
+    FreeList &list = lists[c];
+    if (list.in_use) list.in_use--;
+
+    if (list.free >= limit.load(std::memory_order_relaxed)) {
+        free(block);
+        return;
+    }
+
+    FreeBlock *head = static_cast<FreeBlock *>(block);
+    head->next = list.head;
+    list.head = head;
+    list.free++;
+}
+
+void Adapter::Pool::SetLimit(size_t blocks)
+{
+    limit.store(blocks, std::memory_order_relaxed);
+}
+
+void Adapter::Pool::GetStats(std::vector<Stats> &stats)
+{
+    stats.clear();
+    for (size_t c = 0; c < POOL_CLASSES; c++) {
+        const FreeList &list = lists[c];
+        if (!list.allocations) continue;
+
+        Stats entry;
+        entry.size = (c + 1) * POOL_GRANULE;
+        entry.in_use = list.in_use;
+        entry.free = list.free;
+        entry.high_water = list.high_water;
+        entry.allocations = list.allocations;
+        entry.misses = list.misses;
+        stats.push_back(entry);
+    }
+}
+
+void Adapter::Pool::LogStats(int priority)
+{
+    if (!Log::Enabled(priority)) return;
+
+    std::vector<Stats> stats;
+    GetStats(stats);
+    for (std::vector<Stats>::const_iterator i = stats.begin(); i != stats.end(); i++) {
+        Log::Write(priority, "pool: %lu bytes: in use: %lu, free: %lu, high water: %lu, "
+            "allocations: %lu, misses: %lu", (unsigned long)i->size, i->in_use,
+            i->free, i->high_water, i->allocations, i->misses);
+    }
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
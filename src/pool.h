@@ -0,0 +1,79 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+// Default number of free blocks kept per size class
+#define DEFAULT_POOL_LIMIT      256
+
+namespace Adapter
+{
+
+// Free lists of fixed size classes for per-transaction objects.  Every
+// thread has its own lists, so no locking is needed; a block released
+// by another thread simply joins that thread's list.  Blocks larger
+// than the biggest class go straight to malloc().
+class Pool
+{
+public:
+    static void *Allocate(size_t size);
+    static void Release(void *block, size_t size);
+
+    // free blocks kept per class; the rest go back to the system
+    static void SetLimit(size_t blocks);
+
+    class Stats
+    {
+    public:
+        size_t size; // block size of the class
+        unsigned long in_use; // blocks handed out
+        unsigned long free; // blocks waiting for reuse
+        unsigned long high_water; // most blocks ever in use
+        unsigned long allocations; // blocks handed out, ever
+        unsigned long misses; // allocations that had to call malloc()
+    };
+
+    // non-empty classes of the calling thread
+    static void GetStats(std::vector<Stats> &stats);
+    static void LogStats(int priority);
+
+protected:
+    static std::atomic<size_t> limit;
+};
+
+// STL allocator over Pool, for containers living in transactions
+template <class T>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <class U> struct rebind { typedef PoolAllocator<U> other; };
+
+    PoolAllocator() { };
+    template <class U> PoolAllocator(const PoolAllocator<U> &) { };
+
+    inline pointer allocate(size_type n, const void * = 0)
+        { return static_cast<pointer>(Pool::Allocate(n * sizeof(T))); };
+    inline void deallocate(pointer p, size_type n)
+        { Pool::Release(p, n * sizeof(T)); };
+
+    inline pointer address(reference r) const { return &r; };
+    inline const_pointer address(const_reference r) const { return &r; };
+    inline size_type max_size(void) const { return size_type(-1) / sizeof(T); };
+    inline void construct(pointer p, const T &value) { new(p) T(value); };
+    inline void destroy(pointer p) { p->~T(); };
+
+    template <class U> inline bool operator==(const PoolAllocator<U> &) const { return true; };
+    template <class U> inline bool operator!=(const PoolAllocator<U> &) const { return false; };
+};
+
+} // namespace Adapter
+
+#endif // _POOL_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
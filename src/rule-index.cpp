@@ -0,0 +1,733 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <map>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <atomic>
+#include <algorithm>
+#include <new>
+
+#include <libecap/common/area.h>
+#include <libecap/common/name.h>
+#include <libecap/common/header.h>
+#include <libecap/common/memory.h>
+
+#include <syslog.h>
+#include <expat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "expat-xml.h"
+#include "adapter-log.h"
+#include "pool.h"
+#include "ascii-case.h"
+#include "url-matcher.h"
+#include "client-matcher.h"
+#include "html-scanner.h"
+#include "header-template.h"
+#include "adapter-config.h"
+#include "rule-index.h"
+
+// Longest host name we look up, per RFC 1035
+#define MAX_HOST_LENGTH         255
+
+namespace
+{
+
+typedef unsigned __int128 Address;
+
+Address ToAddress(const unsigned char *bytes)
+{
+    Address address = 0;
+    for (int i = 0; i < 16; i++) address = (address << 8) | bytes[i];
+    return address;
+}
+
+void FromAddress(Address address, unsigned char *bytes)
+{
+    for (int i = 15; i >= 0; i--, address >>= 8) bytes[i] = address & 0xff;
+}
+
+// A CIDR block of a client scoped rule, as an inclusive address range
+class Block
+{
+public:
+    Address first;
+    Address last;
+    unsigned length;
+    unsigned rule;
+};
+
+// outer blocks before the blocks nested in them
+bool BlockLess(const Block &a, const Block &b)
+{
+    if (a.first != b.first) return a.first < b.first;
+    if (a.length != b.length) return a.length < b.length;
+    return a.rule < b.rule;
+}
+
+int KeyCompare(const char *a, size_t a_length, const char *b, size_t b_length)
+{
+    const int order = memcmp(a, b, std::min(a_length, b_length));
+    if (order) return order;
+    return (a_length < b_length) ? -1 : (a_length > b_length);
+}
+
+std::string Lowercase(const std::string &text)
+{
+    std::string result(text);
+    Adapter::AsciiCase::Lower(&result[0], result.data(), result.size());
+    return result;
+}
+
+// host and domain keys are lowercase, without the trailing dot
+std::string HostKey(const std::string &name)
+{
+    std::string key = Lowercase(name);
+    while (key.size() && key[key.size() - 1] == '.')
+        key.erase(key.size() - 1);
+    return key;
+}
+
+// Accumulates the index image in memory before it is written out
+class IndexBuilder
+{
+public:
+    IndexBuilder() : image(sizeof(Adapter::IndexHeader)) { };
+
+    // appends a section of entries, aligned for any of them
+    template <class T> void section(Adapter::RuleIndex::Section s, const std::vector<T> &entries)
+    {
+        image.resize((image.size() + 7) & ~7);
+        sections[s].offset = image.size();
+        sections[s].count = entries.size();
+        if (!entries.size()) return;
+
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&entries[0]);
+        image.insert(image.end(), bytes, bytes + entries.size() * sizeof(T));
+    }
+
+    // strings are stored once, however many rules share them
+    Adapter::IndexString string(const std::string &text)
+    {
+        std::map<std::string, Adapter::IndexString>::const_iterator i = string_index.find(text);
+        if (i != string_index.end()) return i->second;
+
+        Adapter::IndexString entry;
+        entry.offset = strings.size();
+        entry.length = text.size();
+        strings.insert(strings.end(), text.begin(), text.end());
+        string_index[text] = entry;
+        return entry;
+    }
+
+    std::vector<unsigned char> image;
+    std::vector<char> strings;
+    Adapter::IndexSection sections[Adapter::RuleIndex::sectionMax];
+
+protected:
+    std::map<std::string, Adapter::IndexString> string_index;
+};
+
+// the rules of each key become one range of the reference section
+void AddKeys(IndexBuilder &builder, const std::map<std::string, std::vector<uint32_t> > &keys,
+    std::vector<Adapter::IndexKey> &table, std::vector<uint32_t> &refs)
+{
+    for (std::map<std::string, std::vector<uint32_t> >::const_iterator i = keys.begin(); i != keys.end(); i++) {
+        Adapter::IndexKey key;
+        key.key = builder.string(i->first);
+        key.rules.offset = refs.size();
+        key.rules.count = i->second.size();
+        refs.insert(refs.end(), i->second.begin(), i->second.end());
+        table.push_back(key);
+    }
+}
+
+// flattens nested CIDR blocks into disjoint intervals, each listing every
+// block that covers it; blocks never partially overlap, so a stack of the
+// blocks around the current address is all the sweep needs
+void AddIntervals(std::vector<Block> &blocks,
+    std::vector<Adapter::IndexInterval> &intervals, std::vector<Adapter::IndexHit> &hits)
+{
+    std::sort(blocks.begin(), blocks.end(), BlockLess);
+
+    std::vector<const Block *> open;
+    size_t b = 0;
+    while (b < blocks.size() || open.size()) {
+        Address start;
+        if (b < blocks.size() && (!open.size() || blocks[b].first <= open.back()->last)) {
+            start = blocks[b].first;
+            while (b < blocks.size() && blocks[b].first == start)
+                open.push_back(&blocks[b++]);
+        } else {
+            const Address last = open.back()->last;
+            while (open.size() && open.back()->last == last)
+                open.pop_back();
+            if (last == ~Address(0)) continue;
+            start = last + 1;
+        }
+
+        Adapter::IndexInterval interval;
+        FromAddress(start, interval.start);
+        interval.hits.offset = hits.size();
+        interval.hits.count = open.size();
+        for (std::vector<const Block *>::const_iterator i = open.begin(); i != open.end(); i++) {
+            Adapter::IndexHit hit;
+            hit.rule = (*i)->rule;
+            hit.length = (*i)->length;
+            hits.push_back(hit);
+        }
+
+        // a block closing where another opens leaves an empty interval
+        if (intervals.size() && !memcmp(intervals.back().start, interval.start, 16))
+            intervals.back() = interval;
+        else
+            intervals.push_back(interval);
+    }
+}
+
+void DigestBytes(uint64_t &hash, const char *bytes, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 1099511628211ULL;
+    }
+}
+
+} // namespace
+
+Adapter::RuleIndex::RuleIndex()
+    : data(NULL), data_size(0), header(NULL),
+    rule_table(NULL), rule_count(0), strings(NULL), client_only(false), hosted(false), path_length(0) { }
+
+Adapter::RuleIndex::~RuleIndex()
+{
+    if (data) munmap(const_cast<unsigned char *>(data), data_size);
+}
+
+// a Fletcher-style sum over 32-bit words; the size is a multiple of 4
+uint64_t Adapter::RuleIndex::Checksum(const unsigned char *data, size_t size)
+{
+    uint64_t a = 1, b = 0;
+    for (size_t i = 0; i + 4 <= size; ) {
+        // the sums cannot overflow within a block
+        const size_t end = std::min(size, i + 4 * 65536) & ~size_t(3);
+        for ( ; i < end; i += 4) {
+            uint32_t word;
+            memcpy(&word, data + i, 4);
+            a += word;
+            b += a;
+        }
+        a %= 0xffffffffUL;
+        b %= 0xffffffffUL;
+    }
+    return (b << 32) | a;
+}
+
+Adapter::RuleIndexPointer Adapter::RuleIndex::Map(const std::string &filename)
+{
+    const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Open error: " + filename + ": " + strerror(errno));
+
+    return Map(fd, filename);
+}
+
+Adapter::RuleIndexPointer Adapter::RuleIndex::Map(int fd, const std::string &label)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        throw std::runtime_error("Invalid rule index: " + label);
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw std::runtime_error("Map error: " + label + ": " + strerror(errno));
+
+    RuleIndex *index = new RuleIndex;
+    RuleIndexPointer pointer(index);
+    index->data = static_cast<const unsigned char *>(map);
+    index->data_size = st.st_size;
+    index->header = reinterpret_cast<const IndexHeader *>(index->data);
+
+    try {
+        index->validate();
+    } catch (std::runtime_error &e) {
+        throw std::runtime_error(std::string(e.what()) + ": " + label);
+    }
+
+    ADAPTER_LOG(LOG_DEBUG, "%s: %s: %lu rules, %lu bytes", __PRETTY_FUNCTION__,
+        label.c_str(), (unsigned long)index->rule_count, (unsigned long)index->data_size);
+
+    return pointer;
+}
+
+// nothing in the file is trusted: after the checksum, every offset and
+// rule number is checked once here, so lookups need not check them
+void Adapter::RuleIndex::validate(void)
+{
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)))
+        throw std::runtime_error("Not a rule index");
+    if (header->version != INDEX_VERSION)
+        throw std::runtime_error("Unsupported rule index version");
+    if (header->header_size != sizeof(IndexHeader) || header->size != data_size
+        || data_size % 4)
+        throw std::runtime_error("Truncated rule index");
+    if (Checksum(data + sizeof(IndexHeader), data_size - sizeof(IndexHeader)) != header->checksum)
+        throw std::runtime_error("Rule index checksum mismatch");
+
+    const size_t entry_sizes[sectionMax] = {
+        sizeof(IndexString), sizeof(IndexRule), sizeof(IndexString),
+        sizeof(IndexKey), sizeof(IndexKey), sizeof(IndexKey),
+        sizeof(IndexInterval), sizeof(IndexHit),
+        sizeof(uint32_t), sizeof(uint32_t), 1
+    };
+    for (int s = 0; s < sectionMax; s++) {
+        const IndexSection &range = section(Section(s));
+        if (range.offset < sizeof(IndexHeader) || range.offset % 4 || range.offset > data_size
+            || range.count > (data_size - range.offset) / entry_sizes[s])
+            throw std::runtime_error("Invalid rule index section");
+    }
+
+    rule_table = table<IndexRule>(sectionRules);
+    rule_count = section(sectionRules).count;
+    strings = table<char>(sectionStrings);
+
+    const size_t string_size = section(sectionStrings).count;
+    const size_t name_count = section(sectionNames).count;
+    const size_t path_count = section(sectionPaths).count;
+    const size_t ref_count = section(sectionRefs).count;
+    const size_t hit_count = section(sectionHits).count;
+
+    #define CHECK_RANGE(range, limit) \
+        ((range).offset <= (limit) && (range).count <= (limit) - (range).offset)
+    #define CHECK_STRING(string) \
+        ((string).offset <= string_size && (string).length <= string_size - (string).offset)
+
+    const IndexString *names = table<IndexString>(sectionNames);
+    for (size_t i = 0; i < name_count; i++) {
+        if (!CHECK_STRING(names[i]) || !names[i].length)
+            throw std::runtime_error("Invalid rule index name");
+        name_list.push_back(libecap::Name(std::string(strings + names[i].offset,
+            names[i].length), libecap::Name::NextId()));
+    }
+
+    const IndexString *paths = table<IndexString>(sectionPaths);
+    for (size_t i = 0; i < path_count; i++) {
+        if (!CHECK_STRING(paths[i]))
+            throw std::runtime_error("Invalid rule index path");
+        path_length = std::max<size_t>(path_length, paths[i].length);
+    }
+
+    for (size_t i = 0; i < rule_count; i++) {
+        const IndexRule &rule = rule_table[i];
+        if (rule.name >= name_count || rule.action > headerAddIfAbsent
+            || !CHECK_STRING(rule.value) || !CHECK_RANGE(rule.paths, path_count))
+            throw std::runtime_error("Invalid rule index rule");
+        if (!(rule.flags & flagHosted) && (rule.flags & (flagClients | flagUsers)))
+            client_only = true;
+        if (rule.flags & flagHosted)
+            hosted = true;
+    }
+
+    const Section keyed[] = { sectionHosts, sectionDomains, sectionUsers };
+    for (size_t k = 0; k < sizeof(keyed) / sizeof(keyed[0]); k++) {
+        const IndexKey *keys = table<IndexKey>(keyed[k]);
+        for (size_t i = 0; i < section(keyed[k]).count; i++) {
+            if (!CHECK_STRING(keys[i].key) || !CHECK_RANGE(keys[i].rules, ref_count))
+                throw std::runtime_error("Invalid rule index key");
+        }
+    }
+
+    const IndexInterval *intervals = table<IndexInterval>(sectionIntervals);
+    for (size_t i = 0; i < section(sectionIntervals).count; i++) {
+        if (!CHECK_RANGE(intervals[i].hits, hit_count))
+            throw std::runtime_error("Invalid rule index interval");
+    }
+
+    const IndexHit *hits = table<IndexHit>(sectionHits);
+    for (size_t i = 0; i < hit_count; i++) {
+        if (hits[i].rule >= rule_count || hits[i].length > 128)
+            throw std::runtime_error("Invalid rule index hit");
+    }
+
+    const Section numbered[] = { sectionRefs, sectionAny };
+    for (size_t n = 0; n < sizeof(numbered) / sizeof(numbered[0]); n++) {
+        const uint32_t *rules = table<uint32_t>(numbered[n]);
+        for (size_t i = 0; i < section(numbered[n]).count; i++) {
+            if (rules[i] >= rule_count)
+                throw std::runtime_error("Invalid rule index reference");
+        }
+    }
+
+    #undef CHECK_RANGE
+    #undef CHECK_STRING
+}
+
+// rules come out in the order given, so that rule n of the index is
+// rule n of the list; values must not have placeholders
+void Adapter::RuleIndex::Build(const HeaderRuleList &rules, std::vector<unsigned char> &image)
+{
+    IndexBuilder builder;
+
+    std::map<std::string, uint32_t> name_index; // lowercase
+    std::vector<IndexString> names;
+    std::vector<IndexRule> rule_table;
+    std::vector<IndexString> paths;
+    std::map<std::string, std::vector<uint32_t> > hosts, domains, users;
+    std::vector<Block> blocks;
+    std::vector<uint32_t> any;
+
+    for (size_t r = 0; r < rules.size(); r++) {
+        const HeaderRule &rule = rules[r];
+        if (HeaderTemplate(rule.value).dynamic())
+            throw std::runtime_error("Placeholders are not supported in a rule index: " + rule.name);
+
+        IndexRule entry;
+        const std::string name = Lowercase(rule.name);
+        std::map<std::string, uint32_t>::const_iterator n = name_index.find(name);
+        if (n == name_index.end()) {
+            n = name_index.insert(std::make_pair(name, (uint32_t)names.size())).first;
+            names.push_back(builder.string(rule.name));
+        }
+        entry.name = n->second;
+        entry.action = rule.action;
+        entry.flags = 0;
+        if (rule.hosts.size() || rule.domains.size()) entry.flags |= flagHosted;
+        if (rule.clients.size()) entry.flags |= flagClients;
+        if (rule.users.size()) entry.flags |= flagUsers;
+        if (rule.direction == directionResponse) entry.flags |= flagResponse;
+        entry.value = builder.string(rule.value);
+        entry.paths.offset = paths.size();
+        entry.paths.count = rule.paths.size();
+        for (std::vector<std::string>::const_iterator i = rule.paths.begin(); i != rule.paths.end(); i++)
+            paths.push_back(builder.string(*i));
+        rule_table.push_back(entry);
+
+        for (std::vector<std::string>::const_iterator i = rule.hosts.begin(); i != rule.hosts.end(); i++) {
+            const std::string key = HostKey(*i);
+            if (key.size()) hosts[key].push_back(r);
+        }
+        for (std::vector<std::string>::const_iterator i = rule.domains.begin(); i != rule.domains.end(); i++) {
+            const std::string key = HostKey(*i);
+            if (key.size()) domains[key].push_back(r);
+        }
+        for (std::vector<std::string>::const_iterator i = rule.users.begin(); i != rule.users.end(); i++) {
+            const std::string key = Lowercase(*i);
+            if (!key.size() || key.size() > MAX_USER_LENGTH)
+                throw std::runtime_error("Invalid user name: " + *i);
+            users[key].push_back(r);
+        }
+        for (std::vector<std::string>::const_iterator i = rule.clients.begin(); i != rule.clients.end(); i++) {
+            unsigned char address[16];
+            unsigned length;
+            if (!ClientMatcher::ParseCidr(*i, address, length))
+                throw std::runtime_error("Invalid client address: " + *i);
+
+            Block block;
+            block.length = length;
+            block.rule = r;
+            const Address mask = (length) ? ~Address(0) << (128 - length) : Address(0);
+            block.first = ToAddress(address) & mask;
+            block.last = block.first | ~mask;
+            blocks.push_back(block);
+        }
+
+        if (!(entry.flags & flagScoped)) any.push_back(r);
+    }
+
+    // a rule listing a key twice is found once
+    std::map<std::string, std::vector<uint32_t> > *keyed[] = { &hosts, &domains, &users };
+    for (size_t k = 0; k < sizeof(keyed) / sizeof(keyed[0]); k++) {
+        for (std::map<std::string, std::vector<uint32_t> >::iterator i = keyed[k]->begin(); i != keyed[k]->end(); i++)
+            i->second.erase(std::unique(i->second.begin(), i->second.end()), i->second.end());
+    }
+
+    std::vector<IndexKey> host_table, domain_table, user_table;
+    std::vector<uint32_t> refs;
+    AddKeys(builder, hosts, host_table, refs);
+    AddKeys(builder, domains, domain_table, refs);
+    AddKeys(builder, users, user_table, refs);
+
+    std::vector<IndexInterval> intervals;
+    std::vector<IndexHit> hits;
+    AddIntervals(blocks, intervals, hits);
+
+    builder.section(sectionNames, names);
+    builder.section(sectionRules, rule_table);
+    builder.section(sectionPaths, paths);
+    builder.section(sectionHosts, host_table);
+    builder.section(sectionDomains, domain_table);
+    builder.section(sectionUsers, user_table);
+    builder.section(sectionIntervals, intervals);
+    builder.section(sectionHits, hits);
+    builder.section(sectionRefs, refs);
+    builder.section(sectionAny, any);
+    builder.section(sectionStrings, builder.strings);
+    builder.image.resize((builder.image.size() + 3) & ~3);
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.header_size = sizeof(IndexHeader);
+    header.size = builder.image.size();
+    memcpy(header.sections, builder.sections, sizeof(builder.sections));
+    header.checksum = Checksum(&builder.image[sizeof(IndexHeader)],
+        builder.image.size() - sizeof(IndexHeader));
+    memcpy(&builder.image[0], &header, sizeof(header));
+
+    image.swap(builder.image);
+}
+
+// FNV-1a over every field; strings end with a NUL, lists with a byte
+// that XML cannot carry
+uint64_t Adapter::RuleIndex::Digest(const HeaderRuleList &rules)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (HeaderRuleList::const_iterator r = rules.begin(); r != rules.end(); r++) {
+        const uint32_t action = r->action;
+        const uint32_t direction = r->direction;
+        DigestBytes(hash, r->name.c_str(), r->name.size() + 1);
+        DigestBytes(hash, r->value.c_str(), r->value.size() + 1);
+        DigestBytes(hash, (const char *)&action, sizeof(action));
+        DigestBytes(hash, (const char *)&direction, sizeof(direction));
+
+        const std::vector<std::string> *lists[] = {
+            &r->hosts, &r->domains, &r->paths, &r->clients, &r->users
+        };
+        for (size_t l = 0; l < sizeof(lists) / sizeof(lists[0]); l++) {
+            for (size_t i = 0; i < lists[l]->size(); i++)
+                DigestBytes(hash, (*lists[l])[i].c_str(), (*lists[l])[i].size() + 1);
+            DigestBytes(hash, "\x01", 1);
+        }
+    }
+
+    return hash;
+}
+
+void Adapter::RuleIndex::Write(const HeaderRuleList &rules, const std::string &filename)
+{
+    std::vector<unsigned char> image;
+    Build(rules, image);
+
+    // workers mapping the old file keep it until they let go
+    const std::string temporary = filename + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "w");
+    if (!file) throw std::runtime_error("Open error: " + temporary + ": " + strerror(errno));
+
+    const bool written = fwrite(&image[0], image.size(), 1, file) == 1;
+    if (fclose(file) != 0 || !written) {
+        unlink(temporary.c_str());
+        throw std::runtime_error("Write error: " + temporary);
+    }
+    if (rename(temporary.c_str(), filename.c_str()) < 0) {
+        unlink(temporary.c_str());
+        throw std::runtime_error("Rename error: " + filename + ": " + strerror(errno));
+    }
+}
+
+const Adapter::IndexKey *Adapter::RuleIndex::findKey(Section s, const char *key, size_t length) const
+{
+    const IndexKey *keys = table<IndexKey>(s);
+    size_t low = 0, high = section(s).count;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        const int order = KeyCompare(strings + keys[middle].key.offset,
+            keys[middle].key.length, key, length);
+        if (!order) return &keys[middle];
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+    return NULL;
+}
+
+// the last interval starting at or before the address
+const Adapter::IndexInterval *Adapter::RuleIndex::findInterval(const unsigned char *address) const
+{
+    const IndexInterval *intervals = table<IndexInterval>(sectionIntervals);
+    size_t low = 0, high = section(sectionIntervals).count;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (memcmp(intervals[middle].start, address, 16) <= 0) low = middle + 1;
+        else high = middle;
+    }
+    return (low) ? &intervals[low - 1] : NULL;
+}
+
+bool Adapter::RuleIndex::pathMatches(const IndexRule &rule, const char *path, size_t length) const
+{
+    if (!rule.paths.count) return true;
+
+    const IndexString *prefixes = table<IndexString>(sectionPaths) + rule.paths.offset;
+    for (size_t i = 0; i < rule.paths.count; i++) {
+        if (prefixes[i].length <= length
+            && !memcmp(strings + prefixes[i].offset, path, prefixes[i].length))
+            return true;
+    }
+    return false;
+}
+
+void Adapter::RuleIndex::addRules(const IndexSection &refs,
+    const char *path, size_t path_length, RuleMatches &rules) const
+{
+    const uint32_t *numbers = table<uint32_t>(sectionRefs) + refs.offset;
+    for (size_t i = 0; i < refs.count; i++) {
+        if (pathMatches(rule_table[numbers[i]], path, path_length))
+            rules.push_back(numbers[i]);
+    }
+}
+
+// the unsorted, possibly repeated, rules of the URL scopes
+void Adapter::RuleIndex::select(const char *host, size_t host_length,
+    const char *path, size_t path_length, RuleMatches &rules) const
+{
+    const uint32_t *any = table<uint32_t>(sectionAny);
+    for (size_t i = 0; i < section(sectionAny).count; i++) {
+        if (pathMatches(rule_table[any[i]], path, path_length))
+            rules.push_back(any[i]);
+    }
+
+    while (host_length && host[host_length - 1] == '.') host_length--;
+    if (!host_length || host_length > MAX_HOST_LENGTH) return;
+
+    char name[MAX_HOST_LENGTH];
+    AsciiCase::Lower(name, host, host_length);
+
+    const IndexKey *key = findKey(sectionHosts, name, host_length);
+    if (key) addRules(key->rules, path, path_length, rules);
+
+    // the host itself, then each parent domain
+    if (!section(sectionDomains).count) return;
+    for (size_t start = 0; start < host_length; ) {
+        key = findKey(sectionDomains, name + start, host_length - start);
+        if (key) addRules(key->rules, path, path_length, rules);
+
+        const char *dot = (const char *)memchr(name + start, '.', host_length - start);
+        if (!dot) break;
+        start = dot - name + 1;
+    }
+}
+
+// the same steps as UrlMatcher and ClientMatcher take for the XML rules:
+// URL scopes select, client scopes add their own rules and filter, and
+// among the address scoped rules for one header the longest prefix wins
+void Adapter::RuleIndex::match(const char *host, size_t host_length,
+    const char *path, size_t path_length,
+    const libecap::Area &client, const libecap::Area &user,
+    unsigned base, RuleMatches &matches) const
+{
+    RuleMatches rules;
+    select(host, host_length, path, path_length, rules);
+
+    const IndexHit *hits = NULL;
+    size_t hit_count = 0;
+    if (hasClients() && client.size && client.size < INET6_ADDRSTRLEN) {
+        char text[INET6_ADDRSTRLEN];
+        memcpy(text, client.start, client.size);
+        text[client.size] = '\0';
+
+        unsigned char address[16];
+        unsigned length;
+        const IndexInterval *interval = NULL;
+        if (ClientMatcher::ParseCidr(text, address, length) && length == 128)
+            interval = findInterval(address);
+        if (interval) {
+            hits = table<IndexHit>(sectionHits) + interval->hits.offset;
+            hit_count = interval->hits.count;
+        }
+    }
+
+    const IndexKey *entry = NULL;
+    if (hasUsers() && user.size && user.size <= MAX_USER_LENGTH) {
+        char name[MAX_USER_LENGTH];
+        AsciiCase::Lower(name, user.start, user.size);
+        entry = findKey(sectionUsers, name, user.size);
+    }
+    const uint32_t *user_rules = (entry) ? table<uint32_t>(sectionRefs) + entry->rules.offset : NULL;
+    const uint32_t *user_end = (entry) ? user_rules + entry->rules.count : NULL;
+
+    for (size_t h = 0; h < hit_count; h++) {
+        const IndexRule &rule = rule_table[hits[h].rule];
+        if (!(rule.flags & flagHosted) && pathMatches(rule, path, path_length))
+            rules.push_back(hits[h].rule);
+    }
+    for (const uint32_t *i = user_rules; i != user_end; i++) {
+        const IndexRule &rule = rule_table[*i];
+        if (!(rule.flags & flagHosted) && pathMatches(rule, path, path_length))
+            rules.push_back(*i);
+    }
+
+    std::sort(rules.begin(), rules.end());
+    rules.erase(std::unique(rules.begin(), rules.end()), rules.end());
+
+    // per rule kept: the longest prefix, or 0 if not address scoped
+    RuleMatches lengths;
+    size_t scoped = 0;
+    size_t kept = 0;
+    for (size_t r = 0; r < rules.size(); r++) {
+        const IndexRule &rule = rule_table[rules[r]];
+        if ((rule.flags & flagUsers) && !std::binary_search(user_rules, user_end, rules[r]))
+            continue;
+
+        unsigned best = 0;
+        if (rule.flags & flagClients) {
+            bool found = false;
+            for (size_t h = 0; h < hit_count; h++) {
+                if (hits[h].rule != rules[r]) continue;
+                best = std::max(best, (unsigned)hits[h].length);
+                found = true;
+            }
+            if (!found) continue;
+            scoped++;
+        }
+        rules[kept++] = rules[r];
+        lengths.push_back(best);
+    }
+    rules.resize(kept);
+
+    for (size_t r = 0; r < rules.size(); r++) {
+        const IndexRule &rule = rule_table[rules[r]];
+        bool shadowed = false;
+        if (scoped > 1 && (rule.flags & flagClients)) {
+            for (size_t o = 0; o < rules.size() && !shadowed; o++) {
+                const IndexRule &other = rule_table[rules[o]];
+                shadowed = (other.flags & flagClients) && other.name == rule.name
+                    && (other.flags & flagResponse) == (rule.flags & flagResponse)
+                    && lengths[o] > lengths[r];
+            }
+        }
+        if (!shadowed) matches.push_back(base + rules[r]);
+    }
+}
+
+// the client is not known yet, so client scoped rules always might match
+bool Adapter::RuleIndex::matchesAny(const char *url) const
+{
+    if (client_only) return true;
+
+    const char *host, *path;
+    size_t host_length, path_length;
+    UrlMatcher::SplitUrl(url, strlen(url), host, host_length, path, path_length);
+    if (hosted && !host_length) return true; // see UrlMatcher::matchesAny()
+
+    RuleMatches rules;
+    select(host, host_length, path, path_length, rules);
+    return rules.size() > 0;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
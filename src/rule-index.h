@@ -0,0 +1,177 @@
+#ifndef _RULE_INDEX_H
+#define _RULE_INDEX_H
+
+// Binary rule index file identification
+#define INDEX_MAGIC             "CECAPIX"
+#define INDEX_VERSION           2
+
+namespace Adapter
+{
+
+// On-disk layout.  Integers are in host byte order (the index is built
+// on the machine that uses it), sections start 4-byte aligned and the
+// file size is a multiple of 4.  Offsets are from the start of the file
+// except for strings, which are relative to the string section.
+class IndexSection
+{
+public:
+    uint32_t offset;
+    uint32_t count; // entries
+};
+
+class IndexString
+{
+public:
+    uint32_t offset;
+    uint32_t length;
+};
+
+class IndexRule
+{
+public:
+    uint32_t name; // into the name section
+    uint32_t action; // HeaderAction
+    uint32_t flags; // RuleIndex::Flag
+    IndexString value;
+    IndexSection paths; // range of the path section
+};
+
+// A host, domain or user name and the rules scoped to it
+class IndexKey
+{
+public:
+    IndexString key; // lowercase
+    IndexSection rules; // range of the rule reference section
+};
+
+// Addresses from start up to the next interval's start are covered by
+// exactly the CIDR blocks listed in hits
+class IndexInterval
+{
+public:
+    unsigned char start[16]; // IPv6, or IPv4-mapped, network byte order
+    IndexSection hits; // range of the hit section
+};
+
+class IndexHit
+{
+public:
+    uint32_t rule;
+    uint32_t length; // prefix length of the block, for IPv6
+};
+
+class IndexHeader
+{
+public:
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t size; // of the whole file
+    uint64_t checksum; // of everything after the header
+    IndexSection sections[16];
+};
+
+// Header rules compiled offline (see clearos-ecap-compile) into a file
+// that is mapped read-only, so that every Squid worker shares one copy
+// in the page cache and loading costs one pass over the checksum.
+// Lookups work on the mapped tables: binary searches over sorted host,
+// domain and user keys, and over flattened CIDR intervals.
+class RuleIndex
+{
+public:
+    typedef enum
+    {
+        sectionNames, // IndexString, distinct header names
+        sectionRules, // IndexRule
+        sectionPaths, // IndexString
+        sectionHosts, // IndexKey, sorted
+        sectionDomains, // IndexKey, sorted
+        sectionUsers, // IndexKey, sorted
+        sectionIntervals, // IndexInterval, sorted
+        sectionHits, // IndexHit
+        sectionRefs, // uint32_t rule numbers
+        sectionAny, // uint32_t rules without a scope
+        sectionStrings, // bytes
+        sectionMax
+    } Section;
+
+    typedef enum
+    {
+        flagHosted = 1, // scoped by host or domain
+        flagClients = 2, // scoped by client address
+        flagUsers = 4, // scoped by user name
+        flagResponse = 8, // edits responses, see HeaderDirection
+        flagScoped = flagHosted | flagClients | flagUsers
+    } Flag;
+
+    ~RuleIndex();
+
+    // all throw std::runtime_error; Map(fd) takes a descriptor of
+    // ours, and label names it in errors
+    static RuleIndexPointer Map(const std::string &filename);
+    static RuleIndexPointer Map(int fd, const std::string &label);
+    static void Build(const HeaderRuleList &rules, std::vector<unsigned char> &image);
+    static void Write(const HeaderRuleList &rules, const std::string &filename);
+
+    // tells rule lists apart without building them
+    static uint64_t Digest(const HeaderRuleList &rules);
+
+    inline size_t size(void) const { return rule_count; };
+    inline const std::vector<libecap::Name> &names(void) const { return name_list; };
+    inline const IndexRule &rule(unsigned n) const { return rule_table[n]; };
+    inline libecap::Area value(unsigned n) const
+        { return libecap::Area(strings + rule_table[n].value.offset, rule_table[n].value.length); };
+
+    inline bool hasClients(void) const { return section(sectionIntervals).count > 0; };
+    inline bool hasUsers(void) const { return section(sectionUsers).count > 0; };
+    inline bool hostScoped(void) const { return hosted; }; // see UrlMatcher
+    inline size_t pathLength(void) const { return path_length; }; // see UrlMatcher
+
+    // appends base + rule number for every rule that applies
+    void match(const char *host, size_t host_length,
+        const char *path, size_t path_length,
+        const libecap::Area &client, const libecap::Area &user,
+        unsigned base, RuleMatches &matches) const;
+    bool matchesAny(const char *url) const;
+
+    static uint64_t Checksum(const unsigned char *data, size_t size);
+
+protected:
+    RuleIndex();
+
+    void validate(void);
+    inline const IndexSection &section(Section s) const { return header->sections[s]; };
+    template <class T> inline const T *table(Section s) const
+        { return reinterpret_cast<const T *>(data + section(s).offset); };
+
+    // rules the host and path select, before client scopes
+    void select(const char *host, size_t host_length,
+        const char *path, size_t path_length, RuleMatches &rules) const;
+    void addRules(const IndexSection &refs,
+        const char *path, size_t path_length, RuleMatches &rules) const;
+    const IndexKey *findKey(Section s, const char *key, size_t length) const;
+    const IndexInterval *findInterval(const unsigned char *address) const;
+    bool pathMatches(const IndexRule &rule, const char *path, size_t length) const;
+
+    const unsigned char *data;
+    size_t data_size;
+    const IndexHeader *header;
+
+    const IndexRule *rule_table;
+    size_t rule_count;
+    const char *strings;
+    std::vector<libecap::Name> name_list;
+    bool client_only; // some rules are scoped by client alone
+    bool hosted; // some rules are scoped by host or domain
+    size_t path_length;
+
+private:
+    RuleIndex(const RuleIndex &);
+    RuleIndex &operator=(const RuleIndex &);
+};
+
+} // namespace Adapter
+
+#endif // _RULE_INDEX_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
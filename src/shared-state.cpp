@@ -0,0 +1,343 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include <libecap/common/memory.h>
+
+#include <syslog.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "adapter-log.h"
+#include "adapter-stats.h"
+#include "shared-state.h"
+
+#if ATOMIC_LONG_LOCK_FREE != 2 || ATOMIC_LLONG_LOCK_FREE != 2
+#error "shared memory counters need lock-free atomics"
+#endif
+
+// tells apart the SharedState objects of one process
+static std::atomic<uint32_t> last_instance(0);
+
+static void Sleep(void)
+{
+    usleep(1000);
+}
+
+Adapter::SharedState::SharedState(const std::string &name, SharedSegment *segment)
+    : segment_name(name), segment(segment), worker(NULL),
+    owner(((uint64_t)getpid() << 32) | ++last_instance)
+{
+}
+
+// our counters are retired rather than dropped, so that the box-wide
+// totals never go backwards
+Adapter::SharedState::~SharedState()
+{
+    if (worker) {
+        Fold(segment->retired, worker->totals);
+        worker->owner.store(0);
+    }
+    uint64_t dumping = owner;
+    segment->dumper.compare_exchange_strong(dumping, 0);
+
+    munmap(segment, sizeof(SharedSegment));
+}
+
+// NULL if the segment is stale or incompatible; throws on errors
+static Adapter::SharedSegment *Map(const std::string &object, bool &created, struct stat &st)
+{
+    int fd = shm_open(object.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    created = (fd >= 0);
+    if (!created && errno == EEXIST)
+        fd = shm_open(object.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        throw std::runtime_error("Open error: " + object + ": " + strerror(errno));
+
+    // the creator may not have sized it yet
+    memset(&st, 0, sizeof(st));
+    int waited = 0;
+    if (created && ftruncate(fd, sizeof(Adapter::SharedSegment)) < 0) {
+        const int error = errno;
+        close(fd);
+        shm_unlink(object.c_str());
+        throw std::runtime_error("Map error: " + object + ": " + strerror(error));
+    }
+    while (fstat(fd, &st) == 0 && !created &&
+        (size_t)st.st_size < sizeof(Adapter::SharedSegment) && waited++ < SHARED_WAIT) Sleep();
+
+    if (!created && (size_t)st.st_size != sizeof(Adapter::SharedSegment)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, sizeof(Adapter::SharedSegment),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int error = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (created) shm_unlink(object.c_str());
+        throw std::runtime_error("Map error: " + object + ": " + strerror(error));
+    }
+
+    Adapter::SharedSegment *segment = static_cast<Adapter::SharedSegment *>(map);
+    if (created) {
+        memcpy(segment->magic, SHARED_MAGIC, sizeof(segment->magic));
+        segment->version = SHARED_VERSION;
+        segment->size = sizeof(Adapter::SharedSegment);
+        segment->since = time(NULL);
+        segment->ready.store(1);
+    }
+    else {
+        while (!segment->ready.load() && waited++ < SHARED_WAIT) Sleep();
+    }
+
+    if (!segment->ready.load() ||
+        memcmp(segment->magic, SHARED_MAGIC, sizeof(segment->magic)) ||
+        segment->version != SHARED_VERSION || segment->size != sizeof(Adapter::SharedSegment)) {
+        munmap(map, sizeof(Adapter::SharedSegment));
+        return NULL;
+    }
+
+    return segment;
+}
+
+// a crashed creator leaves a segment that never becomes ready, and an
+// upgrade one of an older layout: such a segment is unlinked, unless
+// another worker replaced it meanwhile, and made anew, once.  Workers
+// still attached to it keep it until they exit.
+Adapter::SharedStatePointer Adapter::SharedState::Open(const std::string &name)
+{
+    const std::string object = (name.size() && name[0] == '/') ? name : "/" + name;
+    if (object.size() < 2 || object.find('/', 1) != std::string::npos)
+        throw std::runtime_error("Invalid shared memory name: " + name);
+
+    for (int attempt = 0; ; attempt++) {
+        bool created = false;
+        struct stat seen;
+        SharedSegment *segment = Map(object, created, seen);
+        if (segment) {
+            SharedStatePointer state(new SharedState(object, segment));
+            state->claim();
+
+            ADAPTER_LOG(LOG_DEBUG, "%s: %s: %s, slot %ld", __PRETTY_FUNCTION__,
+                object.c_str(), (created) ? "created" : "attached",
+                (state->worker) ? (long)(state->worker - segment->workers) : -1L);
+            return state;
+        }
+
+        if (attempt)
+            throw std::runtime_error("Incompatible shared memory segment: " + object);
+
+        ADAPTER_LOG(LOG_WARNING, "%s: %s: stale or incompatible, replacing it",
+            __PRETTY_FUNCTION__, object.c_str());
+        int fd = shm_open(object.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 &&
+            st.st_dev == seen.st_dev && st.st_ino == seen.st_ino)
+            shm_unlink(object.c_str());
+        if (fd >= 0) close(fd);
+    }
+}
+
+void Adapter::SharedState::claim(void)
+{
+    for (int i = 0; i < SHARED_WORKERS; i++) {
+        SharedWorker &slot = segment->workers[i];
+        uint64_t previous = slot.owner.load();
+        if (previous && Alive(previous)) continue;
+        if (!slot.owner.compare_exchange_strong(previous, owner)) continue;
+
+        // a worker that died without retiring its counters
+        Fold(segment->retired, slot.totals);
+        worker = &slot;
+        return;
+    }
+
+    ADAPTER_LOG(LOG_WARNING, "%s: %s: all %d worker slots taken",
+        __PRETTY_FUNCTION__, segment_name.c_str(), SHARED_WORKERS);
+}
+
+// a recycled pid passes for its old owner, which only keeps one slot
+// from being reused
+bool Adapter::SharedState::Alive(uint64_t owner)
+{
+    return kill((pid_t)(owner >> 32), 0) == 0 || errno != ESRCH;
+}
+
+// adds from to into and clears it; several processes may fold into
+// the same counters at once, but never from the same ones
+void Adapter::SharedState::Fold(SharedCounters &into, SharedCounters &from)
+{
+    for (int c = 0; c < Stats::counterMax; c++)
+        into.counters[c].fetch_add(from.counters[c].exchange(0));
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+        into.start_time[b].fetch_add(from.start_time[b].exchange(0));
+    into.start_time_total.fetch_add(from.start_time_total.exchange(0));
+
+    const unsigned long peak = from.peak_buffered.exchange(0);
+    unsigned long current = into.peak_buffered.load();
+    while (peak > current && !into.peak_buffered.compare_exchange_weak(current, peak));
+}
+
+void Adapter::SharedState::publish(const Stats::Totals &totals)
+{
+    if (!worker) return;
+
+    SharedCounters &shared = worker->totals;
+    for (int c = 0; c < Stats::counterMax; c++)
+        shared.counters[c].store(totals.counters[c], std::memory_order_relaxed);
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+        shared.start_time[b].store(totals.start_time[b], std::memory_order_relaxed);
+    shared.peak_buffered.store(totals.peak_buffered, std::memory_order_relaxed);
+    shared.start_time_total.store(totals.start_time_total, std::memory_order_relaxed);
+}
+
+// a worker exiting meanwhile may be counted twice, or not at all, for
+// this one snapshot
+void Adapter::SharedState::collect(Stats::Totals &totals) const
+{
+    totals = Stats::Totals();
+    totals.since = segment->since;
+
+    // the counters of dead workers count until their slots are reused
+    const SharedCounters *sources[SHARED_WORKERS + 1] = { &segment->retired };
+    size_t count = 1;
+    for (int i = 0; i < SHARED_WORKERS; i++) {
+        const uint64_t owner = segment->workers[i].owner.load(std::memory_order_relaxed);
+        if (!owner) continue;
+        sources[count++] = &segment->workers[i].totals;
+        if (Alive(owner)) totals.workers++;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const SharedCounters &s = *sources[i];
+        for (int c = 0; c < Stats::counterMax; c++)
+            totals.counters[c] += s.counters[c].load(std::memory_order_relaxed);
+        for (int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+            totals.start_time[b] += s.start_time[b].load(std::memory_order_relaxed);
+        totals.peak_buffered = std::max(totals.peak_buffered,
+            s.peak_buffered.load(std::memory_order_relaxed));
+        totals.start_time_total += s.start_time_total.load(std::memory_order_relaxed);
+    }
+}
+
+// the totals are the same for every worker: the first to ask dumps them
+// for all, until it exits
+bool Adapter::SharedState::dumps(void)
+{
+    uint64_t current = segment->dumper.load();
+    if (current == owner) return true;
+    if (current && Alive(current)) return false;
+    return segment->dumper.compare_exchange_strong(current, owner);
+}
+
+// Workers reloading the same file all find the image of the first one,
+// which builds it while the others wait.  A worker with other rules
+// replaces the image; those still mapping the old one keep it until
+// they let go.
+int Adapter::SharedState::rules(uint64_t digest,
+    const SharedRulesBuilder &builder, std::string &label)
+{
+    int waited = 0;
+    for ( ;; ) {
+        // the generation brackets the digest, like a sequence lock
+        const uint64_t generation = segment->rules_generation.load();
+        const uint64_t published = segment->rules_digest.load();
+        if (generation && published == digest &&
+            segment->rules_generation.load() == generation) {
+            label = rulesName(generation);
+            const int fd = shm_open(label.c_str(), O_RDONLY | O_CLOEXEC, 0);
+            if (fd >= 0) return fd;
+
+            // replaced since, unless it is missing for good
+            if (errno != ENOENT || segment->rules_generation.load() != generation)
+                continue;
+        }
+
+        uint64_t building = segment->rules_builder.load();
+        if (!building || !Alive(building)) {
+            if (!segment->rules_builder.compare_exchange_strong(building, owner))
+                continue;
+
+            try {
+                const int fd = publishRules(digest, builder, label);
+                segment->rules_builder.store(0);
+                return fd;
+            } catch (...) {
+                segment->rules_builder.store(0);
+                throw;
+            }
+        }
+
+        if (waited++ >= SHARED_WAIT) {
+            throw std::runtime_error("Timed out waiting for worker " +
+                std::to_string((unsigned long)(building >> 32)) + " to publish rules");
+        }
+        Sleep();
+    }
+}
+
+int Adapter::SharedState::publishRules(uint64_t digest,
+    const SharedRulesBuilder &builder, std::string &label)
+{
+    std::vector<unsigned char> image;
+    builder.build(image);
+
+    const uint64_t generation = ++segment->rules_serial;
+    label = rulesName(generation);
+
+    // a leftover of a builder that died
+    shm_unlink(label.c_str());
+    const int fd = shm_open(label.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        throw std::runtime_error("Open error: " + label + ": " + strerror(errno));
+
+    size_t written = 0;
+    while (written < image.size()) {
+        const ssize_t n = write(fd, &image[written], image.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            const int error = (n < 0) ? errno : ENOSPC;
+            close(fd);
+            shm_unlink(label.c_str());
+            throw std::runtime_error("Write error: " + label + ": " + strerror(error));
+        }
+        written += n;
+    }
+
+    const uint64_t previous = segment->rules_generation.load();
+    segment->rules_generation.store(0);
+    segment->rules_digest.store(digest);
+    segment->rules_generation.store(generation);
+    if (previous) shm_unlink(rulesName(previous).c_str());
+
+    ADAPTER_LOG(LOG_INFO, "%s: %s: %lu bytes", __PRETTY_FUNCTION__,
+        label.c_str(), (unsigned long)image.size());
+
+    return fd;
+}
+
+std::string Adapter::SharedState::rulesName(uint64_t generation) const
+{
+    std::ostringstream os;
+    os << segment_name << ".rules." << generation;
+    return os.str();
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
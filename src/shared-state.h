@@ -0,0 +1,116 @@
+#ifndef _SHARED_STATE_H
+#define _SHARED_STATE_H
+
+// Shared memory segment identification
+#define SHARED_MAGIC            "CECAPSH"
+#define SHARED_VERSION          3
+
+// Worker processes that can publish statistics at once; more still
+// work, their counters are just not added up
+#define SHARED_WORKERS          256
+
+// How long to wait for another worker to set up the segment, or to
+// publish its rules, in milliseconds
+#define SHARED_WAIT             5000
+
+namespace Adapter
+{
+
+// Counters as one worker published them, see Stats::Totals
+class SharedCounters
+{
+public:
+    std::atomic<unsigned long> counters[Stats::counterMax];
+    std::atomic<unsigned long> peak_buffered;
+    std::atomic<unsigned long> start_time[STATS_LATENCY_BUCKETS];
+    std::atomic<unsigned long> start_time_total;
+};
+
+class SharedWorker
+{
+public:
+    std::atomic<uint64_t> owner; // pid << 32 | instance, 0 when free
+    SharedCounters totals;
+};
+
+// The segment layout.  It is zero-filled on creation and only ever
+// accessed through lock-free atomics, which work across processes.
+class SharedSegment
+{
+public:
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    time_t since;
+    std::atomic<uint32_t> ready; // the above is filled in
+
+    // rules_generation is 0 while the other two change
+    std::atomic<uint64_t> rules_generation; // names the rule image object
+    std::atomic<uint64_t> rules_digest; // of the rules in it
+    std::atomic<uint64_t> rules_builder; // owner publishing rules, or 0
+    uint64_t rules_serial; // last generation; the builder's only
+
+    std::atomic<uint64_t> dumper; // owner dumping the statistics, or 0
+
+    SharedCounters retired; // of workers that are gone
+    SharedWorker workers[SHARED_WORKERS];
+};
+
+// Builds the rule image for SharedState::rules(), when it has to
+class SharedRulesBuilder
+{
+public:
+    virtual ~SharedRulesBuilder() { };
+    virtual void build(std::vector<unsigned char> &image) const = 0;
+};
+
+// A POSIX shared memory segment that the worker processes of one box
+// attach to: the first one creates it and it outlives them all, unless
+// a later one finds it stale or of another version and replaces it.
+// Each worker publishes its counters to a slot of its own, and one
+// compiled copy of the rules is kept in a separate object for all to
+// map.
+class SharedState
+{
+public:
+    ~SharedState();
+
+    // throws std::runtime_error
+    static libecap::shared_ptr<SharedState> Open(const std::string &name);
+
+    inline const std::string &name(void) const { return segment_name; };
+
+    // ours, to be added up by every worker's collect()
+    void publish(const Stats::Totals &totals);
+    void collect(Stats::Totals &totals) const;
+    // true for the one worker that dumps the box-wide totals
+    bool dumps(void);
+
+    // a read-only descriptor of the image of the rules with digest,
+    // built by builder unless another worker already published it;
+    // label names the object.  Throws std::runtime_error.
+    int rules(uint64_t digest, const SharedRulesBuilder &builder, std::string &label);
+
+protected:
+    SharedState(const std::string &name, SharedSegment *segment);
+
+    void claim(void); // a free worker slot, or one of a dead process
+    int publishRules(uint64_t digest, const SharedRulesBuilder &builder, std::string &label);
+    std::string rulesName(uint64_t generation) const;
+
+    static bool Alive(uint64_t owner);
+    static void Fold(SharedCounters &into, SharedCounters &from);
+
+    const std::string segment_name;
+    SharedSegment *segment;
+    SharedWorker *worker; // ours, NULL if every slot is taken
+    uint64_t owner;
+};
+
+typedef libecap::shared_ptr<SharedState> SharedStatePointer;
+
+} // namespace Adapter
+
+#endif // _SHARED_STATE_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
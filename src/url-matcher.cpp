@@ -0,0 +1,257 @@
+#ifdef HAVE_CONFIG_H
+#include "autoconf.h"
+#endif
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <new>
+
+#include <string.h>
+#include <ctype.h>
+
+#include "pool.h"
+#include "ascii-case.h"
+#include "url-matcher.h"
+
+// Longest host name we look up, per RFC 1035
+#define MAX_HOST_LENGTH         255
+
+namespace
+{
+
+bool LabelLess(const Adapter::DomainNode *node, const std::pair<const char *, size_t> &key)
+{
+    return node->label.compare(0, std::string::npos, key.first, key.second) < 0;
+}
+
+// by labels, so that the trie is built in order; then by rule
+bool ScopeLess(const Adapter::DomainScope &a, const Adapter::DomainScope &b)
+{
+    if (a.labels != b.labels) return a.labels < b.labels;
+    return a.rule < b.rule;
+}
+
+std::string Lowercase(const std::string &text)
+{
+    std::string result(text);
+    Adapter::AsciiCase::Lower(&result[0], result.data(), result.size());
+    return result;
+}
+
+} // namespace
+
+Adapter::DomainNode::~DomainNode()
+{
+    for (std::vector<DomainNode *>::iterator i = children.begin(); i != children.end(); i++)
+        delete (*i);
+}
+
+Adapter::DomainNode *Adapter::DomainNode::find(const char *label, size_t length) const
+{
+    const std::pair<const char *, size_t> key(label, length);
+    std::vector<DomainNode *>::const_iterator i;
+    i = std::lower_bound(children.begin(), children.end(), key, LabelLess);
+    if (i == children.end() || (*i)->label.compare(0, std::string::npos, label, length))
+        return NULL;
+    return (*i);
+}
+
+// labels arrive in sorted order (see UrlMatcher::compile()), so the
+// label is either the last child or a new one
+Adapter::DomainNode *Adapter::DomainNode::insert(const std::string &label)
+{
+    if (children.size() && children.back()->label == label)
+        return children.back();
+
+    children.push_back(new DomainNode(label));
+    return children.back();
+}
+
+Adapter::UrlMatcher::UrlMatcher()
+    : root(""), is_scoped(false), client_only(false), hosted(false), path_length(0) { }
+
+Adapter::UrlMatcher::~UrlMatcher() { }
+
+void Adapter::UrlMatcher::add(unsigned rule,
+    const std::vector<std::string> &hosts,
+    const std::vector<std::string> &domains,
+    const std::vector<std::string> &paths, bool client_scoped)
+{
+    if (rule_paths.size() <= rule) rule_paths.resize(rule + 1);
+    rule_paths[rule] = paths;
+    if (paths.size()) is_scoped = true;
+    for (size_t i = 0; i < paths.size(); i++)
+        path_length = std::max(path_length, paths[i].size());
+
+    if (!hosts.size() && !domains.size()) {
+        if (client_scoped) client_only = true;
+        else any_host.push_back(rule);
+        return;
+    }
+
+    is_scoped = true;
+    hosted = true;
+    for (int pass = 0; pass < 2; pass++) {
+        const std::vector<std::string> &names = (pass) ? domains : hosts;
+        for (std::vector<std::string>::const_iterator i = names.begin(); i != names.end(); i++) {
+            std::string name = Lowercase(*i);
+            while (name.size() && name[name.size() - 1] == '.')
+                name.erase(name.size() - 1);
+            if (!name.size()) continue;
+
+            DomainScope scope;
+            scope.rule = rule;
+            scope.subtree = pass;
+            size_t end = name.size();
+            while (end > 0) {
+                size_t dot = name.rfind('.', end - 1);
+                size_t start = (dot == std::string::npos) ? 0 : dot + 1;
+                if (scope.labels.size()) scope.labels += '\0';
+                scope.labels.append(name, start, end - start);
+                end = (dot == std::string::npos) ? 0 : dot;
+            }
+            pending.push_back(scope);
+        }
+    }
+}
+
+// sorted scopes build the trie in one pass, without searching children:
+// a NUL sorts before any label character, so each node's children come
+// in label order, and the scopes below a node come together
+void Adapter::UrlMatcher::compile(void)
+{
+    std::sort(pending.begin(), pending.end(), ScopeLess);
+
+    for (std::vector<DomainScope>::const_iterator i = pending.begin(); i != pending.end(); i++) {
+        DomainNode *node = &root;
+        size_t start = 0;
+        while (start <= i->labels.size()) {
+            size_t end = i->labels.find('\0', start);
+            if (end == std::string::npos) end = i->labels.size();
+            node = node->insert(i->labels.substr(start, end - start));
+            start = end + 1;
+        }
+
+        if (i->subtree) node->subtree.push_back(i->rule);
+        else node->exact.push_back(i->rule);
+    }
+
+    std::vector<DomainScope>().swap(pending);
+}
+
+bool Adapter::UrlMatcher::pathMatches(unsigned rule, const char *path, size_t length) const
+{
+    const std::vector<std::string> &prefixes = rule_paths[rule];
+    if (!prefixes.size()) return true;
+
+    for (std::vector<std::string>::const_iterator i = prefixes.begin(); i != prefixes.end(); i++) {
+        if (i->size() <= length && !memcmp(i->data(), path, i->size()))
+            return true;
+    }
+
+    return false;
+}
+
+void Adapter::UrlMatcher::match(const char *host, size_t host_length,
+    const char *path, size_t path_length, RuleMatches &matches) const
+{
+    matches.clear();
+
+    for (std::vector<unsigned>::const_iterator i = any_host.begin(); i != any_host.end(); i++)
+        if (pathMatches(*i, path, path_length)) matches.push_back(*i);
+
+    while (host_length && host[host_length - 1] == '.') host_length--;
+    if (!host_length || host_length > MAX_HOST_LENGTH || !root.children.size())
+        return;
+
+    char name[MAX_HOST_LENGTH];
+    AsciiCase::Lower(name, host, host_length);
+
+    const size_t matched = matches.size();
+    const DomainNode *node = &root;
+    size_t end = host_length;
+    while (end > 0) {
+        const char *dot = (const char *)memrchr(name, '.', end);
+        size_t start = (dot) ? dot - name + 1 : 0;
+        node = node->find(name + start, end - start);
+        if (!node) break;
+
+        for (std::vector<unsigned>::const_iterator i = node->subtree.begin(); i != node->subtree.end(); i++)
+            if (pathMatches(*i, path, path_length)) matches.push_back(*i);
+
+        end = (dot) ? start - 1 : 0;
+        if (end) continue;
+
+        for (std::vector<unsigned>::const_iterator i = node->exact.begin(); i != node->exact.end(); i++)
+            if (pathMatches(*i, path, path_length)) matches.push_back(*i);
+    }
+
+    // rules are applied in configuration order, once each
+    if (matches.size() != matched) {
+        std::sort(matches.begin(), matches.end());
+        matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+    }
+}
+
+// the client is not known yet, so client scoped rules always might match;
+// Squid passes wantsUrl() the path alone, and without a host any host
+// scoped rule might match too
+bool Adapter::UrlMatcher::matchesAny(const char *url) const
+{
+    if (client_only) return true;
+    if (!is_scoped) return any_host.size() > 0;
+
+    const char *host, *path;
+    size_t host_length, path_length;
+    SplitUrl(url, strlen(url), host, host_length, path, path_length);
+    if (hosted && !host_length) return true;
+
+    RuleMatches matches;
+    match(host, host_length, path, path_length, matches);
+    return matches.size() > 0;
+}
+
+void Adapter::UrlMatcher::SplitUrl(const char *url, size_t length,
+    const char *&host, size_t &host_length,
+    const char *&path, size_t &path_length)
+{
+    const char *end = url + length;
+
+    host = url;
+    host_length = 0;
+    path = url;
+    path_length = length;
+
+    if (!length || url[0] == '/') return; // origin-form, the host is elsewhere
+
+    const char *p = url;
+    const char *scheme = (const char *)memchr(url, ':', length);
+    if (scheme && scheme + 2 < end && scheme[1] == '/' && scheme[2] == '/')
+        p = scheme + 3;
+
+    // authority runs up to the path or query
+    const char *authority_end = p;
+    while (authority_end < end && *authority_end != '/' && *authority_end != '?')
+        authority_end++;
+
+    const char *at = (const char *)memrchr(p, '@', authority_end - p);
+    if (at) p = at + 1;
+
+    host = p;
+    if (p < authority_end && *p == '[') {
+        // IPv6 literal
+        const char *bracket = (const char *)memchr(p, ']', authority_end - p);
+        host = p + 1;
+        host_length = (bracket) ? bracket - host : authority_end - host;
+    } else {
+        const char *colon = (const char *)memchr(p, ':', authority_end - p);
+        host_length = ((colon) ? colon : authority_end) - p;
+    }
+
+    path = authority_end;
+    path_length = end - authority_end;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
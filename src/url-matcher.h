@@ -0,0 +1,91 @@
+#ifndef _URL_MATCHER_H
+#define _URL_MATCHER_H
+
+namespace Adapter
+{
+
+// Rule numbers matching a request, in ascending order
+typedef std::vector<unsigned, PoolAllocator<unsigned> > RuleMatches;
+
+// One label of a reversed host name ("com" -> "youtube" -> "www")
+class DomainNode
+{
+public:
+    DomainNode(const std::string &label) : label(label) { };
+    ~DomainNode();
+
+    DomainNode *find(const char *label, size_t length) const;
+    DomainNode *insert(const std::string &label);
+
+    std::string label;
+    std::vector<DomainNode *> children; // sorted by label
+    std::vector<unsigned> exact; // rules for exactly this host name
+    std::vector<unsigned> subtree; // rules for this domain and below
+};
+
+// A host scope waiting for UrlMatcher::compile()
+class DomainScope
+{
+public:
+    std::string labels; // reversed, NUL separated: "com\0youtube\0www"
+    unsigned rule;
+    bool subtree; // a domain rather than an exact host
+};
+
+// Compiled host/domain/path scopes of the configured rules.  Host names
+// live in a trie of reversed labels, so a lookup costs one step per
+// label no matter how many domains are configured; path prefixes are
+// then checked against the (few) rules the host selected.
+class UrlMatcher
+{
+public:
+    UrlMatcher();
+    ~UrlMatcher();
+
+    // hosts match exactly, domains also match their subdomains and
+    // paths are prefixes; a rule without hosts or domains matches any
+    // host, unless it is client scoped: ClientMatcher finds those
+    void add(unsigned rule,
+        const std::vector<std::string> &hosts,
+        const std::vector<std::string> &domains,
+        const std::vector<std::string> &paths,
+        bool client_scoped = false);
+    void compile(void);
+
+    // false when every rule matches every URL
+    inline bool scoped(void) const { return is_scoped; };
+    // true when some rule is scoped by host or domain
+    inline bool hostScoped(void) const { return hosted; };
+    // the longest path prefix; longer paths match like their first bytes
+    inline size_t pathLength(void) const { return path_length; };
+
+    void match(const char *host, size_t host_length,
+        const char *path, size_t path_length, RuleMatches &matches) const;
+    bool matchesAny(const char *url) const;
+    bool pathMatches(unsigned rule, const char *path, size_t length) const;
+
+    // splits an absolute or origin-form URI; host is empty for the latter
+    static void SplitUrl(const char *url, size_t length,
+        const char *&host, size_t &host_length,
+        const char *&path, size_t &path_length);
+
+protected:
+    DomainNode root;
+    std::vector<DomainScope> pending; // host scopes, until compile()
+    std::vector<unsigned> any_host; // rules without a host scope
+    std::vector<std::vector<std::string> > rule_paths; // per rule
+    bool is_scoped;
+    bool client_only; // some rules are scoped by client alone
+    bool hosted; // some rules are scoped by host or domain
+    size_t path_length;
+
+private:
+    UrlMatcher(const UrlMatcher &);
+    UrlMatcher &operator=(const UrlMatcher &);
+};
+
+} // namespace Adapter
+
+#endif // _URL_MATCHER_H
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4